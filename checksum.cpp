@@ -0,0 +1,281 @@
+#include "checksum.hpp"
+#include "metrics.hpp"
+#include "spool.hpp"
+
+#include <cpuid.h>
+#include <endian.h>
+#include <nmmintrin.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+#define CRC32C_POLY 0x82f63b78  // reversed
+#define LANE_LONG 8192  // bytes per lane of the three-way crc32 loop...
+#define LANE_SHORT 256  // ...and of the one that mops up after it
+
+namespace {
+/* GF(2) 32x32 matrices, one word per column, acting on a CRC register */
+uint32_t matrix_times(const uint32_t* mat, uint32_t vec) {
+  uint32_t sum = 0;
+  for (; vec != 0; vec >>= 1, mat++) {
+    if (vec & 1) {
+      sum ^= *mat;
+    }
+  }
+  return sum;
+}
+
+void matrix_square(uint32_t* square, const uint32_t* mat) {
+  for (int n = 0; n < 32; n++) {
+    square[n] = matrix_times(mat, mat[n]);
+  }
+}
+
+/* fills zeros[k][b] with what feeding len zero bytes does to a register
+ * holding b << 8k; len must be a power of two */
+void zeros_table(uint32_t zeros[4][256], size_t len) {
+  uint32_t odd[32], even[32];
+  odd[0] = CRC32C_POLY;  // one zero bit
+  for (int n = 1; n < 32; n++) {
+    odd[n] = 1u << (n - 1);
+  }
+  matrix_square(even, odd);  // two
+  matrix_square(odd, even);  // four
+  uint32_t* op = odd;
+  do {
+    matrix_square(even, odd);  // eight, then 32, 128, ...
+    op = even;
+    len >>= 1;
+    if (len == 0) {
+      break;
+    }
+    matrix_square(odd, even);  // 16, 64, ...
+    op = odd;
+    len >>= 1;
+  } while (len != 0);
+
+  for (uint32_t b = 0; b < 256; b++) {
+    for (int k = 0; k < 4; k++) {
+      zeros[k][b] = matrix_times(op, b << (8 * k));
+    }
+  }
+}
+
+struct Tables {
+  Tables() {
+    for (uint32_t b = 0; b < 256; b++) {
+      uint32_t crc = b;
+      for (int i = 0; i < 8; i++) {
+        crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+      }
+      table[0][b] = crc;
+    }
+    for (uint32_t b = 0; b < 256; b++) {
+      for (int k = 1; k < 8; k++) {
+        uint32_t prev = table[k - 1][b];
+        table[k][b] = (prev >> 8) ^ table[0][prev & 0xff];
+      }
+    }
+    zeros_table(long_zeros, LANE_LONG);
+    zeros_table(short_zeros, LANE_SHORT);
+  }
+
+  /* slicing-by-8: table[k][b] is the CRC of byte b followed by k zero
+   * bytes, so eight bytes are folded in with eight lookups and no
+   * dependency chain between them */
+  uint32_t table[8][256];
+
+  /* moves a lane's CRC past the LANE_LONG (or LANE_SHORT) bytes after it */
+  uint32_t long_zeros[4][256];
+  uint32_t short_zeros[4][256];
+};
+const Tables tables;
+}  // namespace
+
+static uint32_t crc32c_portable(uint32_t crc, const unsigned char* p,
+                                size_t len) {
+  const uint32_t(*t)[256] = tables.table;
+  while (len >= 8) {
+    uint32_t lo, hi;
+    memcpy(&lo, p, 4);
+    memcpy(&hi, p + 4, 4);
+    lo = le32toh(lo) ^ crc;
+    hi = le32toh(hi);
+    crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^
+          t[4][lo >> 24] ^ t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^
+          t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+    p += 8;
+    len -= 8;
+  }
+  while (len-- > 0) {
+    crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+  }
+  return crc;
+}
+
+static uint32_t shift(const uint32_t zeros[4][256], uint32_t crc) {
+  return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^
+         zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+/* crc32 takes three cycles to produce its result but can start one every
+ * cycle, so one dependency chain leaves it idle two thirds of the time.
+ * Instead the data is cut into three lanes, each CRCed on its own, and the
+ * lanes' CRCs are then put together with the zeros tables (after Mark
+ * Adler's crc32c.c). */
+template <size_t lane>
+__attribute__((target("sse4.2"))) static uint64_t crc32c_lanes(
+    uint64_t c, const unsigned char*& p, size_t& len,
+    const uint32_t zeros[4][256]) {
+  while (len >= 3 * lane) {
+    uint64_t c1 = 0, c2 = 0;
+    for (size_t i = 0; i < lane; i += 8) {
+      uint64_t w0, w1, w2;
+      memcpy(&w0, p + i, 8);
+      memcpy(&w1, p + lane + i, 8);
+      memcpy(&w2, p + 2 * lane + i, 8);
+      c = _mm_crc32_u64(c, w0);
+      c1 = _mm_crc32_u64(c1, w1);
+      c2 = _mm_crc32_u64(c2, w2);
+    }
+    c = shift(zeros, c) ^ c1;
+    c = shift(zeros, c) ^ c2;
+    p += 3 * lane;
+    len -= 3 * lane;
+  }
+  return c;
+}
+
+__attribute__((target("sse4.2"))) static uint32_t crc32c_sse42(
+    uint32_t crc, const unsigned char* p, size_t len) {
+  uint64_t c = crc;
+  c = crc32c_lanes<LANE_LONG>(c, p, len, tables.long_zeros);
+  c = crc32c_lanes<LANE_SHORT>(c, p, len, tables.short_zeros);
+  while (len >= 8) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    c = _mm_crc32_u64(c, word);
+    p += 8;
+    len -= 8;
+  }
+  while (len-- > 0) {
+    c = _mm_crc32_u8(c, *p++);
+  }
+  return c;
+}
+
+static bool have_sse42() {
+  static const bool have = [] {
+    unsigned eax, ebx, ecx, edx;
+    return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2);
+  }();
+  return have;
+}
+
+static bool sse42_wanted = true;
+
+bool crc32c_accelerated() {
+  return sse42_wanted && have_sse42();
+}
+
+void crc32c_accelerate(bool on) {
+  sse42_wanted = on;
+}
+
+uint32_t crc32c(uint32_t crc, const char* data, size_t len) {
+  const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+  crc = ~crc;
+  if (crc32c_accelerated()) {
+    crc = crc32c_sse42(crc, p, len);
+  } else {
+    crc = crc32c_portable(crc, p, len);
+  }
+  return ~crc;
+}
+
+uint32_t crc32c_file(const FileDescriptor& file) {
+  std::vector<char> buf(65536);
+  uint32_t crc = 0;
+  off_t offset = 0;
+  ssize_t n;
+
+  while ((n = pread(file.raw(), buf.data(), buf.size(), offset)) != 0) {
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error{"pread(): " + std::string{strerror(errno)}};
+    }
+    crc = crc32c(crc, buf.data(), n);
+    offset += n;
+  }
+  return crc;
+}
+
+void Digest::expect(uint64_t length) {
+  on = true;
+  checked = true;
+  left = length;
+}
+
+size_t Digest::feed(const char* data, size_t len) {
+  if (!on) {
+    return len;
+  }
+
+  size_t n = len;
+  if (checked) {
+    n = std::min<uint64_t>(len, left);
+    left -= n;
+    size_t extra = len - n;
+    if (extra > CHECK_TRAILER - fill) {
+      throw std::runtime_error{"client sent more than its checked upload"};
+    }
+    memcpy(trailer + fill, data + n, extra);
+    fill += extra;
+  }
+  crc = crc32c(crc, data, n);
+  bytes += n;
+  return n;
+}
+
+static std::string hex32(uint32_t value) {
+  char buf[9];
+  snprintf(buf, sizeof(buf), "%08x", value);
+  return buf;
+}
+
+void Digest::seal(const FileDescriptor& dir, const std::string& name,
+                  int id) {
+  if (!on) {
+    return;
+  }
+
+  std::string line = "crc32c " + hex32(crc) + " " + std::to_string(bytes);
+  if (checked) {
+    uint32_t theirs = 0;
+    bool whole = left == 0 && fill == CHECK_TRAILER;
+    if (whole) {
+      memcpy(&theirs, trailer, sizeof(theirs));
+      theirs = be32toh(theirs);
+    }
+    if (whole && theirs == crc) {
+      line += " ok";
+    } else {
+      line += " mismatch client=" + (whole ? hex32(theirs) : "none");
+      std::cerr << "ERROR: connection " << id << ": checksum mismatch"
+                << std::endl;
+      thread_metrics().checksum_mismatches.add();
+    }
+  }
+
+  Spool sidecar{dir, name + DIGEST_SUFFIX};
+  sidecar.file().write_all(line + "\n");
+  sidecar.publish();
+}
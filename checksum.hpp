@@ -0,0 +1,66 @@
+#ifndef CHECKSUM_HPP
+#define CHECKSUM_HPP
+
+#include "file.hpp"
+#include "frames.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#define DIGEST_SUFFIX ".crc32c"  // the sidecar of <id>.file
+
+/* CRC32C (Castagnoli) of data, carrying on from crc (0 to start). Uses the
+ * SSE4.2 crc32 instruction, eight bytes at a time, where the CPU has it and
+ * a table-driven loop everywhere else; both give the same answer. */
+uint32_t crc32c(uint32_t crc, const char* data, size_t len);
+
+/* whether crc32c() uses the crc32 instruction; on by default where the CPU
+ * has it. Turning it off sends everything through the tables, so
+ * test/crc32c can check them on any machine. */
+bool crc32c_accelerated();
+void crc32c_accelerate(bool on);
+
+/* the CRC32C of a whole file, read without moving its offset */
+uint32_t crc32c_file(const FileDescriptor& file);
+
+/* An upload's CRC32C, computed over the data as it's received so nothing
+ * has to read the file back to vouch for it. When the upload is over, seal()
+ * leaves a sidecar, <id>.file.crc32c, next to the file:
+ *
+ *   crc32c <hex digest> <bytes> [ok | mismatch client=<hex digest>|none]
+ *
+ * The last field is only there for a checked upload (see frames.hpp), whose
+ * client sent its own digest to compare with; "none" means it never arrived.
+ * A mismatch doesn't keep the file from being published, but it's reported
+ * on stderr and counted in the metrics. */
+class Digest {
+ public:
+  Digest()
+      : on(false), checked(false), crc(0), bytes(0), left(0), fill(0) {}
+
+  void start() { on = true; }
+  bool active() const { return on; }
+
+  /* a checked upload: length bytes of data come first, then the trailer */
+  void expect(uint64_t length);
+
+  /* takes in len received bytes and returns how many of them, from the
+   * start, are the upload's data; whatever follows is the client's digest.
+   * Throws if the client sends more than it said it would. */
+  size_t feed(const char* data, size_t len);
+
+  /* writes the sidecar for file name in dir, before the file is published */
+  void seal(const FileDescriptor& dir, const std::string& name, int id);
+
+ private:
+  bool on;
+  bool checked;
+  uint32_t crc;
+  uint64_t bytes;  // of data, so far
+  uint64_t left;   // checked: data still to come
+  char trailer[CHECK_TRAILER];
+  size_t fill;     // ...and how much of the trailer has arrived
+};
+
+#endif // CHECKSUM_HPP
@@ -4,12 +4,51 @@
  *
  *
  * USAGE
- *   ./client <HOSTNAME-OR-IP> <PORT> <FILENAME>
+ *   ./client [-m sendfile|zerocopy|copy|pipeline] [-n STREAMS] [-r]
+ *            [-u UPLOAD-ID] [-c] [-v] <HOSTNAME-OR-IP> <PORT> <FILENAME>
+ *   ./client -b [-j CONNECTIONS] [-m ...] [-c] [-v] <HOSTNAME-OR-IP> <PORT>
+ *            <FILENAME|DIRECTORY|->...
+ *   ./client -g UPLOAD-ID [-o OFFSET] [-l LENGTH] [-v] <HOSTNAME-OR-IP> <PORT>
+ *            <FILENAME>
  *
  * hostname-or-ip:  hostname or IP address of the server to connect
  * port:            port number of the server to connect
  * filename:        name of the file to transfer to the server after the
  *                  connection is established
+ * -m:              how the file is pushed into the socket; "sendfile" (the
+ *                  default) lets the kernel do it, "zerocopy" sends an mmap
+ *                  of the file with MSG_ZEROCOPY, "copy" reads and sends
+ *                  4K at a time, "pipeline" reads ahead on a thread of its
+ *                  own in chunks that grow with the send rate, for files
+ *                  on slow or network file systems; not with -n, -r or -g
+ * -n:              split the file into this many ranges and send each over a
+ *                  connection of its own, in parallel, for the server to put
+ *                  back together (see frames.hpp); ranges always go by
+ *                  sendfile. The default, 1, sends the file as plain bytes
+ * -r:              resumable upload: ask the server how much of this upload
+ *                  it already holds and send only the rest, reconnecting
+ *                  and carrying on (up to 5 times) if the connection fails
+ * -u:              the upload ID to resume, with -r; by default it's derived
+ *                  from the file's identity, size and modification time, so
+ *                  running the same command again picks up where it stopped
+ * -c:              checked upload: announce the file's size, then follow it
+ *                  with its CRC32C for the server to compare with the one it
+ *                  computes (see checksum.hpp); plain uploads only
+ * -b:              batch: send every file named, each as an upload of its
+ *                  own over a connection of its own; a directory stands for
+ *                  the regular files directly in it and "-" for a list of
+ *                  paths on standard input. Each file's outcome is printed
+ *                  on standard output ("ok <path>" or "failed <path>: ..."),
+ *                  progress on standard error, and the exit code is nonzero
+ *                  if any file failed
+ * -j:              how many of a batch's files are sent at once (default 8)
+ * -g:              fetch instead of sending: the server sends back the file
+ *                  it stored for the connection with this ID (the number in
+ *                  its name), which is written to FILENAME
+ * -o, -l:          fetch only LENGTH bytes of it from OFFSET on; by default
+ *                  from the start, and to the end
+ * -v:              print the bytes sent, the system calls it took and the
+ *                  CPU time used on standard output
  *
  *
  * REQUIREMENTS
@@ -33,25 +72,568 @@
  *     an error string starting with 'ERROR:' to standard error, and exit with
  *     non-zero code
  */
+#include "checksum.hpp"
 #include "file.hpp"
+#include "frames.hpp"
+#include "ring.hpp"
 #include "socket.hpp"
 
+#include <dirent.h>
+#include <endian.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
 #include <iostream>
+#include <mutex>
+#include <random>
 #include <string>
+#include <thread>
+#include <vector>
+
+#define RESUME_ATTEMPTS 5  // connections a resumable upload may take
+#define RESUME_PAUSE 1     // seconds between them
+#define BATCH_JOBS 8       // files a batch sends at once, by default
+#define BATCH_PROGRESS 1   // seconds between a batch's progress lines
+
+static std::string usage =
+    " [-m sendfile|zerocopy|copy|pipeline] [-n STREAMS] [-r [-u UPLOAD-ID]]"
+    " [-c] [-b [-j CONNECTIONS]] [-g UPLOAD-ID [-o OFFSET] [-l LENGTH]] [-v]"
+    " <HOSTNAME-OR-IP> <PORT> <FILENAME>...";
+
+enum class Method { SENDFILE, ZEROCOPY, COPY, PIPELINE };
+
+static double cpu_ms(const struct timeval& tv) {
+  return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+/* Sends the file as 'streams' ranges over as many connections at once, each
+ * led by a FrameHeader; throws the first stream's error once all are done */
+static void send_streams(const char* host, const char* port,
+                                const char* path, size_t streams,
+                                TransferStats& stats) {
+  FileDescriptor file = FileDescriptor::open_r(path);
+  struct stat st;
+  if (stat(path, &st) == -1) {
+    throw std::runtime_error{"stat(): " + std::string{strerror(errno)}};
+  }
+
+  uint64_t total = st.st_size;
+  uint64_t upload = std::random_device{}();
+  upload = upload << 32 | std::random_device{}();
+
+  std::vector<std::string> errors(streams);
+  std::vector<TransferStats> sent(streams);
+  std::vector<std::thread> threads;
+
+  for (size_t i = 0; i < streams; i++) {
+    threads.emplace_back([&, i] {
+      FrameHeader header;
+      header.upload = upload;
+      header.offset = total * i / streams;
+      header.length = total * (i + 1) / streams - header.offset;
+      header.total = total;
+
+      try {
+        ConnectedSocket sock{host, port};
+        char head[FRAME_HEADER];
+        header.encode(head);
+        sent[i].syscalls += sock.send_all(head, sizeof(head));
+        file.send_range(sock, header.offset, header.length, sent[i]);
+      } catch (std::runtime_error& e) {
+        errors[i] = e.what();
+      }
+    });
+  }
+
+  for (size_t i = 0; i < streams; i++) {
+    threads[i].join();
+    stats.bytes += sent[i].bytes;
+    stats.syscalls += sent[i].syscalls;
+  }
+  for (std::string& error : errors) {
+    if (!error.empty()) {
+      throw std::runtime_error{error};
+    }
+  }
+}
+
+/* leads a checked upload: the server takes the file to be this long and
+ * what follows it to be its digest */
+static void send_check_header(ConnectedSocket& sock, const char* path,
+                              TransferStats& stats) {
+  struct stat st;
+  if (stat(path, &st) == -1) {
+    throw std::runtime_error{"stat(): " + std::string{strerror(errno)}};
+  }
+
+  FrameHeader header;
+  header.length = st.st_size;
+  header.total = st.st_size;
+  header.check = true;
+  char head[FRAME_HEADER];
+  header.encode(head);
+  stats.syscalls += sock.send_all(head, sizeof(head));
+}
+
+/* FNV-1a over what identifies this version of the file */
+static uint64_t upload_id(const struct stat& st) {
+  uint64_t fields[] = {static_cast<uint64_t>(st.st_dev),
+                       static_cast<uint64_t>(st.st_ino),
+                       static_cast<uint64_t>(st.st_size),
+                       static_cast<uint64_t>(st.st_mtim.tv_sec),
+                       static_cast<uint64_t>(st.st_mtim.tv_nsec)};
+  const unsigned char* bytes = reinterpret_cast<const unsigned char*>(fields);
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < sizeof(fields); i++) {
+    hash = (hash ^ bytes[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+/* Sends the file as a resumable upload: the server says how much of it it
+ * already has and only the rest goes out. A connection that fails is
+ * followed by another, up to RESUME_ATTEMPTS of them. */
+static void send_resumable(const char* host, const char* port,
+                           const char* path, uint64_t upload, bool given,
+                           TransferStats& stats) {
+  FileDescriptor file = FileDescriptor::open_r(path);
+  struct stat st;
+  if (stat(path, &st) == -1) {
+    throw std::runtime_error{"stat(): " + std::string{strerror(errno)}};
+  }
+
+  FrameHeader header;
+  header.upload = given ? upload : upload_id(st);
+  header.length = st.st_size;
+  header.total = st.st_size;
+  header.resume = true;
+
+  for (int attempt = 1;; attempt++) {
+    std::string error;
+    try {
+      ConnectedSocket sock{host, port};
+      char head[FRAME_HEADER];
+      header.encode(head);
+      stats.syscalls += sock.send_all(head, sizeof(head));
+
+      sock.set_recv_timeout();
+      std::string reply;
+      while (reply.size() < RESUME_REPLY) {
+        reply += sock.recv();
+      }
+      uint64_t offset;
+      memcpy(&offset, reply.data(), sizeof(offset));
+      offset = be64toh(offset);
+      if (offset > header.total || reply.size() != RESUME_REPLY) {
+        throw std::runtime_error{"bad reply to a resumable upload"};
+      }
+
+      file.send_range(sock, offset, header.total - offset, stats);
+      return;
+
+    } catch (socket_closed_exception& e) {
+      error = "connection closed by the server";
+    } catch (std::runtime_error& e) {
+      error = e.what();
+    }
+
+    if (attempt == RESUME_ATTEMPTS) {
+      throw std::runtime_error{error};
+    }
+    std::cerr << "WARNING: " << error << "; resuming" << std::endl;
+    sleep(RESUME_PAUSE);
+  }
+}
+
+/* Sends one file over a connection of its own, as plain bytes by the given
+ * method, led by a check header and followed by the digest if checked. With
+ * confirm, waits for the server to close the connection, which it only does
+ * once it has read the whole file. */
+static void send_file(const Address& addr, const std::string& path,
+                      Method method, bool checked, bool confirm,
+                      TransferStats& stats) {
+  FileDescriptor file = FileDescriptor::open_r(path);
+  ConnectedSocket sock{addr};
+  if (checked) {
+    send_check_header(sock, path.c_str(), stats);
+  }
+  switch (method) {
+    case Method::SENDFILE:
+      file.sendfile(sock, stats);
+      break;
+    case Method::ZEROCOPY:
+      file.send_zerocopy(sock, stats);
+      break;
+    case Method::COPY:
+      file.send_copy(sock, stats);
+      break;
+    case Method::PIPELINE:
+      file.send_pipelined(sock, stats);
+      break;
+  }
+  if (checked) {
+    /* the file was just read, so this comes out of the page cache */
+    uint32_t crc = htobe32(crc32c_file(file));
+    stats.syscalls += sock.send_all(reinterpret_cast<const char*>(&crc),
+                                    sizeof(crc));
+  }
+  if (confirm) {
+    sock.finish();
+  }
+}
 
-static std::string usage = " <HOSTNAME-OR-IP> <PORT> <FILENAME>";
+/* Fetches length bytes (or FETCH_ALL) from offset of the file the server
+ * stored for connection 'id' into path, which is created or truncated. The
+ * server going quiet for TIMEOUT seconds is an error, and so is it closing
+ * before the whole range has arrived. */
+static void fetch_file(const Address& addr, const std::string& path,
+                       uint64_t id, uint64_t offset, uint64_t length,
+                       TransferStats& stats) {
+  FrameHeader header;
+  header.upload = id;
+  header.offset = offset;
+  header.length = length;
+  header.fetch = true;
+
+  ConnectedSocket sock{addr};
+  char head[FRAME_HEADER];
+  header.encode(head);
+  stats.syscalls += sock.send_all(head, sizeof(head));
+  sock.set_recv_timeout();
+
+  try {
+    /* the reply comes in at the front of the ring, in one piece */
+    RingBuffer ring{socket_buffers()};
+    struct iovec iov[2];
+    while (ring.size() < FETCH_REPLY) {
+      ring.produced(sock.recvv(iov, ring.space(iov)));
+      stats.syscalls++;
+    }
+    ring.filled(iov);
+    uint64_t fields[2];
+    memcpy(fields, iov[0].iov_base, sizeof(fields));
+    if (be64toh(fields[0]) == FETCH_MISSING) {
+      throw std::runtime_error{"the server has no file for upload " +
+                               std::to_string(id)};
+    }
+    uint64_t left = be64toh(fields[1]);
+    ring.consumed(FETCH_REPLY);
+
+    FileDescriptor out = FileDescriptor::create_w(path);
+    while (1) {
+      size_t n = ring.size();
+      if (n > left) {
+        throw std::runtime_error{"the server sent more than it said"};
+      }
+      out.writev_all(iov, ring.filled(iov));
+      ring.consumed(n);
+      stats.bytes += n;
+      left -= n;
+      if (left == 0) {
+        return;
+      }
+      ring.produced(sock.recvv(iov, ring.space(iov)));
+      stats.syscalls++;
+    }
+  } catch (socket_closed_exception& e) {
+    throw std::runtime_error{"connection closed before the whole file came"};
+  }
+}
+
+/* the files a batch names: a directory stands for the regular files in it
+ * (not below it), in name order, and "-" for the paths on standard input,
+ * one per line */
+static std::vector<std::string> batch_files(char* args[], int count) {
+  std::vector<std::string> files;
+  for (int i = 0; i < count; i++) {
+    std::string arg = args[i];
+    if (arg == "-") {
+      std::string line;
+      while (std::getline(std::cin, line)) {
+        if (!line.empty()) {
+          files.push_back(line);
+        }
+      }
+      continue;
+    }
+
+    struct stat st;
+    if (stat(arg.c_str(), &st) == -1 || !S_ISDIR(st.st_mode)) {
+      files.push_back(arg);  // if it isn't there, sending it says so
+      continue;
+    }
+    DIR* dir = opendir(arg.c_str());
+    if (dir == nullptr) {
+      throw std::runtime_error{"opendir(): " + std::string{strerror(errno)}};
+    }
+    std::vector<std::string> names;
+    while (struct dirent* entry = readdir(dir)) {
+      std::string path = arg + "/" + entry->d_name;
+      if (stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+        names.push_back(path);
+      }
+    }
+    closedir(dir);
+    std::sort(names.begin(), names.end());
+    files.insert(files.end(), names.begin(), names.end());
+  }
+  return files;
+}
+
+/* Sends every file in files, each over a connection of its own and so as an
+ * upload of its own on the server, with up to 'jobs' of them in flight. The
+ * address is looked up once for the lot, and a connection only counts as
+ * done when the server closes it, so the batch can't run ahead of the
+ * server and overflow its accept queue. Prints "ok <path>" or
+ * "failed <path>: <error>" on standard output as each one finishes, and
+ * progress on standard error about once a second; returns how many failed. */
+static size_t send_batch(const char* host, const char* port,
+                         const std::vector<std::string>& files, size_t jobs,
+                         Method method, bool checked, TransferStats& stats) {
+  Address addr{host, port};
+  std::atomic<size_t> next{0};
+  size_t done = 0;
+  size_t failed = 0;
+  std::mutex lock;  // guards done, failed, stats and standard output
+  std::condition_variable finished;
+  std::vector<std::thread> threads;
+
+  for (size_t t = 0; t < std::min(jobs, files.size()); t++) {
+    threads.emplace_back([&] {
+      size_t i;
+      while ((i = next++) < files.size()) {
+        TransferStats sent;
+        std::string error;
+        try {
+          send_file(addr, files[i], method, checked, true, sent);
+        } catch (socket_closed_exception& e) {
+          error = "connection closed by the server";
+        } catch (std::runtime_error& e) {
+          error = e.what();
+        }
+
+        std::lock_guard<std::mutex> guard{lock};
+        stats.bytes += sent.bytes;
+        stats.syscalls += sent.syscalls;
+        if (error.empty()) {
+          std::cout << "ok " << files[i] << std::endl;
+        } else {
+          std::cout << "failed " << files[i] << ": " << error << std::endl;
+          failed++;
+        }
+        done++;
+        finished.notify_one();
+      }
+    });
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  auto report = [&] {
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    double mb = stats.bytes / 1e6;
+    fprintf(stderr, "%zu/%zu files, %.1f MB, %.1f MB/s, %zu failed\n", done,
+            files.size(), mb, elapsed.count() > 0 ? mb / elapsed.count() : 0,
+            failed);
+  };
+  {
+    std::unique_lock<std::mutex> guard{lock};
+    while (done < files.size()) {
+      if (!finished.wait_for(guard, std::chrono::seconds(BATCH_PROGRESS),
+                             [&] { return done == files.size(); })) {
+        report();
+      }
+    }
+    report();
+  }
+
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  return failed;
+}
 
 int main(int argc, char* argv[]) {
-  if (argc != 4) {
+  Method method = Method::SENDFILE;
+  bool chosen = false;  // -m given
+  size_t streams = 1;
+  bool resumable = false;
+  uint64_t upload = 0;
+  bool given = false;
+  bool checked = false;
+  bool batch = false;
+  size_t jobs = BATCH_JOBS;
+  bool fetch = false;
+  uint64_t fetch_id = 0;
+  uint64_t offset = 0;
+  uint64_t length = FETCH_ALL;
+  bool verbose = false;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "m:n:ru:cbj:g:o:l:v")) != -1) {
+    std::string arg = optarg ? optarg : "";
+    switch (opt) {
+      case 'm':
+        if (arg == "sendfile") {
+          method = Method::SENDFILE;
+        } else if (arg == "zerocopy") {
+          method = Method::ZEROCOPY;
+        } else if (arg == "copy") {
+          method = Method::COPY;
+        } else if (arg == "pipeline") {
+          method = Method::PIPELINE;
+        } else {
+          std::cerr << "ERROR: unknown method " << arg << std::endl;
+          return EXIT_FAILURE;
+        }
+        chosen = true;
+        break;
+      case 'n': {
+        char* end;
+        streams = strtoul(arg.c_str(), &end, 10);
+        if (arg.empty() || *end != '\0' || streams == 0) {
+          std::cerr << "ERROR: invalid number of streams " << arg << std::endl;
+          return EXIT_FAILURE;
+        }
+        break;
+      }
+      case 'r':
+        resumable = true;
+        break;
+      case 'u': {
+        char* end;
+        upload = strtoull(arg.c_str(), &end, 0);
+        if (arg.empty() || *end != '\0') {
+          std::cerr << "ERROR: invalid upload ID " << arg << std::endl;
+          return EXIT_FAILURE;
+        }
+        given = true;
+        break;
+      }
+      case 'c':
+        checked = true;
+        break;
+      case 'b':
+        batch = true;
+        break;
+      case 'j': {
+        char* end;
+        jobs = strtoul(arg.c_str(), &end, 10);
+        if (arg.empty() || *end != '\0' || jobs == 0) {
+          std::cerr << "ERROR: invalid number of connections " << arg
+                    << std::endl;
+          return EXIT_FAILURE;
+        }
+        break;
+      }
+      case 'g':
+      case 'o':
+      case 'l': {
+        char* end;
+        uint64_t val = strtoull(arg.c_str(), &end, 0);
+        if (arg.empty() || *end != '\0' || arg[0] == '-') {
+          std::cerr << "ERROR: invalid value for -" << static_cast<char>(opt)
+                    << ": " << arg << std::endl;
+          return EXIT_FAILURE;
+        }
+        if (opt == 'g') {
+          fetch = true;
+          fetch_id = val;
+        } else if (opt == 'o') {
+          offset = val;
+        } else {
+          length = val;
+        }
+        break;
+      }
+      case 'v':
+        verbose = true;
+        break;
+      default:
+        std::cerr << "Usage: " << argv[0] << usage << std::endl;
+        return EXIT_FAILURE;
+    }
+  }
+
+  if (batch ? argc - optind < 3 : argc - optind != 3) {
     std::cerr << "Usage: " << argv[0] << usage << std::endl;
     return EXIT_FAILURE;
   }
+  if (checked && (resumable || streams > 1)) {
+    std::cerr << "ERROR: -c can't be combined with -n or -r" << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (batch && (resumable || streams > 1)) {
+    std::cerr << "ERROR: -b can't be combined with -n or -r" << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (given && !resumable) {
+    std::cerr << "ERROR: -u only goes with -r" << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (!fetch && (offset != 0 || length != FETCH_ALL)) {
+    std::cerr << "ERROR: -o and -l only go with -g" << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (fetch && (batch || checked || resumable || streams > 1)) {
+    std::cerr << "ERROR: -g can't be combined with -b, -c, -n or -r"
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (chosen && (fetch || resumable || streams > 1)) {
+    std::cerr << "ERROR: -m can't be combined with -g, -n or -r" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  /* a server that goes away mid-transfer should be an error message, not a
+   * silent death by SIGPIPE */
+  signal(SIGPIPE, SIG_IGN);
 
+  TransferStats stats;
+  size_t failed = 0;
   try {
-    ConnectedSocket sock{argv[1], argv[2]};
-    FileDescriptor::open_r(argv[3]).sendfile(sock);
+    if (fetch) {
+      fetch_file(Address{argv[optind], argv[optind + 1]}, argv[optind + 2],
+                 fetch_id, offset, length, stats);
+    } else if (batch) {
+      std::vector<std::string> files =
+          batch_files(argv + optind + 2, argc - optind - 2);
+      failed = send_batch(argv[optind], argv[optind + 1], files, jobs, method,
+                          checked, stats);
+    } else if (resumable) {
+      send_resumable(argv[optind], argv[optind + 1], argv[optind + 2], upload,
+                     given, stats);
+    } else if (streams > 1) {
+      send_streams(argv[optind], argv[optind + 1], argv[optind + 2], streams,
+                   stats);
+    } else {
+      send_file(Address{argv[optind], argv[optind + 1]}, argv[optind + 2],
+                method, checked, false, stats);
+    }
   } catch (std::runtime_error& e) {
     std::cerr << "ERROR: " << e.what() << std::endl;
     return EXIT_FAILURE;
   }
+
+  if (verbose) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    std::cout << "bytes=" << stats.bytes << " syscalls=" << stats.syscalls
+              << " user_ms=" << cpu_ms(ru.ru_utime)
+              << " sys_ms=" << cpu_ms(ru.ru_stime) << std::endl;
+  }
+  if (failed > 0) {
+    std::cerr << "ERROR: " << failed << " of the files failed" << std::endl;
+    return EXIT_FAILURE;
+  }
 }
@@ -0,0 +1,180 @@
+#include "dedup.hpp"
+#include "metrics.hpp"
+#include "sha256.hpp"
+#include "spool.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+/* The masks FastCDC suggests for an 8 KB average: 15 bits before CHUNK_AVG
+ * and 11 after, spread out over the high half of the hash, which is the
+ * part that depends on the most bytes. */
+#define MASK_STRICT 0x0003590703530000ULL
+#define MASK_LOOSE 0x0000d90003530000ULL
+
+namespace {
+/* one random word per byte value; a manifest's chunks are only found again
+ * if every run of the server cuts at the same places, so these are
+ * generated (by splitmix64) from a fixed seed rather than at random */
+struct Gear {
+  Gear() {
+    uint64_t x = 0x6163636963646331ULL;
+    for (uint64_t& word : table) {
+      uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+      word = z ^ (z >> 31);
+    }
+  }
+  uint64_t table[256];
+};
+const Gear gear;
+}  // namespace
+
+size_t Chunker::scan(const char* data, size_t len) {
+  const unsigned char* in = reinterpret_cast<const unsigned char*>(data);
+  const uint64_t* table = gear.table;
+  size_t base = seen;  // of the chunk, before data
+  size_t i = 0;
+  uint64_t h = hash;
+
+  /* one loop per stretch of the chunk, so the inner loops test nothing but
+   * the hash and the end of the stretch */
+  if (base < CHUNK_MIN) {
+    i = std::min(len, static_cast<size_t>(CHUNK_MIN) - base);
+  }
+  size_t stop = 0;
+  if (base < CHUNK_AVG) {
+    stop = std::min(len, static_cast<size_t>(CHUNK_AVG) - base);
+  }
+  for (; i < stop; i++) {
+    h = (h << 1) + table[in[i]];
+    if (!(h & MASK_STRICT)) {
+      return cut(i + 1);
+    }
+  }
+  stop = std::min(len, static_cast<size_t>(CHUNK_MAX) - base);
+  for (; i < stop; i++) {
+    h = (h << 1) + table[in[i]];
+    if (!(h & MASK_LOOSE)) {
+      return cut(i + 1);
+    }
+  }
+  if (base + i == CHUNK_MAX) {
+    return cut(i);
+  }
+  hash = h;
+  seen = base + i;
+  return 0;
+}
+
+size_t Chunker::cut(size_t len) {
+  hash = 0;
+  seen = 0;
+  return len;
+}
+
+ChunkStore::ChunkStore(const FileDescriptor& dir)
+    : chunks(FileDescriptor::mkdirat(dir, CHUNK_DIR)) {}
+
+std::string ChunkStore::put(const char* data, size_t len) {
+  std::string name = Sha256::hex(data, len);
+  ThreadMetrics& m = thread_metrics();
+
+  if (faccessat(chunks.raw(), name.c_str(), F_OK, 0) == 0) {
+    m.chunks_reused.add();
+    m.bytes_reused.add(len);
+    return name;
+  }
+
+  Spool spool{chunks, name};
+  spool.file().write_all(data, len);
+  spool.publish();
+  m.chunks_stored.add();
+  return name;
+}
+
+std::string ChunkStore::get(const std::string& file_dir,
+                            const std::string& name) {
+  return FileDescriptor::open_r(file_dir + "/" CHUNK_DIR "/" + name)
+      .read_all();
+}
+
+void ChunkStore::sync() const {
+  if (syncfs(chunks.raw()) == -1) {
+    throw std::runtime_error{"syncfs(): " + std::string{strerror(errno)}};
+  }
+}
+
+Deduper::Deduper(ChunkStore& store, FileDescriptor& manifest)
+    : chunks(store), manifest(manifest) {}
+
+void Deduper::write(const char* data, size_t len) {
+  while (len > 0) {
+    size_t n = chunker.scan(data, len);
+    if (n == 0) {
+      partial.insert(partial.end(), data, data + len);
+      return;
+    }
+
+    /* a chunk that lies whole in data is stored straight from it */
+    if (partial.empty()) {
+      store(data, n);
+    } else {
+      partial.insert(partial.end(), data, data + n);
+      store(partial.data(), partial.size());
+      partial.clear();
+    }
+    data += n;
+    len -= n;
+  }
+}
+
+void Deduper::finish() {
+  if (!partial.empty()) {
+    store(partial.data(), partial.size());
+    partial.clear();
+  }
+  if (!lines.empty()) {
+    manifest.write_all(MANIFEST_MAGIC + lines);
+  }
+}
+
+void Deduper::store(const char* data, size_t len) {
+  lines += chunks.put(data, len) + " " + std::to_string(len) + "\n";
+}
+
+void restore_manifest(const std::string& file_dir, const std::string& text,
+                      FileDescriptor& out) {
+  std::string magic{MANIFEST_MAGIC};
+  if (text.empty()) {
+    return;  // an empty upload, which is left empty
+  }
+  if (text.compare(0, magic.size(), magic) != 0) {
+    throw std::runtime_error{"not a manifest"};
+  }
+
+  std::istringstream lines{text.substr(magic.size())};
+  std::string name;
+  size_t len;
+  while (lines >> name >> len) {
+    if (name.size() != 2 * SHA256_BYTES ||
+        name.find_first_not_of("0123456789abcdef") != std::string::npos) {
+      throw std::runtime_error{"bad chunk name in manifest: " + name};
+    }
+    std::string chunk = ChunkStore::get(file_dir, name);
+    if (chunk.size() != len || Sha256::hex(chunk.data(), len) != name) {
+      throw std::runtime_error{"chunk " + name + " is damaged"};
+    }
+    out.write_all(chunk);
+  }
+  if (!lines.eof()) {
+    throw std::runtime_error{"malformed manifest"};
+  }
+}
@@ -0,0 +1,104 @@
+#ifndef DEDUP_HPP
+#define DEDUP_HPP
+
+#include "file.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#define CHUNK_MIN 2048    // no cut point is looked for before this...
+#define CHUNK_AVG 8192    // ...a stricter one before this, a looser after...
+#define CHUNK_MAX 65536   // ...and one is forced here
+#define CHUNK_DIR ".chunks"  // in the file directory
+#define MANIFEST_MAGIC "accio-manifest 1\n"
+
+/* Content-defined chunking, after FastCDC (Xia et al., USENIX ATC '16).
+ *
+ * A gear hash rolls over the data, one shift and one table lookup per byte,
+ * and a chunk ends wherever the bits under a mask come out zero. Since that
+ * depends only on the last few dozen bytes, an insertion near the start of a
+ * file moves the cut points around it but leaves the rest where they were,
+ * so the chunks after it still match the ones already stored.
+ *
+ * Bytes before CHUNK_MIN aren't even hashed, and the mask is harder to
+ * satisfy before CHUNK_AVG than after it ("normalized chunking"), which
+ * keeps the sizes bunched up around the average. */
+class Chunker {
+ public:
+  Chunker() : hash(0), seen(0) {}
+
+  /* how many bytes of data finish the current chunk, or 0 if it goes on
+   * past all of them; after a cut the next call starts a new chunk */
+  size_t scan(const char* data, size_t len);
+
+ private:
+  size_t cut(size_t len);
+
+  uint64_t hash;
+  size_t seen;  // bytes of the current chunk so far
+};
+
+/* Chunks by SHA-256, each stored once as CHUNK_DIR/<hex digest>. A chunk is
+ * spooled and linked in under its name, so a reader never finds half of
+ * one; two uploads racing to store the same chunk both write it, and either
+ * copy will do. */
+class ChunkStore {
+ public:
+  explicit ChunkStore(const FileDescriptor& dir);  // creates CHUNK_DIR
+  ChunkStore(const ChunkStore&) = delete;
+
+  ChunkStore& operator=(const ChunkStore&) = delete;
+
+  /* returns the chunk's name, having stored it unless it already was */
+  std::string put(const char* data, size_t len);
+
+  /* the chunk's contents, for putting a file back together */
+  static std::string get(const std::string& file_dir,
+                         const std::string& name);
+
+  /* puts every chunk stored so far on disk: syncfs(), since they're spread
+   * over a file each */
+  void sync() const;
+
+ private:
+  FileDescriptor chunks;
+};
+
+/* Takes the place of WriteBehind for a deduplicated upload: received data
+ * is cut into chunks as it arrives, each goes to the store, and the file
+ * itself becomes a manifest listing them in order, one "<digest> <size>"
+ * line each after MANIFEST_MAGIC (or nothing at all for an empty upload, so
+ * it stays an empty file). restore_manifest() (or ./restore) turns that
+ * back into the upload. */
+class Deduper {
+ public:
+  Deduper(ChunkStore& store, FileDescriptor& manifest);
+  Deduper(const Deduper&) = delete;
+
+  Deduper& operator=(const Deduper&) = delete;
+
+  void write(const char* data, size_t len);
+
+  /* stores the last chunk and writes out the manifest */
+  void finish();
+
+  /* the chunks the manifest lists are on disk (the manifest itself isn't) */
+  void sync() const { chunks.sync(); }
+
+ private:
+  void store(const char* data, size_t len);
+
+  ChunkStore& chunks;
+  FileDescriptor& manifest;
+  Chunker chunker;
+  std::vector<char> partial;  // the chunk in progress, once it spans writes
+  std::string lines;
+};
+
+/* writes the upload a manifest stands for to out */
+void restore_manifest(const std::string& file_dir, const std::string& text,
+                      FileDescriptor& out);
+
+#endif // DEDUP_HPP
@@ -0,0 +1,90 @@
+#include "durable.hpp"
+#include "metrics.hpp"
+
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+GroupCommit::GroupCommit(const FileDescriptor& dir)
+    : dir(dir), started(0), finished(0), stopping(false) {
+  flusher = std::thread{&GroupCommit::run, this};
+}
+
+GroupCommit::~GroupCommit() {
+  {
+    std::lock_guard<std::mutex> guard{lock};
+    stopping = true;
+  }
+  queued.notify_one();
+  flusher.join();
+}
+
+void GroupCommit::add(Publish publish, Release release) {
+  {
+    std::lock_guard<std::mutex> guard{lock};
+    queue.push_back(Upload{std::move(publish), std::move(release)});
+  }
+  queued.notify_one();
+}
+
+void GroupCommit::wait(Publish publish, Release release) {
+  std::unique_lock<std::mutex> guard{lock};
+  queue.push_back(Upload{std::move(publish), std::move(release)});
+  uint64_t round = started + 1;
+  queued.notify_one();
+  committed.wait(guard, [&] { return finished >= round; });
+}
+
+/* syncfs() only reports write-back errors from Linux 5.8 on; before that a
+ * failure here goes unnoticed, as it would with sync() */
+static bool sync_all(const FileDescriptor& dir) {
+  if (syncfs(dir.raw()) == -1) {
+    std::cerr << "ERROR: syncfs(): " << strerror(errno) << std::endl;
+    return false;
+  }
+  return true;
+}
+
+void GroupCommit::run() {
+  std::vector<Upload> round;
+  std::vector<Upload> linked;  // the last round, its names not yet synced
+
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> guard{lock};
+      queued.wait(guard, [&] {
+        return stopping || !queue.empty() || !linked.empty();
+      });
+      if (queue.empty() && linked.empty()) {
+        return;  // stopping, and nothing left over
+      }
+      round.swap(queue);
+      started++;
+    }
+
+    /* this round's data and the last round's names in one go */
+    bool synced = sync_all(dir);
+    for (Upload& upload : linked) {
+      upload.release(synced);
+    }
+    linked.clear();  // closes the last round's connections
+    {
+      std::lock_guard<std::mutex> guard{lock};
+      finished = started - 1;
+    }
+    committed.notify_all();
+
+    if (!round.empty()) {
+      for (Upload& upload : round) {
+        upload.publish(synced);
+      }
+      ThreadMetrics& m = thread_metrics();
+      m.commit_rounds.add();
+      m.commit_batch.record(round.size());
+    }
+    linked.swap(round);
+  }
+}
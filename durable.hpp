@@ -0,0 +1,83 @@
+#ifndef DURABLE_HPP
+#define DURABLE_HPP
+
+#include "file.hpp"
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* when a finished upload reaches the disk:
+ *   NONE   whenever the page cache gets round to it; a crash soon after the
+ *          client sees its connection close can lose the file
+ *   CLOSE  before its file is published and its connection closed: the
+ *          data is synced, the file linked in, then the directory synced
+ *   GROUP  the same guarantee, but a GroupCommit syncs every upload that
+ *          finished since its last round at once */
+enum class Durability { NONE, CLOSE, GROUP };
+
+/* Group commit.
+ *
+ * A sync costs about the same whether it covers one file or a thousand, so
+ * syncing each upload on its own caps the server at a few hundred uploads a
+ * second. Instead, finished uploads are queued here with what publishes
+ * them, and a flusher thread takes everything in the queue at once:
+ *
+ *   syncfs()  every queued file's data (and anything else dirty on the file
+ *             system) is on disk
+ *   publish   each upload is linked in under its name
+ *
+ * The names are on disk after the next round's syncfs(), which is when the
+ * flusher releases the uploads and their clients' connections close; with
+ * nothing else queued, that round is an empty one. If that syncfs() fails,
+ * the names may never have got there, and the uploads are released with
+ * the failure instead, so no client takes the close for an acknowledgement. An upload that finishes
+ * during a round waits for the next one, so the busier the server, the more
+ * each round covers. */
+class GroupCommit {
+ public:
+  /* publish(true) links the upload in; publish(false) means its data
+   * couldn't be synced and it should be failed instead */
+  typedef std::function<void(bool)> Publish;
+
+  /* release(true) once the published upload's name is on disk as well;
+   * release(false) if the sync meant to put it there failed */
+  typedef std::function<void(bool)> Release;
+
+  explicit GroupCommit(const FileDescriptor& dir);  // anywhere on the fs
+  GroupCommit(const GroupCommit&) = delete;
+  ~GroupCommit();  // commits whatever is still queued
+
+  GroupCommit& operator=(const GroupCommit&) = delete;
+
+  /* whatever the two hold on to, the client's socket in particular, is let
+   * go of once release has run */
+  void add(Publish publish, Release release);
+
+  /* add(), then wait for the upload to be released, for a caller that
+   * can't hand it over (a worker thread, whose spool is on its stack) */
+  void wait(Publish publish, Release release);
+
+ private:
+  struct Upload {
+    Publish publish;
+    Release release;
+  };
+
+  void run();
+
+  const FileDescriptor& dir;
+  std::vector<Upload> queue;
+  uint64_t started;   // rounds; the queue goes into round started + 1
+  uint64_t finished;  // rounds whose uploads have been let go
+  bool stopping;
+  std::mutex lock;
+  std::condition_variable queued;
+  std::condition_variable committed;
+  std::thread flusher;
+};
+
+#endif // DURABLE_HPP
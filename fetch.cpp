@@ -0,0 +1,64 @@
+#include "fetch.hpp"
+#include "metrics.hpp"
+#include "socket.hpp"
+
+#include <endian.h>
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+
+void Fetch::start(const Layout& layout, const FrameHeader& header) {
+  started = true;
+  uint64_t size = FETCH_MISSING;
+
+  if (header.upload > 0 && header.upload <= INT_MAX) {
+    file = FileDescriptor::openat_r(layout.root(),
+                                    layout.path(header.upload));
+  }
+  if (file.valid()) {
+    size = file.size();
+    uint64_t from = std::min(header.offset, size);
+    offset = from;
+    left = std::min(header.length, size - from);
+  }
+
+  uint64_t fields[] = {htobe64(size), htobe64(left)};
+  memcpy(reply, fields, sizeof(reply));
+}
+
+void Fetch::send(ConnectedSocket& sock) {
+  sock.send_all(reply, sizeof(reply));
+  replied = sizeof(reply);
+
+  TransferStats stats;
+  try {
+    file.send_range(sock, offset, left, stats);
+  } catch (std::runtime_error& e) {
+    thread_metrics().bytes_sent.add(stats.bytes);
+    throw;
+  }
+  thread_metrics().bytes_sent.add(stats.bytes);
+  offset += left;
+  left = 0;
+}
+
+bool Fetch::pump(ConnectedSocket& sock) {
+  while (replied < sizeof(reply)) {
+    ssize_t n = sock.try_send(reply + replied, sizeof(reply) - replied);
+    if (n == -1) {
+      return false;
+    }
+    replied += n;
+  }
+
+  while (left > 0) {
+    ssize_t n = file.try_sendfile(sock, offset, left);
+    if (n == -1) {
+      return false;
+    }
+    thread_metrics().bytes_sent.add(n);
+    left -= n;
+  }
+  return true;
+}
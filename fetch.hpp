@@ -0,0 +1,47 @@
+#ifndef FETCH_HPP
+#define FETCH_HPP
+
+#include "file.hpp"
+#include "frames.hpp"
+#include "layout.hpp"
+
+#include <sys/types.h>
+
+#include <cstddef>
+#include <cstdint>
+
+class ConnectedSocket;
+
+/* One fetch being answered (see frames.hpp): the reply, then the range
+ * straight out of the page cache with sendfile(). Only published files are
+ * found, so a fetch never sees half an upload; a deduplicated upload comes
+ * back as its manifest. */
+class Fetch {
+ public:
+  Fetch() : started(false), replied(0), offset(0), left(0) {}
+  Fetch(const Fetch&) = delete;
+
+  Fetch& operator=(const Fetch&) = delete;
+
+  /* looks the file up and works out the reply */
+  void start(const Layout& layout, const FrameHeader& header);
+  bool active() const { return started; }
+
+  /* sends the reply and the range on a blocking socket, giving up if the
+   * client takes nothing for TIMEOUT seconds */
+  void send(ConnectedSocket& sock);
+
+  /* sends whatever a nonblocking socket takes; returns true once it has
+   * taken everything */
+  bool pump(ConnectedSocket& sock);
+
+ private:
+  bool started;
+  FileDescriptor file;  // invalid if there's no such file
+  char reply[FETCH_REPLY];
+  size_t replied;  // bytes of the reply sent so far
+  off_t offset;    // of the next byte of the range to send
+  uint64_t left;   // of the range
+};
+
+#endif // FETCH_HPP
@@ -1,15 +1,68 @@
 #include "file.hpp"
+#include "metrics.hpp"
+#include "readahead.hpp"
+#include "slab.hpp"
 #include "socket.hpp"
+#include "trace.hpp"
 
 #include <fcntl.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <cerrno>
+#include <chrono>
 #include <cstring>
 #include <stdexcept>
 
+void advance_iov(struct iovec*& iov, int& iovcnt, size_t n) {
+  while (iovcnt > 0 && n >= iov->iov_len) {
+    n -= iov->iov_len;
+    iov++;
+    iovcnt--;
+  }
+  if (iovcnt > 0) {
+    iov->iov_base = static_cast<char*>(iov->iov_base) + n;
+    iov->iov_len -= n;
+  }
+}
+
+Pipe::Pipe() {
+  int fds[2];
+  if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) == -1) {
+    throw std::runtime_error{"pipe2(): " + std::string{strerror(errno)}};
+  }
+  rd = fds[0];
+  wr = fds[1];
+
+  /* not fatal: the default 64K pipe just means twice the splice() calls */
+  int size = fcntl(wr, F_SETPIPE_SZ, PIPEBUF);
+  if (size == -1) {
+    size = fcntl(wr, F_GETPIPE_SZ);
+  }
+  capacity = size > 0 ? size : BLOCKSIZE;
+}
+
+Pipe::~Pipe() {
+  close(rd);
+  close(wr);
+}
+
+void Pipe::drain() {
+  char scratch[BLOCKSIZE];
+  while (read(rd, scratch, sizeof(scratch)) > 0) {
+  }
+}
+
 FileDescriptor::FileDescriptor(int fd) : fd(fd) {}
 FileDescriptor::FileDescriptor(FileDescriptor&& other) noexcept {
   fd = other.fd;
@@ -22,6 +75,9 @@ FileDescriptor::~FileDescriptor() {
 }
 
 FileDescriptor& FileDescriptor::operator=(FileDescriptor&& other) noexcept {
+  if (fd > 0 && fd != other.fd) {
+    close(fd);
+  }
   fd = other.fd;
   other.fd = -1;
   return *this;
@@ -29,7 +85,7 @@ FileDescriptor& FileDescriptor::operator=(FileDescriptor&& other) noexcept {
 
 FileDescriptor FileDescriptor::open(const std::string& file, int flags) {
   int fd;
-  fd = ::open(file.c_str(), flags);
+  fd = ::open(file.c_str(), flags, S_IWUSR | S_IRUSR | S_IRGRP | S_IROTH);
   if (fd < 0) {
     throw std::runtime_error{"open(): " + std::string{strerror(errno)}};
   }
@@ -48,31 +104,446 @@ FileDescriptor FileDescriptor::openat(const FileDescriptor& dir,
 }
 
 void FileDescriptor::write_all(const std::string& data) {
-  const char *buf = data.c_str();
-  size_t nbytes = data.size();
+  write_all(data.c_str(), data.size());
+}
+
+void FileDescriptor::write_all(const char* data, size_t nbytes) {
+  TRACE_SCOPE("write_all", "bytes", nbytes);
   size_t total = 0;
   ssize_t n;
 
   do {
-    if ((n = ::write(fd, buf + total, nbytes - total)) == -1) {
+    if ((n = ::write(fd, data + total, nbytes - total)) == -1) {
       throw std::runtime_error{"write(): " + std::string{strerror(errno)}};
     }
     total += n;
   } while (total < nbytes);
 }
 
-void FileDescriptor::sendfile(ConnectedSocket& sock) {
+void FileDescriptor::writev_all(struct iovec* iov, int iovcnt) {
+  TRACE_SCOPE("writev_all", "iovecs", iovcnt);
+  while (iovcnt > 0) {
+    ssize_t n = ::writev(fd, iov, iovcnt);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error{"writev(): " + std::string{strerror(errno)}};
+    }
+    advance_iov(iov, iovcnt, n);
+  }
+}
+
+std::string FileDescriptor::read_all() {
+  std::string data;
+  char buf[65536];
   ssize_t n;
 
-  while ((n = read(fd, buf, BLOCKSIZE)) > 0) {
-    sock.send_all(std::string{buf, static_cast<size_t>(n)});
+  while ((n = ::read(fd, buf, sizeof(buf))) != 0) {
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error{"read(): " + std::string{strerror(errno)}};
+    }
+    data.append(buf, n);
+  }
+  return data;
+}
+
+namespace {
+/* puts a socket in nonblocking mode for as long as it's in scope */
+struct NonBlocking {
+  explicit NonBlocking(int fd) : fd(fd), flags(fcntl(fd, F_GETFL)) {
+    if (flags != -1) {
+      fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    }
+  }
+  ~NonBlocking() {
+    if (flags != -1) {
+      fcntl(fd, F_SETFL, flags);
+    }
+  }
+  int fd;
+  int flags;
+};
+
+/* unmaps on the way out, exceptions included */
+struct Mapping {
+  Mapping(void* addr, size_t len) : addr(addr), len(len) {}
+  ~Mapping() {
+    if (addr != MAP_FAILED) {
+      munmap(addr, len);
+    }
+  }
+  void* addr;
+  size_t len;
+};
+}
+
+/* Waits for room in a nonblocking socket's send buffer (or for anything on
+ * its error queue). SO_SNDTIMEO only bounds each call, and one big
+ * sendfile() can sit through it several times over while trickling out a
+ * few pages; polling keeps the limit at TIMEOUT seconds without progress. */
+static void wait_writable(int sockfd, TransferStats& stats) {
+  struct pollfd pfd = {sockfd, POLLOUT, 0};
+
+  stats.syscalls++;
+  int n = poll(&pfd, 1, TIMEOUT * 1000);
+  if (n == 0) {
+    throw std::runtime_error{"send(): connection timed out"};
+  }
+  if (n == -1 && errno != EINTR) {
+    throw std::runtime_error{"poll(): " + std::string{strerror(errno)}};
+  }
+}
+
+void FileDescriptor::sendfile(ConnectedSocket& sock, TransferStats& stats) {
+  bool supported = true;
+
+  {
+    NonBlocking guard{sock.sockfd};
+    ssize_t n;
+
+    while (supported) {
+      stats.syscalls++;
+      n = ::sendfile(sock.sockfd, fd, nullptr, SENDFILE_MAX);
+      if (n > 0) {
+        stats.bytes += n;
+        continue;
+      }
+      if (n == 0) {
+        return;
+      }
+
+      switch (errno) {
+        case EINTR:
+          break;
+        case EAGAIN:
+          wait_writable(sock.sockfd, stats);
+          break;
+        case EINVAL:
+        case ENOSYS:
+          supported = false;
+          break;
+        default:
+          throw std::runtime_error{"sendfile(): " +
+                                   std::string{strerror(errno)}};
+      }
+    }
+  }
+
+  /* not something the kernel can sendfile() from (a pipe, say); the file
+   * offset has kept up with what was sent, so just copy the rest */
+  send_copy(sock, stats);
+}
+
+void FileDescriptor::send_range(ConnectedSocket& sock, off_t offset,
+                                size_t len, TransferStats& stats) {
+  {
+    NonBlocking guard{sock.sockfd};
+
+    while (len > 0) {
+      stats.syscalls++;
+      ssize_t n = ::sendfile(sock.sockfd, fd, &offset,
+                             std::min<size_t>(len, SENDFILE_MAX));
+      if (n > 0) {
+        stats.bytes += n;
+        len -= n;
+        continue;
+      }
+      if (n == 0) {
+        throw std::runtime_error{"sendfile(): file shorter than its range"};
+      }
+
+      if (errno == EAGAIN) {
+        wait_writable(sock.sockfd, stats);
+      } else if (errno == EINVAL || errno == ENOSYS) {
+        break;
+      } else if (errno != EINTR) {
+        throw std::runtime_error{"sendfile(): " +
+                                 std::string{strerror(errno)}};
+      }
+    }
+  }
+
+  /* can't be sendfile()d; offset has kept up with what was sent */
+  BufferPool::Buffer buf = block_buffers().borrow();
+  while (len > 0) {
+    stats.syscalls++;
+    ssize_t n = pread(fd, buf.data(), std::min(len, buf.size()), offset);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n == -1) {
+      throw std::runtime_error{"pread(): " + std::string{strerror(errno)}};
+    }
+    if (n == 0) {
+      throw std::runtime_error{"pread(): file shorter than its range"};
+    }
+    stats.syscalls += sock.send_all(buf.data(), n);
+    stats.bytes += n;
+    offset += n;
+    len -= n;
+  }
+}
+
+/* Reads MSG_ZEROCOPY completion notifications off the socket's error queue;
+ * if 'wait', blocks up to TIMEOUT seconds for the first one. Returns how many
+ * zerocopy sends the kernel is done with. */
+static uint32_t reap_zerocopy(int sockfd, bool wait, TransferStats& stats) {
+  uint32_t done = 0;
+
+  if (wait) {
+    struct pollfd pfd = {sockfd, 0, 0};  // POLLERR is always reported
+    stats.syscalls++;
+    if (poll(&pfd, 1, TIMEOUT * 1000) == 0) {
+      throw std::runtime_error{"send(): connection timed out"};
+    }
+  }
+
+  while (true) {
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+    struct msghdr msg = {};
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    stats.syscalls++;
+    if (recvmsg(sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+      if (errno == EAGAIN || errno == EINTR) {
+        return done;
+      }
+      throw std::runtime_error{"recvmsg(MSG_ERRQUEUE): " +
+                               std::string{strerror(errno)}};
+    }
+
+    for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != nullptr;
+         cm = CMSG_NXTHDR(&msg, cm)) {
+      /* an IPv6 socket gets them at its own level */
+      if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+          !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) {
+        continue;
+      }
+      struct sock_extended_err* err =
+          reinterpret_cast<struct sock_extended_err*>(CMSG_DATA(cm));
+      if (err->ee_origin == SO_EE_ORIGIN_ZEROCOPY && err->ee_errno == 0) {
+        /* [ee_info, ee_data] is the range of sends that completed; over
+         * loopback the kernel sets SO_EE_CODE_ZEROCOPY_COPIED because it
+         * had to copy after all */
+        done += err->ee_data - err->ee_info + 1;
+      }
+    }
+  }
+}
+
+void FileDescriptor::send_zerocopy(ConnectedSocket& sock,
+                                   TransferStats& stats) {
+  struct stat st;
+  off_t offset;
+
+  if (fstat(fd, &st) == -1) {
+    throw std::runtime_error{"fstat(): " + std::string{strerror(errno)}};
+  }
+  if ((offset = lseek(fd, 0, SEEK_CUR)) == -1 || !S_ISREG(st.st_mode)) {
+    send_copy(sock, stats);  // nothing to map
+    return;
+  }
+  if (st.st_size <= offset) {
+    return;
+  }
+
+  size_t len = st.st_size;
+  Mapping map{mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0), len};
+  if (map.addr == MAP_FAILED) {
+    throw std::runtime_error{"mmap(): " + std::string{strerror(errno)}};
+  }
+  madvise(map.addr, len, MADV_SEQUENTIAL);
+
+  /* without SO_ZEROCOPY (pre-4.14 kernels) this still saves the read()
+   * copy, the kernel just copies out of the mapping instead */
+  int one = 1;
+  bool zerocopy =
+      setsockopt(sock.sockfd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+  stats.syscalls++;
+
+  const char* data = static_cast<const char*>(map.addr);
+  size_t total = offset;
+  uint32_t pending = 0;
+
+  while (total < len) {
+    size_t chunk = std::min<size_t>(len - total, ZEROCOPY_CHUNK);
+    stats.syscalls++;
+    ssize_t n = ::send(sock.sockfd, data + total, chunk,
+                       MSG_DONTWAIT | (zerocopy ? MSG_ZEROCOPY : 0));
+    if (n >= 0) {
+      total += n;
+      stats.bytes += n;
+      pending += zerocopy;
+      /* collect completions as we go so they don't pile up in optmem */
+      if (zerocopy && pending >= ZEROCOPY_BACKLOG) {
+        pending -= reap_zerocopy(sock.sockfd, false, stats);
+      }
+      continue;
+    }
+
+    switch (errno) {
+      case EINTR:
+        break;
+      case ENOBUFS:
+        /* out of optmem for notifications; wait for the kernel to catch up */
+        pending -= reap_zerocopy(sock.sockfd, true, stats);
+        break;
+      case EAGAIN:
+        /* notifications wake poll() up too, so clear them out first */
+        if (zerocopy) {
+          pending -= reap_zerocopy(sock.sockfd, false, stats);
+        }
+        wait_writable(sock.sockfd, stats);
+        break;
+      default:
+        throw std::runtime_error{"send(): " + std::string{strerror(errno)}};
+    }
+  }
+
+  /* The skbs hold their own references to the mapped pages, so unmapping
+   * now is safe; the file is never written to, so there's nothing to wait
+   * for before returning. */
+  lseek(fd, total, SEEK_SET);
+}
+
+void FileDescriptor::send_copy(ConnectedSocket& sock, TransferStats& stats) {
+  BufferPool::Buffer buf = block_buffers().borrow();
+  ssize_t n;
+
+  while (true) {
+    stats.syscalls++;
+    if ((n = read(fd, buf.data(), buf.size())) <= 0) {
+      break;
+    }
+    stats.syscalls += sock.send_all(buf.data(), n);
+    stats.bytes += n;
   }
   if (n == -1) {
     throw std::runtime_error{"read(): " + std::string{strerror(errno)}};
   }
 }
 
+void FileDescriptor::send_pipelined(ConnectedSocket& sock,
+                                    TransferStats& stats) {
+  off_t start = lseek(fd, 0, SEEK_CUR);
+  if (start == -1) {
+    send_copy(sock, stats);  // a pipe, say; nothing to read ahead
+    return;
+  }
+
+  ReadAhead ahead{fd, start};
+  off_t sent = 0;
+  double rate = 0;  // bytes per second into the socket, smoothed
+
+  while (true) {
+    ReadAhead::Chunk chunk = ahead.next();
+    if (chunk.len == 0) {
+      break;
+    }
+
+    auto begun = std::chrono::steady_clock::now();
+    stats.syscalls += sock.send_all(chunk.data, chunk.len);
+    std::chrono::duration<double> took =
+        std::chrono::steady_clock::now() - begun;
+    ahead.release();
+    stats.bytes += chunk.len;
+    sent += chunk.len;
+
+    /* size the reads so each buffer takes about READAHEAD_TARGET_MS to
+     * send: the ring then holds a fixed amount of time, not of bytes */
+    if (took.count() > 0) {
+      double now = chunk.len / took.count();
+      rate = rate == 0 ? now : 0.75 * rate + 0.25 * now;
+      ahead.resize(rate * READAHEAD_TARGET_MS / 1000);
+    }
+  }
+
+  stats.syscalls += ahead.reads();
+  lseek(fd, start + sent, SEEK_SET);  // as if it had been read() through
+}
+
+ssize_t FileDescriptor::try_sendfile(ConnectedSocket& sock, off_t& offset,
+                                     size_t len) {
+  ssize_t n;
+  do {
+    n = ::sendfile(sock.sockfd, fd, &offset,
+                   std::min<size_t>(len, SENDFILE_MAX));
+  } while (n == -1 && errno == EINTR);
+
+  if (n == -1) {
+    if (errno == EAGAIN) {
+      return -1;
+    }
+    throw std::runtime_error{"sendfile(): " + std::string{strerror(errno)}};
+  }
+  if (n == 0 && len > 0) {
+    throw std::runtime_error{"sendfile(): file shorter than its range"};
+  }
+  return n;
+}
+
+ssize_t FileDescriptor::splice_from(ConnectedSocket& sock, Pipe& pipe) {
+  TRACE_SCOPE("splice", "bytes", 0);
+  ssize_t n;
+
+  do {
+    n = splice(sock.sockfd, nullptr, pipe.wr, nullptr, pipe.capacity,
+               SPLICE_F_MOVE);
+  } while (n == -1 && errno == EINTR);
+
+  if (n == -1) {
+    switch (errno) {
+      case EAGAIN:
+        return -1;
+      case EINVAL:
+        throw splice_unsupported();
+      default:
+        throw std::runtime_error{"splice(): " + std::string{strerror(errno)}};
+    }
+  }
+  else if (n == 0) {
+    throw socket_closed_exception();
+  }
+  TRACE_ARG(n);
+
+  /* the second half is the disk write */
+  Stopwatch timer;
+  size_t left = n;
+  while (left > 0) {
+    ssize_t m = splice(pipe.rd, nullptr, fd, nullptr, left, SPLICE_F_MOVE);
+    if (m > 0) {
+      left -= m;
+      continue;
+    }
+    if (m == 0) {
+      throw std::runtime_error{"splice(): pipe ran dry"};
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    if (errno == EINVAL) {
+      /* the file can't be spliced into; the data is already out of the
+       * socket, so copy it out of the pipe before giving up on splicing */
+      BufferPool::Buffer buf = block_buffers().borrow();
+      while (left > 0 && (m = read(pipe.rd, buf.data(), buf.size())) > 0) {
+        write_all(buf.data(), m);
+        left -= m;
+      }
+      throw splice_unsupported();
+    }
+    throw std::runtime_error{"splice(): " + std::string{strerror(errno)}};
+  }
+  thread_metrics().write_latency.record(timer.micros());
+  return n;
+}
+
 void FileDescriptor::clear() {
+  TRACE_SCOPE("clear", "fd", fd);
   if (ftruncate(fd, 0) == -1) {
     throw std::runtime_error{"ftruncate(): " + std::string{strerror(errno)}};
   }
@@ -81,21 +552,139 @@ void FileDescriptor::clear() {
   }
 }
 
+void FileDescriptor::sync() const {
+  if (fdatasync(fd) == -1) {
+    throw std::runtime_error{"fdatasync(): " + std::string{strerror(errno)}};
+  }
+}
+
+void FileDescriptor::pwritev_all(struct iovec* iov, int iovcnt,
+                                 off_t offset) {
+  TRACE_SCOPE("pwritev_all", "iovecs", iovcnt);
+  while (iovcnt > 0) {
+    ssize_t n = ::pwritev(fd, iov, iovcnt, offset);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error{"pwritev(): " + std::string{strerror(errno)}};
+    }
+    offset += n;
+    advance_iov(iov, iovcnt, n);
+  }
+}
+
+void FileDescriptor::preallocate(off_t offset, off_t len) {
+  /* KEEP_SIZE: the blocks are reserved but the file doesn't look any longer
+   * than what's actually been written. Not every file system can do this,
+   * and it's only an optimization, so refusals are fine */
+  if (fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, len) == -1 &&
+      errno != EOPNOTSUPP && errno != ENOSYS) {
+    throw std::runtime_error{"fallocate(): " + std::string{strerror(errno)}};
+  }
+}
+
+void FileDescriptor::truncate(off_t len) {
+  if (ftruncate(fd, len) == -1) {
+    throw std::runtime_error{"ftruncate(): " + std::string{strerror(errno)}};
+  }
+}
+
+off_t FileDescriptor::position() {
+  off_t pos = lseek(fd, 0, SEEK_CUR);
+  if (pos == -1) {
+    throw std::runtime_error{"lseek(): " + std::string{strerror(errno)}};
+  }
+  return pos;
+}
+
+off_t FileDescriptor::size() const {
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    throw std::runtime_error{"fstat(): " + std::string{strerror(errno)}};
+  }
+  return st.st_size;
+}
+
+bool FileDescriptor::set_direct(bool on) {
+  int flags = fcntl(fd, F_GETFL);
+  if (flags == -1) {
+    throw std::runtime_error{"fcntl(F_GETFL): " + std::string{strerror(errno)}};
+  }
+  flags = on ? flags | O_DIRECT : flags & ~O_DIRECT;
+  if (fcntl(fd, F_SETFL, flags) == -1) {
+    if (errno == EINVAL) {
+      return false;
+    }
+    throw std::runtime_error{"fcntl(O_DIRECT): " +
+                             std::string{strerror(errno)}};
+  }
+  return true;
+}
+
 FileDescriptor FileDescriptor::open_r(const std::string& file) {
   return FileDescriptor::open(file, O_RDONLY);
 }
 
 FileDescriptor FileDescriptor::create_w(const std::string& file) {
-  return FileDescriptor::open(file, O_RDONLY | O_CREAT | O_TRUNC);
+  return FileDescriptor::open(file, O_WRONLY | O_CREAT | O_TRUNC);
 }
 
 FileDescriptor FileDescriptor::opendir(const std::string& dir) {
   return FileDescriptor::open(dir, O_DIRECTORY);
 }
 
+FileDescriptor FileDescriptor::mkdirat(const FileDescriptor& dir,
+                                       const std::string& name) {
+  if (::mkdirat(dir.fd, name.c_str(), S_IRWXU) == -1 && errno != EEXIST) {
+    throw std::runtime_error{"mkdirat(): " + std::string{strerror(errno)}};
+  }
+  return FileDescriptor::openat(dir, name, O_DIRECTORY, 0);
+}
+
 FileDescriptor FileDescriptor::openat_cw(const FileDescriptor& dir,
                                          const std::string& file) {
   int flags = O_CREAT | O_WRONLY;
   int mode = S_IWUSR | S_IRUSR;
   return FileDescriptor::openat(dir, file, flags, mode);
 }
+
+FileDescriptor FileDescriptor::openat_ctw(const FileDescriptor& dir,
+                                          const std::string& file) {
+  int flags = O_CREAT | O_TRUNC | O_WRONLY;
+  int mode = S_IWUSR | S_IRUSR;
+  return FileDescriptor::openat(dir, file, flags, mode);
+}
+
+FileDescriptor FileDescriptor::openat_r(const FileDescriptor& dir,
+                                        const std::string& file) {
+  int fd = ::openat(dir.fd, file.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    if (errno == ENOENT || errno == ENOTDIR) {
+      return FileDescriptor{};
+    }
+    throw std::runtime_error{"openat(): " + std::string{strerror(errno)}};
+  }
+  return FileDescriptor{fd};
+}
+
+FileDescriptor FileDescriptor::openat_tmpfile(const FileDescriptor& dir) {
+  int fd = ::openat(dir.fd, ".", O_TMPFILE | O_WRONLY | O_CLOEXEC,
+                    S_IWUSR | S_IRUSR);
+  if (fd < 0) {
+    if (errno == EOPNOTSUPP || errno == EISDIR) {
+      return FileDescriptor{};  // the file system (or kernel) can't
+    }
+    throw std::runtime_error{"openat(O_TMPFILE): " +
+                             std::string{strerror(errno)}};
+  }
+  return FileDescriptor{fd};
+}
+
+FileDescriptor FileDescriptor::eventfd() {
+  int fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (fd < 0) {
+    throw std::runtime_error{"eventfd(): " + std::string{strerror(errno)}};
+  }
+  return FileDescriptor{fd};
+}
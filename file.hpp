@@ -2,9 +2,56 @@
 #define FILE_HPP
 
 #include <string>
+#include <stdexcept>
 #include <sys/types.h>
 
+struct iovec;
+
 #define BLOCKSIZE 4096 // given by blockdev --getbsz /dev/sda5
+#define PIPEBUF 131072 // SOCKBUF rounded up to what F_SETPIPE_SZ would give
+#define SENDFILE_MAX 0x7ffff000 // most sendfile(2) will move in one call
+#define ZEROCOPY_CHUNK (1 << 20) // bytes per MSG_ZEROCOPY send()
+#define ZEROCOPY_BACKLOG 32 // unreaped MSG_ZEROCOPY sends before reaping
+
+/* splice() refused the socket or the file; use the copy path instead */
+class splice_unsupported : public std::runtime_error {
+ public:
+  splice_unsupported() : std::runtime_error{"splice(): not supported"} {}
+};
+
+/* The in-kernel buffer that FileDescriptor::splice_from() moves data through.
+ * It is empty between calls, so one pipe can be shared by every connection
+ * serviced from the same thread. */
+class Pipe {
+ friend class FileDescriptor;
+
+ public:
+  Pipe();
+  Pipe(const Pipe&) = delete;
+  ~Pipe();
+
+  Pipe& operator=(const Pipe&) = delete;
+
+  /* throw away anything left behind by a failed splice_from() */
+  void drain();
+
+ private:
+  int rd;
+  int wr;
+  size_t capacity;
+};
+
+/* what it cost to push a file down a socket, for the client's -v report */
+struct TransferStats {
+  TransferStats() : bytes(0), syscalls(0) {}
+  size_t bytes;
+  size_t syscalls;
+};
+
+/* steps iov past n bytes that went out (or came in): buffers taken in full
+ * are skipped and the one cut short is trimmed, for callers of writev() and
+ * the like that go round again with what's left */
+void advance_iov(struct iovec*& iov, int& iovcnt, size_t n);
 
 class ConnectedSocket;
 class FileDescriptor {
@@ -18,14 +65,88 @@ class FileDescriptor {
   FileDescriptor& operator=(FileDescriptor&&) noexcept;
 
   void write_all(const std::string& data);
-  void sendfile(ConnectedSocket& sock);
+  void write_all(const char* data, size_t nbytes);
+  /* write_all() of every buffer iov points at, in order, in as few
+   * writev()s as it takes; may modify iov as it works through short writes */
+  void writev_all(struct iovec* iov, int iovcnt);
   void clear();
 
+  /* the rest of the file, from the current offset */
+  std::string read_all();
+
+  /* positional I/O for WriteBehind; none of these move the file offset.
+   * pwritev_all() may modify iov as it works through short writes */
+  void pwritev_all(struct iovec* iov, int iovcnt, off_t offset);
+  void preallocate(off_t offset, off_t len);
+  void truncate(off_t len);
+  off_t position();
+  off_t size() const;
+
+  /* fdatasync(); everything written so far survives a crash */
+  void sync() const;
+
+  /* turns O_DIRECT on or off; returns false where the file system won't
+   * have it (tmpfs, for one) */
+  bool set_direct(bool on);
+
+  /* Ways of sending the rest of the file down a socket, all of which keep
+   * the socket's SO_SNDTIMEO semantics:
+   *   sendfile      sendfile(2); the kernel reads the page cache straight
+   *                 into the socket. Falls back to send_copy() for files it
+   *                 can't handle.
+   *   send_zerocopy mmap(2)s the file and sends it with MSG_ZEROCOPY. The
+   *                 kernel holds on to the pages it still has to send, so
+   *                 it unmaps without waiting for the last completions
+   *   send_copy     read(2) into a buffer and send(2) it
+   *   send_pipelined
+   *                 send_copy() with the reads done ahead by a thread of
+   *                 their own (see ReadAhead), in chunks sized to keep up
+   *                 with the socket; for files on slow or remote storage */
+  void sendfile(ConnectedSocket& sock, TransferStats& stats);
+  void send_zerocopy(ConnectedSocket& sock, TransferStats& stats);
+  void send_copy(ConnectedSocket& sock, TransferStats& stats);
+  void send_pipelined(ConnectedSocket& sock, TransferStats& stats);
+
+  /* sendfile() of just len bytes from offset, leaving the file offset alone
+   * so several threads can each send a range of the same file */
+  void send_range(ConnectedSocket& sock, off_t offset, size_t len,
+                  TransferStats& stats);
+
+  /* Moves one socket buffer's worth of data into the file without it ever
+   * entering user space. Returns the number of bytes moved, or -1 if the
+   * socket would block (or its SO_RCVTIMEO expired). Throws
+   * socket_closed_exception on EOF and splice_unsupported if either end
+   * can't be spliced; nothing read off the socket is lost in that case. */
+  ssize_t splice_from(ConnectedSocket& sock, Pipe& pipe);
+
+  /* the nonblocking counterpart of send_range(): sendfile()s up to len bytes
+   * from offset (moving it along) into a nonblocking socket and returns how
+   * many went, or -1 if the socket is full */
+  ssize_t try_sendfile(ConnectedSocket& sock, off_t& offset, size_t len);
+
   static FileDescriptor open_r(const std::string& file);
   static FileDescriptor create_w(const std::string& file);
   static FileDescriptor opendir(const std::string& dir);
+  /* the directory name in dir, created first if it isn't there */
+  static FileDescriptor mkdirat(const FileDescriptor& dir,
+                                const std::string& name);
   static FileDescriptor openat_cw(const FileDescriptor& dir,
                                   const std::string& file);
+  static FileDescriptor openat_ctw(const FileDescriptor& dir,
+                                   const std::string& file);
+  /* file in dir for reading, or an invalid descriptor if there isn't one */
+  static FileDescriptor openat_r(const FileDescriptor& dir,
+                                 const std::string& file);
+  /* an unnamed file in dir, or an invalid descriptor (see valid) where
+   * O_TMPFILE isn't supported */
+  static FileDescriptor openat_tmpfile(const FileDescriptor& dir);
+  static FileDescriptor eventfd();
+  /* takes ownership of a descriptor from elsewhere (another process, say) */
+  static FileDescriptor adopt(int fd) { return FileDescriptor{fd}; }
+
+  /* for registering with a Reactor; the descriptor stays owned by us */
+  int raw() const { return fd; }
+  bool valid() const { return fd != -1; }
 
  private:
   static FileDescriptor open(const std::string& file, int flags);
@@ -33,7 +154,6 @@ class FileDescriptor {
                                const std::string& file, int flags, int mode);
   explicit FileDescriptor(int fd);
   int fd;
-  char buf[BLOCKSIZE];
 };
 
 #endif // FILE_HPP
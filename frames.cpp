@@ -0,0 +1,320 @@
+#include "frames.hpp"
+#include "metrics.hpp"
+#include "socket.hpp"
+
+#include <endian.h>
+#include <poll.h>
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <iostream>
+#include <iterator>
+#include <stdexcept>
+#include <vector>
+
+#include <cstring>
+
+void FrameHeader::encode(char* out) const {
+  uint64_t fields[] = {htobe64(upload), htobe64(offset), htobe64(length),
+                       htobe64(total)};
+  const char* magic = FRAME_MAGIC;
+  if (resume) {
+    magic = RESUME_MAGIC;
+  } else if (check) {
+    magic = CHECK_MAGIC;
+  } else if (fetch) {
+    magic = FETCH_MAGIC;
+  }
+  memcpy(out, magic, FRAME_MAGIC_LEN);
+  memcpy(out + FRAME_MAGIC_LEN, fields, sizeof(fields));
+}
+
+int FrameHeader::decode(const char* data, size_t len) {
+  size_t n = std::min<size_t>(len, FRAME_MAGIC_LEN);
+  bool stream = memcmp(data, FRAME_MAGIC, n) == 0;
+  bool resumed = memcmp(data, RESUME_MAGIC, n) == 0;
+  bool checked = memcmp(data, CHECK_MAGIC, n) == 0;
+  bool fetched = memcmp(data, FETCH_MAGIC, n) == 0;
+  if (!stream && !resumed && !checked && !fetched) {
+    return 0;
+  }
+  if (len < FRAME_HEADER) {
+    return -1;
+  }
+
+  uint64_t fields[4];
+  memcpy(fields, data + FRAME_MAGIC_LEN, sizeof(fields));
+  upload = be64toh(fields[0]);
+  offset = be64toh(fields[1]);
+  length = be64toh(fields[2]);
+  total = be64toh(fields[3]);
+  resume = resumed;
+  check = checked;
+  fetch = fetched;
+  return 1;
+}
+
+int read_frame_header(ConnectedSocket& sock, FrameHeader& header, bool block) {
+  char head[FRAME_HEADER];
+
+  ssize_t n = sock.peek(head, sizeof(head), false);
+  if (n == -1) {
+    if (block) {
+      throw socket_timeout_error();
+    }
+    return -1;
+  }
+  int framed = n == 0 ? 0 : header.decode(head, n);
+
+  if (framed == -1 && block) {
+    n = sock.peek(head, sizeof(head), true);
+    if (n == -1) {
+      throw socket_timeout_error();
+    }
+    framed = header.decode(head, n) == 1 ? 1 : 0;  // EOF short of a header
+  } else if (framed == -1) {
+    /* an edge-triggered caller won't hear from a client that has already
+     * shut down again, so the few bytes it sent are all there will be */
+    struct pollfd pfd = {sock.fd(), POLLRDHUP, 0};
+    if (poll(&pfd, 1, 0) == 1 && (pfd.revents & (POLLRDHUP | POLLHUP))) {
+      framed = 0;
+    }
+  }
+
+  /* the peek saw the whole header, so this takes it without blocking */
+  if (framed == 1 && sock.try_recv(head, sizeof(head)) != FRAME_HEADER) {
+    throw std::runtime_error{"recv(): short frame header"};
+  }
+  return framed;
+}
+
+void send_resume_offset(ConnectedSocket& sock, uint64_t offset) {
+  /* the first thing ever sent on the socket, so it always fits */
+  uint64_t reply = htobe64(offset);
+  sock.send_all(reinterpret_cast<const char*>(&reply), sizeof(reply));
+}
+
+Assembly::Assembly(Layout::Dir dir, const std::string& name,
+                   const FrameHeader& header)
+    : dir(std::move(dir)), spool(*this->dir, name), upload(header.upload),
+      total(header.total), landed(0), durable(0), streams(0),
+      resumable(header.resume), broken(false), timed_out(false),
+      settled(false),
+      expires(std::chrono::steady_clock::now() +
+              std::chrono::seconds(TIMEOUT)) {}
+
+Assemblies::~Assemblies() {
+  for (auto& it : open) {
+    try {
+      it.second->spool.fail("ERROR: incomplete upload");
+    } catch (std::runtime_error& e) {
+      std::cerr << "ERROR: " << e.what() << std::endl;
+    }
+  }
+}
+
+void Assemblies::attach(Stream& stream, const FrameHeader& header,
+                        Layout& layout, int id) {
+  if (!header.resume && (header.length > header.total ||
+                         header.offset > header.total - header.length)) {
+    throw std::runtime_error{"stream range runs past the end of its file"};
+  }
+  if (header.total > max_total) {
+    throw std::runtime_error{"upload of " + std::to_string(header.total) +
+                             " bytes is over the limit of " +
+                             std::to_string(max_total)};
+  }
+
+  std::lock_guard<std::mutex> guard{lock};
+  sweep();
+
+  auto it = open.find(header.upload);
+  if (it == open.end()) {
+    std::shared_ptr<Assembly> assembly{
+        new Assembly{layout.dir(id), std::to_string(id) + ".file", header}};
+    it = open.emplace(header.upload, assembly).first;
+  } else if (it->second->total != header.total ||
+             it->second->resumable != header.resume) {
+    throw std::runtime_error{"streams of one upload disagree on its size"};
+  }
+
+  Assembly& assembly = *it->second;
+  if (assembly.resumable && assembly.streams > 0) {
+    /* it carries on from durable, which the stream still attached would
+     * write past; a resume that races the old connection's end tries again */
+    throw std::runtime_error{"upload is still attached to another stream"};
+  }
+  uint64_t offset = assembly.resumable ? assembly.durable : header.offset;
+  uint64_t length = assembly.resumable ? assembly.total - assembly.durable
+                                       : header.length;
+  if (!assembly.resumable && length > 0) {
+    /* a resumable upload's streams take turns, one at a time, each from
+     * where the last left off; anyone else's may not write over another's */
+    auto after = assembly.claimed.lower_bound(offset);
+    if ((after != assembly.claimed.end() && after->first < offset + length) ||
+        (after != assembly.claimed.begin() &&
+         std::prev(after)->second > offset)) {
+      throw std::runtime_error{"stream range overlaps another stream's"};
+    }
+  }
+  if (length > 0) {
+    /* only what a stream has actually come to fill, in whatever order */
+    assembly.file().preallocate(offset, length);
+  }
+  if (!assembly.resumable && length > 0) {
+    assembly.claimed[offset] = offset + length;
+  }
+
+  assembly.streams++;
+  stream.assembly = it->second;
+  stream.registry = this;
+  stream.offset = offset;
+  stream.length = length;
+  stream.left = length;
+}
+
+void Assemblies::detach(Stream& stream, bool closed, bool timed_out) {
+  Assembly& assembly = *stream.assembly;
+  bool delivered = closed && stream.left == 0 && !stream.faulty;
+
+  /* what a resumable stream wrote only counts once it's on disk (as does
+   * what any stream wrote, if the file has to be durable); that can take a
+   * while, so not while holding up everyone else */
+  bool synced = false;
+  if ((assembly.resumable || (durable && delivered)) && !stream.faulty) {
+    try {
+      assembly.file().sync();
+      synced = true;
+    } catch (std::runtime_error& e) {
+      std::cerr << "ERROR: upload " << assembly.upload << ": " << e.what()
+                << std::endl;
+    }
+  }
+  if (durable && !synced) {
+    delivered = false;  // it can't be vouched for
+  }
+
+  std::lock_guard<std::mutex> guard{lock};
+  if (assembly.settled) {
+    return;  // published without this stream
+  }
+  assembly.streams--;
+
+  if (assembly.resumable) {
+    /* streams start at or before durable and it only ever grows, so
+     * everything up to where this one got is in the file */
+    if (synced) {
+      assembly.durable = std::max(assembly.durable, stream.offset);
+    }
+    if (assembly.durable == assembly.total) {
+      settle(assembly, true);
+    } else if (assembly.streams == 0) {
+      assembly.expires = std::chrono::steady_clock::now() + retention;
+    }
+    sweep();
+    return;
+  }
+
+  if (delivered) {
+    assembly.landed += stream.length;
+  } else {
+    assembly.broken = true;
+    assembly.timed_out |= timed_out;
+  }
+
+  if (!assembly.broken && assembly.landed == assembly.total) {
+    settle(assembly, true);
+  } else if (assembly.broken && assembly.streams == 0) {
+    settle(assembly, false);
+  } else if (assembly.streams == 0) {
+    assembly.expires =
+        std::chrono::steady_clock::now() + std::chrono::seconds(TIMEOUT);
+  }
+  sweep();
+}
+
+void Assemblies::expire() {
+  std::lock_guard<std::mutex> guard{lock};
+  sweep();
+}
+
+void Assemblies::sweep() {
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  if (now - swept < std::chrono::seconds(1)) {
+    return;
+  }
+  swept = now;
+
+  std::vector<Assembly*> expired;
+  for (auto& it : open) {
+    Assembly& assembly = *it.second;
+    if (assembly.streams == 0 && assembly.expires < now) {
+      assembly.timed_out = true;
+      expired.push_back(&assembly);
+    }
+  }
+  for (Assembly* assembly : expired) {
+    settle(*assembly, false);
+  }
+}
+
+/* publishes or fails an assembly and takes it out of the table */
+void Assemblies::settle(Assembly& assembly, bool complete) {
+  try {
+    if (complete) {
+      assembly.spool.publish();
+      if (durable) {
+        assembly.dir->sync();
+      }
+    } else {
+      assembly.spool.fail(assembly.timed_out ? "ERROR: socket timed out"
+                                             : "ERROR: incomplete upload");
+    }
+  } catch (std::runtime_error& e) {
+    std::cerr << "ERROR: upload " << assembly.upload << ": " << e.what()
+              << std::endl;
+  }
+  assembly.settled = true;
+  open.erase(assembly.upload);  // may destroy it
+}
+
+Stream::~Stream() {
+  if (attached()) {
+    finish(false, false);
+  }
+}
+
+uint64_t Stream::attach(Assemblies& assemblies, const FrameHeader& header,
+                        Layout& layout, int id) {
+  assemblies.attach(*this, header, layout, id);
+  return offset;
+}
+
+uint64_t Stream::claim(size_t len) {
+  if (len > left) {
+    throw std::runtime_error{"stream sent more than its range"};
+  }
+  uint64_t at = offset;
+  offset += len;
+  left -= len;
+  return at;
+}
+
+void Stream::write(const char* data, size_t len) {
+  struct iovec iov = {const_cast<char*>(data), len};
+  off_t at = claim(len);
+
+  Stopwatch timer;
+  try {
+    assembly->file().pwritev_all(&iov, 1, at);
+  } catch (std::runtime_error& e) {
+    fault();
+    throw;
+  }
+  thread_metrics().write_latency.record(timer.micros());
+}
+
+void Stream::finish(bool closed, bool timed_out) {
+  registry->detach(*this, closed, timed_out);
+  assembly.reset();
+}
@@ -0,0 +1,227 @@
+#ifndef FRAMES_HPP
+#define FRAMES_HPP
+
+#include "file.hpp"
+#include "layout.hpp"
+#include "spool.hpp"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#define FRAME_MAGIC "\x7f" "ACCIOMS"   // no file type we know starts with this
+#define RESUME_MAGIC "\x7f" "ACCIORS"  // ...or this
+#define CHECK_MAGIC "\x7f" "ACCIOCK"   // ...or this
+#define FETCH_MAGIC "\x7f" "ACCIOGT"   // ...or this
+#define FRAME_MAGIC_LEN 8
+#define FRAME_HEADER 40  // magic, then four 64-bit big-endian fields
+#define RESUME_REPLY 8   // the offset a resumed upload carries on from
+#define CHECK_TRAILER 4  // the CRC32C that follows a checked upload
+#define FETCH_REPLY 16   // a fetched file's size, then the range's length
+#define FETCH_ALL UINT64_MAX      // a fetch's length: to the end of the file
+#define FETCH_MISSING UINT64_MAX  // a fetch reply's size: no such file
+#define RESUME_RETENTION 600  // seconds a resumable upload waits to resume
+#define ASSEMBLY_MAX_TOTAL (1ULL << 30)  // default cap on a stream's total
+
+/* The multi-stream protocol.
+ *
+ * A plain client just sends its file and closes. A multi-stream client
+ * splits the file into ranges and sends each one over a connection of its
+ * own, starting with this header:
+ *
+ *   magic   FRAME_MAGIC
+ *   upload  chosen by the client; the same on every stream of one file
+ *   offset  where this stream's range starts in the file
+ *   length  how many bytes of it this stream carries
+ *   total   the size of the whole file
+ *
+ * A resumable upload is one stream led by RESUME_MAGIC instead, whose
+ * offset and length the server ignores: it answers with RESUME_REPLY bytes,
+ * the big-endian offset up to which it already holds the file durably, and
+ * the client sends the rest from there. If the connection fails, what has
+ * arrived is kept (instead of making way for ERROR) for the server's
+ * retention window, and the client can connect again to carry on.
+ *
+ * A checked upload is a plain one led by CHECK_MAGIC, of which only length
+ * counts: that many bytes of the file follow, and then CHECK_TRAILER bytes
+ * of the big-endian CRC32C the client computed over them, for the server to
+ * hold its own against (see checksum.hpp).
+ *
+ * A fetch, led by FETCH_MAGIC, isn't an upload at all but asks for one back:
+ * upload is the connection ID it was stored under, and offset and length
+ * the range of it wanted (FETCH_ALL for the rest of the file). The server
+ * answers FETCH_REPLY bytes, the big-endian size of the whole file (or
+ * FETCH_MISSING) and length of the range, clamped to the file, then sends
+ * that many bytes and closes. Its connection ID goes unused.
+ *
+ * The server tells these apart from a plain upload by the first
+ * FRAME_MAGIC_LEN bytes, so a plain upload only gets mistaken for a stream
+ * if its file starts with one of the magics. */
+struct FrameHeader {
+  FrameHeader()
+      : upload(0), offset(0), length(0), total(0), resume(false),
+        check(false), fetch(false) {}
+
+  uint64_t upload;
+  uint64_t offset;
+  uint64_t length;
+  uint64_t total;
+  bool resume;  // RESUME_MAGIC
+  bool check;   // CHECK_MAGIC
+  bool fetch;   // FETCH_MAGIC
+
+  void encode(char* out) const;  // FRAME_HEADER bytes
+
+  /* 1 if data starts with a valid header (now in *this), 0 if it can't be
+   * one, -1 if it might be but len is too short to tell */
+  int decode(const char* data, size_t len);
+};
+
+class ConnectedSocket;
+
+/* Looks at the start of a connection for a FrameHeader and takes it off the
+ * socket if it's there. Returns 1 for a stream, 0 for a plain upload, and
+ * -1 on a nonblocking socket that hasn't sent enough to tell yet; a
+ * blocking one waits, and throws socket_timeout_error if that takes longer
+ * than SO_RCVTIMEO. */
+int read_frame_header(ConnectedSocket& sock, FrameHeader& header, bool block);
+
+/* sends a resumed upload's stream the offset to carry on from */
+void send_resume_offset(ConnectedSocket& sock, uint64_t offset);
+
+/* One file being put together from the ranges of several streams. It takes
+ * the name of the first stream to arrive and is published once every byte
+ * of it has landed. Streams may not overlap: one whose range takes in bytes
+ * another has already claimed is refused, so every byte counted as landed
+ * is a different one. Once a stream has ended short of its range, the file
+ * can't be completed, so the last stream to go gets it an ERROR file like
+ * any failed upload. Streams that haven't connected yet are waited for as
+ * long as an idle connection would be, TIMEOUT seconds after the last one
+ * left, and then the file times out the same way.
+ *
+ * A resumable one takes one stream at a time, refusing any other while it
+ * is attached, and is always filled from the front; every stream that
+ * leaves syncs what it wrote to disk before its end counts as durable. When
+ * one leaves early the upload is kept, for the retention window, for the
+ * next stream to pick up from there. */
+class Assembly {
+ public:
+  Assembly(Layout::Dir dir, const std::string& name,
+           const FrameHeader& header);
+  Assembly(const Assembly&) = delete;
+
+  Assembly& operator=(const Assembly&) = delete;
+
+  FileDescriptor& file() { return spool.file(); }
+
+ private:
+  friend class Assemblies;
+
+  Layout::Dir dir;  // held open for spool
+  Spool spool;
+  uint64_t upload;
+  uint64_t total;
+  uint64_t landed;   // bytes of every stream that delivered its whole range
+  std::map<uint64_t, uint64_t> claimed;  // every stream's range, start -> end
+  uint64_t durable;  // resumable: synced from the start of the file to here
+  unsigned streams;  // attached right now
+  bool resumable;
+  bool broken;       // a stream ended short; this can never complete
+  bool timed_out;    // ...and one of them timed out
+  bool settled;      // published or failed, and out of the table
+  std::chrono::steady_clock::time_point expires;  // once no stream is attached
+};
+
+/* Every Assembly in progress, by upload. Streams of one upload may be
+ * serviced by different threads (or shards), so the table is locked; only
+ * attaching and detaching take the lock, the writes themselves don't. */
+class Stream;
+class Assemblies {
+ public:
+  /* with durable, a file is synced before it's published and its
+   * directory after, whatever the server's Durability; the last stream
+   * syncs what it wrote itself, so no group commit is involved. Uploads
+   * larger than max_total are refused. */
+  explicit Assemblies(unsigned retention = RESUME_RETENTION,
+                      bool durable = false,
+                      uint64_t max_total = ASSEMBLY_MAX_TOTAL)
+      : retention(retention), durable(durable), max_total(max_total) {}
+  Assemblies(const Assemblies&) = delete;
+  ~Assemblies();  // fails whatever is still waiting for streams
+
+  Assemblies& operator=(const Assemblies&) = delete;
+
+  /* fills in where stream starts and how much of the file it carries */
+  void attach(Stream& stream, const FrameHeader& header, Layout& layout,
+              int id);
+  void detach(Stream& stream, bool closed, bool timed_out);
+
+  /* sweep()s; the event loops call this on their timer ticks, so uploads
+   * expire even when no stream comes or goes */
+  void expire();
+
+ private:
+  /* Uploads no stream has been attached to for too long get their ERROR
+   * file: a resumable one once its retention window has run out, any other
+   * after TIMEOUT. At most once a second. */
+  void sweep();
+  void settle(Assembly& assembly, bool complete);
+
+  std::mutex lock;
+  std::unordered_map<uint64_t, std::shared_ptr<Assembly>> open;
+  std::chrono::seconds retention;
+  bool durable;
+  uint64_t max_total;
+  std::chrono::steady_clock::time_point swept;
+};
+
+/* One connection's part in an Assembly: the range it still has to fill. */
+class Stream {
+ public:
+  Stream()
+      : registry(nullptr), length(0), offset(0), left(0), faulty(false) {}
+  Stream(const Stream&) = delete;
+  ~Stream();
+
+  Stream& operator=(const Stream&) = delete;
+
+  /* returns the offset the range starts at, which for a resumed upload is
+   * what the client has to be told */
+  uint64_t attach(Assemblies& assemblies, const FrameHeader& header,
+                  Layout& layout, int id);
+  bool attached() const { return assembly != nullptr; }
+
+  /* hands out where the next len bytes of the range go, throwing if the
+   * client sends more than it said it would */
+  uint64_t claim(size_t len);
+
+  /* claims len bytes and writes data there */
+  void write(const char* data, size_t len);
+
+  /* a write to a claimed range failed, so the range can't count */
+  void fault() { faulty = true; }
+
+  /* the file's descriptor, for writes issued elsewhere (by io_uring) */
+  int fd() const { return assembly->file().raw(); }
+
+  /* done with the connection; closed if the client closed it cleanly, in
+   * which case a stream that sent its whole range counts as delivered */
+  void finish(bool closed, bool timed_out);
+
+ private:
+  friend class Assemblies;
+
+  Assemblies* registry;
+  std::shared_ptr<Assembly> assembly;
+  uint64_t length;  // of the range
+  uint64_t offset;  // where the next claimed byte goes
+  uint64_t left;    // of the range, still to come
+  bool faulty;
+};
+
+#endif // FRAMES_HPP
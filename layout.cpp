@@ -0,0 +1,54 @@
+#include "layout.hpp"
+
+#include <cstdio>
+
+#define LAYOUT_FANOUT 4096  // subdirectories per directory
+
+Layout::Layout(FileDescriptor root, unsigned per_dir)
+    : top(std::make_shared<FileDescriptor>(std::move(root))),
+      per_dir(per_dir) {}
+
+static std::string hex3(uint32_t n) {
+  char buf[16];
+  snprintf(buf, sizeof(buf), "%03x", n);
+  return buf;
+}
+
+Layout::Dir Layout::dir(int id) {
+  if (per_dir == 0) {
+    return top;
+  }
+
+  uint32_t bucket = static_cast<uint32_t>(id) / per_dir;
+  std::lock_guard<std::mutex> guard{lock};
+  auto it = cached.find(bucket);
+  if (it != cached.end()) {
+    recent.splice(recent.begin(), recent, it->second);
+    return it->second->second;
+  }
+
+  /* a miss happens about once every per_dir uploads, so it's fine to make
+   * the directories with the lock held */
+  FileDescriptor outer =
+      FileDescriptor::mkdirat(*top, hex3(bucket / LAYOUT_FANOUT));
+  Dir inner = std::make_shared<FileDescriptor>(
+      FileDescriptor::mkdirat(outer, hex3(bucket % LAYOUT_FANOUT)));
+
+  recent.emplace_front(bucket, inner);
+  cached[bucket] = recent.begin();
+  if (recent.size() > LAYOUT_OPEN) {
+    cached.erase(recent.back().first);
+    recent.pop_back();
+  }
+  return inner;
+}
+
+std::string Layout::path(int id) const {
+  std::string name = std::to_string(id) + ".file";
+  if (per_dir == 0) {
+    return name;
+  }
+  uint32_t bucket = static_cast<uint32_t>(id) / per_dir;
+  return hex3(bucket / LAYOUT_FANOUT) + "/" + hex3(bucket % LAYOUT_FANOUT) +
+         "/" + name;
+}
@@ -0,0 +1,59 @@
+#ifndef LAYOUT_HPP
+#define LAYOUT_HPP
+
+#include "file.hpp"
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#define LAYOUT_OPEN 64  // shard directories kept open, most recently used
+
+/* Where each upload's <id>.file goes under FILE-DIR.
+ *
+ * By default that's FILE-DIR itself. A few million files into one directory,
+ * though, every create and lookup gets slow and anything that lists it
+ * crawls, so with per_dir set the files are spread over subdirectories
+ * instead: upload id goes into bucket id / per_dir, which lives at
+ *
+ *   FILE-DIR/<bucket / 4096, 3 hex digits>/<bucket % 4096, 3 hex digits>/
+ *
+ * so no directory holds more than per_dir files or 4096 subdirectories.
+ * They're made when the first file needs them. Ids are handed out in order,
+ * so uploads in flight fall into a handful of buckets, whose directories
+ * are kept open (the LAYOUT_OPEN most recently used) and creating a file is
+ * one openat() relative to one of them. */
+class Layout {
+ public:
+  /* shared, so a directory evicted from the cache stays open for whoever
+   * is still writing into it */
+  typedef std::shared_ptr<const FileDescriptor> Dir;
+
+  Layout(FileDescriptor root, unsigned per_dir);
+  Layout(const Layout&) = delete;
+
+  Layout& operator=(const Layout&) = delete;
+
+  const FileDescriptor& root() const { return *top; }
+
+  /* the directory upload id's file goes in, made if it isn't there yet */
+  Dir dir(int id);
+
+  /* where that file is, relative to root() */
+  std::string path(int id) const;
+
+ private:
+  typedef std::list<std::pair<uint32_t, Dir>> Recent;
+
+  Dir top;
+  unsigned per_dir;  // 0 for everything in FILE-DIR
+  std::mutex lock;
+  Recent recent;  // most recently used first
+  std::unordered_map<uint32_t, Recent::iterator> cached;
+};
+
+#endif // LAYOUT_HPP
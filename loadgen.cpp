@@ -0,0 +1,601 @@
+/*
+ * The load generator starts a local ./server on a scratch directory, drives
+ * it with many concurrent uploads and reports how it coped.
+ *
+ *
+ * USAGE
+ *   ./loadgen [-n UPLOADS] [-c CONCURRENCY] [-j THREADS] [-s SIZE[-SIZE]]
+ *             [-r RATE] [-x STALLED-PERCENT] [-p PORT] [-- SERVER-ARGS...]
+ *
+ * -n:          uploads in total (default 2000)
+ * -c:          uploads in flight at once, spread over the threads
+ *              (default 200)
+ * -j:          client threads, each running its own epoll loop (default:
+ *              one per CPU)
+ * -s:          upload size in bytes, or a range to draw sizes from uniformly;
+ *              K and M suffixes are understood (default 64K-1M)
+ * -r:          bytes per second each client sends at most; 0, the default,
+ *              sends as fast as the socket takes it
+ * -x:          percentage of clients that send half their file and then
+ *              stall, so the server has to time them out
+ * -p:          port for the server (default 3003)
+ * server-args: passed on to ./server, e.g. -- -e uring -i copy
+ *
+ *
+ * REPORT
+ *   MB/s       payload bytes over the wall time of the whole run
+ *   conn/s     uploads completed over the same
+ *   p50/p99/p999
+ *              time-to-durable-file: from starting to connect until the
+ *              server has published <id>.file (watched with inotify)
+ *
+ * Each upload starts with its own index as 8 bytes, so once the server has
+ * stopped every file can be traced back to the upload that made it and its
+ * size checked.
+ */
+#include "reactor.hpp"
+#include "socket.hpp"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+
+#define SEND_CHUNK 65536    // most handed to one send()
+#define TAG_BYTES 8         // the upload's index, at the start of its file
+#define SETTLE_SECONDS 30   // wait this long past TIMEOUT for the last files
+
+typedef std::chrono::steady_clock Clock;
+
+static std::string usage =
+    " [-n UPLOADS] [-c CONCURRENCY] [-j THREADS] [-s SIZE[-SIZE]] [-r RATE]"
+    " [-x STALLED-PERCENT] [-p PORT] [-- SERVER-ARGS...]";
+
+struct LoadConfig {
+  LoadConfig()
+      : uploads(2000), concurrency(200),
+        threads(std::max(1u, std::thread::hardware_concurrency())),
+        min_size(65536), max_size(1048576), rate(0), stalled(0),
+        port("3003") {}
+
+  size_t uploads;
+  size_t concurrency;
+  size_t threads;
+  size_t min_size;
+  size_t max_size;
+  size_t rate;     // bytes per second per client, 0 for no limit
+  size_t stalled;  // percent
+  std::string port;
+  std::vector<std::string> server_args;
+};
+
+/* what each upload was supposed to do and when it started; every slot is
+ * written by exactly one client thread */
+struct Planned {
+  size_t size;
+  bool stall;
+  Clock::time_point start;
+};
+
+/* one client connection in flight */
+struct Upload {
+  Upload(ConnectedSocket sock, uint64_t index, const Planned& plan)
+      : sock(std::move(sock)), index(index), size(plan.size),
+        limit(plan.stall ? plan.size / 2 : plan.size), sent(0),
+        stall(plan.stall), start(plan.start), throttled(false) {}
+
+  ConnectedSocket sock;
+  uint64_t index;
+  size_t size;
+  size_t limit;  // where to stop sending; size unless stalling
+  size_t sent;
+  bool stall;
+  Clock::time_point start;
+  bool throttled;  // out of EPOLLOUT until the rate allows more
+};
+
+/* one file the server published, and when */
+struct Published {
+  std::string name;
+  Clock::time_point at;
+};
+
+static double seconds(Clock::duration d) {
+  return std::chrono::duration<double>(d).count();
+}
+
+static size_t parse_size(const std::string& arg) {
+  char* end;
+  unsigned long long val = strtoull(arg.c_str(), &end, 10);
+  std::string suffix{end};
+  if (suffix == "K" || suffix == "k") {
+    val <<= 10;
+  } else if (suffix == "M" || suffix == "m") {
+    val <<= 20;
+  } else if (!suffix.empty() || arg.empty()) {
+    throw std::runtime_error{"invalid size " + arg};
+  }
+  return val;
+}
+
+static size_t parse_count(char opt, const char* arg, bool zero_ok) {
+  char* end;
+  unsigned long val = strtoul(arg, &end, 10);
+  if (*arg == '\0' || *end != '\0' || (val == 0 && !zero_ok)) {
+    throw std::runtime_error{std::string{"invalid value for -"} + opt + ": " +
+                             arg};
+  }
+  return val;
+}
+
+/* Runs ./server on dir and waits for it to listen. Connecting to find out
+ * would cost it a connection number, so look for the socket in /proc. */
+static pid_t start_server(const LoadConfig& config, const std::string& dir) {
+  std::vector<std::string> args{"./server"};
+  args.insert(args.end(), config.server_args.begin(), config.server_args.end());
+  args.push_back(config.port);
+  args.push_back(dir);
+
+  pid_t pid = fork();
+  if (pid == -1) {
+    throw std::runtime_error{"fork(): " + std::string{strerror(errno)}};
+  }
+  if (pid == 0) {
+    std::vector<char*> argv;
+    for (std::string& arg : args) {
+      argv.push_back(&arg[0]);
+    }
+    argv.push_back(nullptr);
+    execv(argv[0], argv.data());
+    std::cerr << "ERROR: execv(./server): " << strerror(errno) << std::endl;
+    _exit(EXIT_FAILURE);
+  }
+
+  char hex[8];
+  snprintf(hex, sizeof(hex), ":%04X", atoi(config.port.c_str()));
+  std::string proc = "/proc/" + std::to_string(pid) + "/net/tcp";
+
+  for (int tries = 0; tries < 500; tries++) {
+    std::ifstream tcp{proc};
+    std::string line;
+    while (std::getline(tcp, line)) {
+      /* sl local_address rem_address st; 0A is LISTEN */
+      char local[64], remote[64], state[8];
+      if (sscanf(line.c_str(), "%*s %63s %63s %7s", local, remote, state) ==
+              3 &&
+          std::string{local}.find(hex) != std::string::npos &&
+          std::string{state} == "0A") {
+        return pid;
+      }
+    }
+
+    int status;
+    if (waitpid(pid, &status, WNOHANG) == pid) {
+      throw std::runtime_error{"./server exited before listening"};
+    }
+    usleep(10000);
+  }
+  kill(pid, SIGTERM);
+  throw std::runtime_error{"./server never started listening"};
+}
+
+static void stop_server(pid_t pid) {
+  kill(pid, SIGTERM);
+  int status;
+  waitpid(pid, &status, 0);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    std::cerr << "WARNING: ./server did not exit cleanly" << std::endl;
+  }
+}
+
+static void remove_dir(const std::string& dir) {
+  DIR* d = ::opendir(dir.c_str());
+  if (d == nullptr) {
+    return;
+  }
+  struct dirent* ent;
+  while ((ent = readdir(d)) != nullptr) {
+    std::string name{ent->d_name};
+    if (name != "." && name != "..") {
+      unlinkat(dirfd(d), name.c_str(), 0);
+    }
+  }
+  closedir(d);
+  rmdir(dir.c_str());
+}
+
+/* Collects every file that appears in dir, with the time it did, until told
+ * to stop. linkat() and open(O_CREAT) both show up as IN_CREATE, rename()
+ * as IN_MOVED_TO; the server's hidden spools start with a dot. */
+static void watch(const std::string& dir, std::atomic<bool>& done,
+                  std::vector<Published>& files, std::atomic<size_t>& seen) {
+  int fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+  if (fd == -1 ||
+      inotify_add_watch(fd, dir.c_str(), IN_CREATE | IN_MOVED_TO) == -1) {
+    std::cerr << "ERROR: inotify: " << strerror(errno) << std::endl;
+    return;
+  }
+
+  alignas(struct inotify_event) char buf[65536];
+  while (!done) {
+    struct pollfd pfd = {fd, POLLIN, 0};
+    if (poll(&pfd, 1, 50) <= 0) {
+      continue;
+    }
+
+    Clock::time_point now = Clock::now();
+    ssize_t n = read(fd, buf, sizeof(buf));
+    for (ssize_t off = 0; off < n;) {
+      struct inotify_event* ev =
+          reinterpret_cast<struct inotify_event*>(buf + off);
+      if (ev->len > 0 && ev->name[0] != '.') {
+        files.push_back(Published{ev->name, now});
+        seen++;
+      }
+      off += sizeof(struct inotify_event) + ev->len;
+    }
+  }
+  close(fd);
+}
+
+/* One client thread: keeps its share of the concurrency busy with uploads
+ * until the shared counter runs out. */
+class Client {
+ public:
+  Client(const LoadConfig& config, size_t slots, std::vector<Planned>& plans,
+         std::atomic<size_t>& next, const std::vector<char>& payload)
+      : bytes(0), completed(0), failed(0), config(config), slots(slots),
+        plans(plans), next(next), payload(payload),
+        random(std::random_device{}()) {}
+
+  void run();
+
+  size_t bytes;      // payload sent by uploads that finished
+  size_t completed;  // uploads sent in full (or stalled as planned)
+  size_t failed;
+
+ private:
+  bool open_one();
+  void pump(Upload& up);
+  void finish(Upload& up, bool ok);
+  void unthrottle();
+
+  const LoadConfig& config;
+  size_t slots;
+  std::vector<Planned>& plans;
+  std::atomic<size_t>& next;
+  const std::vector<char>& payload;
+  std::mt19937_64 random;
+
+  Reactor reactor;
+  std::unordered_map<Upload*, std::unique_ptr<Upload>> live;
+};
+
+void Client::run() {
+  bool more = true;
+  while (more || !live.empty()) {
+    while (more && live.size() < slots) {
+      more = open_one();
+    }
+
+    int n = reactor.wait(config.rate > 0 ? 10 : 100);
+    for (int i = 0; i < n; i++) {
+      pump(*static_cast<Upload*>(reactor.event(i).data.ptr));
+    }
+    if (config.rate > 0) {
+      unthrottle();
+    }
+  }
+}
+
+bool Client::open_one() {
+  size_t index = next++;
+  if (index >= plans.size()) {
+    return false;
+  }
+
+  Planned& plan = plans[index];
+  std::uniform_int_distribution<size_t> size{config.min_size, config.max_size};
+  std::uniform_int_distribution<size_t> percent{0, 99};
+  plan.size = size(random);
+  plan.stall = percent(random) < config.stalled;
+  plan.start = Clock::now();
+
+  try {
+    ConnectedSocket sock{"localhost", config.port};
+    sock.set_nonblocking();
+    int fd = sock.fd();
+
+    std::unique_ptr<Upload> up{new Upload{std::move(sock), index, plan}};
+    reactor.add(fd, EPOLLOUT | EPOLLRDHUP, up.get());
+    live[up.get()] = std::move(up);
+
+  } catch (std::runtime_error& e) {
+    std::cerr << "ERROR: upload " << index << ": " << e.what() << std::endl;
+    failed++;
+  }
+  return true;
+}
+
+void Client::pump(Upload& up) {
+  try {
+    if (up.sent == up.limit) {
+      /* a stalled client waits for the server to give up on it */
+      char scratch[256];
+      while (up.sock.try_recv(scratch, sizeof(scratch)) > 0) {
+      }
+      return;
+    }
+
+    while (up.sent < up.limit) {
+      size_t len = std::min<size_t>(SEND_CHUNK, up.limit - up.sent);
+      if (config.rate > 0) {
+        double allowed = seconds(Clock::now() - up.start) * config.rate;
+        if (allowed <= up.sent) {
+          up.throttled = true;
+          reactor.modify(up.sock.fd(), EPOLLRDHUP, &up);
+          return;
+        }
+        len = std::min<size_t>(len, allowed - up.sent);
+      }
+
+      /* the first TAG_BYTES are the index, the rest comes from payload */
+      char tag[TAG_BYTES];
+      memcpy(tag, &up.index, sizeof(tag));
+      const char* src = up.sent < TAG_BYTES ? tag + up.sent
+                                            : payload.data() + up.sent;
+      if (up.sent < TAG_BYTES) {
+        len = std::min<size_t>(len, TAG_BYTES - up.sent);
+      }
+
+      ssize_t n = up.sock.try_send(src, len);
+      if (n == -1) {
+        return;  // wait for EPOLLOUT
+      }
+      up.sent += n;
+    }
+
+    if (up.stall) {
+      reactor.modify(up.sock.fd(), EPOLLIN | EPOLLRDHUP, &up);
+    } else {
+      finish(up, true);
+    }
+
+  } catch (socket_closed_exception& e) {
+    finish(up, up.stall);
+  } catch (std::runtime_error& e) {
+    /* a reset is how some engines end a stalled upload */
+    if (!up.stall) {
+      std::cerr << "ERROR: upload " << up.index << ": " << e.what()
+                << std::endl;
+    }
+    finish(up, up.stall);
+  }
+}
+
+void Client::finish(Upload& up, bool ok) {
+  if (ok) {
+    completed++;
+    bytes += up.sent;
+  } else {
+    failed++;
+  }
+  live.erase(&up);  // closing the socket ends the upload
+}
+
+void Client::unthrottle() {
+  for (auto& it : live) {
+    Upload& up = *it.second;
+    if (up.throttled &&
+        seconds(Clock::now() - up.start) * config.rate > up.sent) {
+      up.throttled = false;
+      reactor.modify(up.sock.fd(), EPOLLOUT | EPOLLRDHUP, &up);
+    }
+  }
+}
+
+/* nearest-rank percentile of sorted samples */
+static double percentile(const std::vector<double>& sorted, double p) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  size_t rank = static_cast<size_t>(p / 100.0 * sorted.size());
+  return sorted[std::min(rank, sorted.size() - 1)];
+}
+
+/* matches the published files up with the uploads that made them */
+static void report(const std::string& dir, const std::vector<Planned>& plans,
+                   const std::vector<Published>& files, size_t bytes,
+                   double elapsed) {
+  std::vector<double> latency;
+  size_t timed_out = 0, wrong = 0;
+
+  for (const Published& file : files) {
+    std::string path = dir + "/" + file.name;
+    std::ifstream in{path, std::ios::binary};
+    char head[TAG_BYTES] = {0};
+    in.read(head, sizeof(head));
+
+    if (in.gcount() >= 5 && std::string{head, 5} == "ERROR") {
+      timed_out++;
+      continue;
+    }
+
+    uint64_t index;
+    memcpy(&index, head, sizeof(index));
+    struct stat st;
+    if (in.gcount() != TAG_BYTES || index >= plans.size() ||
+        stat(path.c_str(), &st) == -1 ||
+        static_cast<size_t>(st.st_size) != plans[index].size) {
+      wrong++;
+      continue;
+    }
+    latency.push_back(seconds(file.at - plans[index].start) * 1000);
+  }
+  std::sort(latency.begin(), latency.end());
+
+  std::cout << "uploads=" << plans.size() << " durable=" << latency.size()
+            << " timed_out=" << timed_out << " bad=" << wrong
+            << " missing=" << plans.size() - files.size() << std::endl;
+  std::cout << "MB/s=" << bytes / elapsed / 1e6
+            << " conn/s=" << latency.size() / elapsed << std::endl;
+  std::cout << "durable_ms p50=" << percentile(latency, 50)
+            << " p99=" << percentile(latency, 99)
+            << " p999=" << percentile(latency, 99.9)
+            << " max=" << (latency.empty() ? 0 : latency.back()) << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+  LoadConfig config;
+  int opt;
+
+  try {
+    while ((opt = getopt(argc, argv, "n:c:j:s:r:x:p:")) != -1) {
+      switch (opt) {
+        case 'n':
+          config.uploads = parse_count(opt, optarg, false);
+          break;
+        case 'c':
+          config.concurrency = parse_count(opt, optarg, false);
+          break;
+        case 'j':
+          config.threads = parse_count(opt, optarg, false);
+          break;
+        case 's': {
+          std::string arg{optarg};
+          size_t dash = arg.find('-');
+          config.min_size = parse_size(arg.substr(0, dash));
+          config.max_size = dash == std::string::npos
+                                ? config.min_size
+                                : parse_size(arg.substr(dash + 1));
+          break;
+        }
+        case 'r':
+          config.rate = parse_size(optarg);
+          break;
+        case 'x':
+          config.stalled = parse_count(opt, optarg, true);
+          break;
+        case 'p':
+          config.port = optarg;
+          break;
+        default:
+          std::cerr << "Usage: " << argv[0] << usage << std::endl;
+          return EXIT_FAILURE;
+      }
+    }
+    for (int i = optind; i < argc; i++) {
+      config.server_args.push_back(argv[i]);
+    }
+    if (config.min_size < TAG_BYTES || config.max_size < config.min_size) {
+      throw std::runtime_error{"sizes must be at least 8 bytes, low to high"};
+    }
+    config.threads = std::min(config.threads, config.concurrency);
+  } catch (std::runtime_error& e) {
+    std::cerr << "ERROR: " << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+
+  char dir_template[] = "/tmp/loadgen.XXXXXX";
+  if (mkdtemp(dir_template) == nullptr) {
+    std::cerr << "ERROR: mkdtemp(): " << strerror(errno) << std::endl;
+    return EXIT_FAILURE;
+  }
+  std::string dir{dir_template};
+
+  int status = EXIT_SUCCESS;
+  try {
+    std::vector<char> payload(config.max_size);
+    std::mt19937 fill{42};
+    for (char& c : payload) {
+      c = static_cast<char>(fill());
+    }
+
+    std::vector<Planned> plans(config.uploads);
+    std::atomic<size_t> next{0};
+    std::vector<std::unique_ptr<Client>> clients;
+    for (size_t i = 0; i < config.threads; i++) {
+      /* hand out the concurrency as evenly as it goes */
+      size_t slots = config.concurrency / config.threads +
+                     (i < config.concurrency % config.threads ? 1 : 0);
+      clients.emplace_back(new Client{config, slots, plans, next, payload});
+    }
+
+    std::string args;
+    for (const std::string& arg : config.server_args) {
+      args += " " + arg;
+    }
+    std::cout << "server:" << (args.empty() ? " (defaults)" : args)
+              << " uploads=" << config.uploads
+              << " concurrency=" << config.concurrency
+              << " threads=" << config.threads << std::endl;
+
+    pid_t server = start_server(config, dir);
+
+    std::atomic<bool> done{false};
+    std::atomic<size_t> seen{0};
+    std::vector<Published> files;
+    std::thread watcher{watch, dir, std::ref(done), std::ref(files),
+                        std::ref(seen)};
+
+    Clock::time_point start = Clock::now();
+    std::vector<std::thread> threads;
+    for (auto& client : clients) {
+      threads.emplace_back(&Client::run, client.get());
+    }
+    for (std::thread& t : threads) {
+      t.join();
+    }
+
+    /* the clients are done once their data is in the socket; the run is
+     * done once the server has published what it's going to */
+    size_t expected = 0, bytes = 0;
+    for (auto& client : clients) {
+      expected += client->completed;
+      bytes += client->bytes;
+    }
+    Clock::time_point deadline =
+        Clock::now() + std::chrono::seconds(SETTLE_SECONDS);
+    while (seen < expected && Clock::now() < deadline) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    done = true;
+    watcher.join();
+    double elapsed = seconds(Clock::now() - start);
+
+    stop_server(server);
+    report(dir, plans, files, bytes, elapsed);
+
+  } catch (std::runtime_error& e) {
+    std::cerr << "ERROR: " << e.what() << std::endl;
+    status = EXIT_FAILURE;
+  }
+
+  remove_dir(dir);
+  return status;
+}
@@ -0,0 +1,284 @@
+#include "metrics.hpp"
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#include <cerrno>
+#include <cstring>
+
+#define SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+
+void Histogram::record(uint64_t value) {
+  counts[bucket(value)].add();
+  sum.add(value);
+}
+
+size_t Histogram::bucket(uint64_t value) {
+  if (value < SUB_BUCKETS) {
+    return value;
+  }
+  /* the top HISTOGRAM_SUB_BITS bits below the leading one pick the bucket
+   * within its power of two */
+  unsigned shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+  return ((shift + 1) << HISTOGRAM_SUB_BITS) +
+         ((value >> shift) & (SUB_BUCKETS - 1));
+}
+
+uint64_t Histogram::upper_bound(size_t bucket) {
+  if (bucket < SUB_BUCKETS) {
+    return bucket;
+  }
+  unsigned shift = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+  uint64_t sub = SUB_BUCKETS + (bucket & (SUB_BUCKETS - 1));
+  uint64_t low = sub << shift;
+  return low + ((1ULL << shift) - 1);
+}
+
+/* Every thread's metrics, in the order they were first asked for. The lock
+ * is only taken to register a thread and to scrape, never to record. */
+static std::mutex registry_lock;
+static std::vector<std::unique_ptr<ThreadMetrics>> registry;
+
+ThreadMetrics& thread_metrics() {
+  static thread_local ThreadMetrics* mine = nullptr;
+  if (mine == nullptr) {
+    std::lock_guard<std::mutex> guard{registry_lock};
+    registry.emplace_back(new ThreadMetrics);
+    mine = registry.back().get();
+  }
+  return *mine;
+}
+
+/* A histogram summed over every thread */
+struct HistogramTotal {
+  HistogramTotal() : counts(HISTOGRAM_BUCKETS), sum(0) {}
+
+  void add(const Histogram& h) {
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+      counts[i] += h.count(i);
+    }
+    sum += h.total();
+  }
+
+  std::vector<uint64_t> counts;
+  uint64_t sum;
+};
+
+static void render_counter(std::ostream& out, const std::string& name,
+                           const std::string& help, uint64_t value,
+                           const std::string& type = "counter") {
+  out << "# HELP " << name << " " << help << "\n"
+      << "# TYPE " << name << " " << type << "\n"
+      << name << " " << value << "\n";
+}
+
+/* Cumulative buckets, as Prometheus wants them. Empty buckets would only
+ * repeat the count before them, so they're left out. values are divided by
+ * scale on the way out (microseconds to seconds, say). */
+static void render_histogram(std::ostream& out, const std::string& name,
+                             const std::string& help, const HistogramTotal& h,
+                             double scale) {
+  out << "# HELP " << name << " " << help << "\n"
+      << "# TYPE " << name << " histogram\n";
+
+  uint64_t cumulative = 0;
+  for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    if (h.counts[i] == 0) {
+      continue;
+    }
+    cumulative += h.counts[i];
+    out << name << "_bucket{le=\"" << Histogram::upper_bound(i) / scale
+        << "\"} " << cumulative << "\n";
+  }
+  out << name << "_bucket{le=\"+Inf\"} " << cumulative << "\n"
+      << name << "_sum " << h.sum / scale << "\n"
+      << name << "_count " << cumulative << "\n";
+}
+
+std::string render_metrics() {
+  uint64_t accepted = 0, rejected = 0, completed = 0, timed_out = 0,
+           failed = 0, bytes = 0, stored = 0, reused = 0, bytes_reused = 0,
+           mismatches = 0, rounds = 0, fetches = 0, sent = 0,
+           throttled = 0;
+  HistogramTotal recv_bytes, write_latency, upload_duration, commit_batch;
+
+  {
+    std::lock_guard<std::mutex> guard{registry_lock};
+    for (auto& m : registry) {
+      accepted += m->accepted.get();
+      rejected += m->rejected.get();
+      completed += m->completed.get();
+      timed_out += m->timed_out.get();
+      failed += m->failed.get();
+      bytes += m->bytes_received.get();
+      stored += m->chunks_stored.get();
+      reused += m->chunks_reused.get();
+      bytes_reused += m->bytes_reused.get();
+      mismatches += m->checksum_mismatches.get();
+      rounds += m->commit_rounds.get();
+      fetches += m->fetches.get();
+      sent += m->bytes_sent.get();
+      throttled += m->throttled.get();
+      recv_bytes.add(m->recv_bytes);
+      write_latency.add(m->write_latency);
+      upload_duration.add(m->upload_duration);
+      commit_batch.add(m->commit_batch);
+    }
+  }
+
+  /* the counters are read one at a time, so a connection may have been
+   * counted as finished but not yet as accepted */
+  uint64_t finished = completed + timed_out + failed + fetches;
+  uint64_t active = accepted > finished ? accepted - finished : 0;
+
+  std::ostringstream out;
+  out.precision(9);
+  render_counter(out, "accio_connections_accepted_total",
+                 "Connections accepted and given a file.", accepted);
+  render_counter(out, "accio_connections_rejected_total",
+                 "Connections reset by admission control.", rejected);
+  render_counter(out, "accio_connections_active",
+                 "Connections being serviced right now.", active, "gauge");
+  render_counter(out, "accio_uploads_completed_total",
+                 "Uploads the client closed and that were published.",
+                 completed);
+  render_counter(out, "accio_uploads_timed_out_total",
+                 "Uploads replaced by ERROR after the idle timeout.",
+                 timed_out);
+  render_counter(out, "accio_uploads_failed_total",
+                 "Uploads cut short by an I/O error.", failed);
+  render_counter(out, "accio_received_bytes_total",
+                 "Bytes received from clients.", bytes);
+  render_counter(out, "accio_dedup_chunks_stored_total",
+                 "Chunks written to the deduplicating store.", stored);
+  render_counter(out, "accio_dedup_chunks_reused_total",
+                 "Chunks the deduplicating store already held.", reused);
+  render_counter(out, "accio_dedup_reused_bytes_total",
+                 "Bytes of uploads that were not stored again.",
+                 bytes_reused);
+  render_counter(out, "accio_checksum_mismatches_total",
+                 "Checked uploads whose CRC32C didn't match the client's.",
+                 mismatches);
+  render_counter(out, "accio_commit_rounds_total",
+                 "Group commits: syncs shared by every upload queued.",
+                 rounds);
+  render_counter(out, "accio_fetches_total",
+                 "Stored files (or ranges of them) sent back in full.",
+                 fetches);
+  render_counter(out, "accio_sent_bytes_total",
+                 "Bytes of stored files sent to clients.", sent);
+  render_counter(out, "accio_throttled_total",
+                 "Times a connection was held back by a bandwidth limit.",
+                 throttled);
+  render_histogram(out, "accio_recv_bytes",
+                   "Bytes moved off a socket per recv() or splice().",
+                   recv_bytes, 1);
+  render_histogram(out, "accio_write_latency_seconds",
+                   "Time to write one chunk of received data to its file.",
+                   write_latency, 1e6);
+  render_histogram(out, "accio_upload_duration_seconds",
+                   "Time from accepting a connection to its file appearing.",
+                   upload_duration, 1e6);
+  render_histogram(out, "accio_commit_batch_uploads",
+                   "Uploads made durable by one group commit.", commit_batch,
+                   1);
+  return out.str();
+}
+
+StatsSocket::StatsSocket(const std::string& path)
+    : path(path), wakeup(FileDescriptor::eventfd()) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    throw std::runtime_error{"stats socket path too long: " + path};
+  }
+  strcpy(addr.sun_path, path.c_str());
+
+  sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sockfd == -1) {
+    throw std::runtime_error{"socket(): " + std::string{strerror(errno)}};
+  }
+
+  /* a socket file left behind by a server that didn't get to clean up */
+  unlink(path.c_str());
+  struct stat st;
+  if (bind(sockfd, reinterpret_cast<struct sockaddr*>(&addr),
+           sizeof(addr)) == -1 ||
+      listen(sockfd, STATS_BACKLOG) == -1 || stat(path.c_str(), &st) == -1) {
+    std::string err{strerror(errno)};
+    close(sockfd);
+    throw std::runtime_error{"bind(" + path + "): " + err};
+  }
+  inode = st.st_ino;
+
+  thread = std::thread{&StatsSocket::serve, this};
+}
+
+StatsSocket::~StatsSocket() {
+  uint64_t one = 1;
+  if (write(wakeup.raw(), &one, sizeof(one)) == -1) {
+    std::cerr << "ERROR: write(eventfd): " << strerror(errno) << std::endl;
+  }
+  thread.join();
+  close(sockfd);
+
+  struct stat st;
+  if (stat(path.c_str(), &st) == 0 && st.st_ino == inode) {
+    unlink(path.c_str());
+  }
+}
+
+void StatsSocket::serve() {
+  struct pollfd fds[2] = {{sockfd, POLLIN, 0}, {wakeup.raw(), POLLIN, 0}};
+
+  while (true) {
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      std::cerr << "ERROR: poll(): " << strerror(errno) << std::endl;
+      return;
+    }
+    if (fds[1].revents & POLLIN) {
+      return;
+    }
+
+    int client = accept4(sockfd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (client == -1) {
+      continue;
+    }
+
+    /* a reader that stops reading mustn't wedge the stats thread */
+    struct timeval timeout = {1, 0};
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    std::string text = render_metrics();
+    const char* data = text.data();
+    size_t left = text.size();
+    while (left > 0) {
+      ssize_t n = send(client, data, left, MSG_NOSIGNAL);
+      if (n == -1 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        break;
+      }
+      data += n;
+      left -= n;
+    }
+    close(client);
+  }
+}
@@ -0,0 +1,131 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include "file.hpp"
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <thread>
+
+#define HISTOGRAM_SUB_BITS 3  // 8 buckets per power of two, within 12.5%
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+#define STATS_BACKLOG 16
+
+/* A count that only its own thread ever adds to. No read-modify-write is
+ * needed for that, just a relaxed store the scraper can read at any time. */
+class Counter {
+ public:
+  Counter() : val(0) {}
+  Counter(const Counter&) = delete;
+
+  Counter& operator=(const Counter&) = delete;
+
+  void add(uint64_t n = 1) {
+    val.store(val.load(std::memory_order_relaxed) + n,
+              std::memory_order_relaxed);
+  }
+  uint64_t get() const { return val.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<uint64_t> val;
+};
+
+/* An HDR-style histogram: values below 2^HISTOGRAM_SUB_BITS get a bucket
+ * each, and every power of two above that is split into as many linear
+ * buckets, so any uint64_t is recorded to within 12.5% in a fixed 496
+ * counters. Written by one thread, like Counter. */
+class Histogram {
+ public:
+  Histogram() {}
+  Histogram(const Histogram&) = delete;
+
+  Histogram& operator=(const Histogram&) = delete;
+
+  void record(uint64_t value);
+  uint64_t count(size_t bucket) const { return counts[bucket].get(); }
+  uint64_t total() const { return sum.get(); }  // of every value recorded
+
+  static size_t bucket(uint64_t value);
+  static uint64_t upper_bound(size_t bucket);  // largest value in bucket
+
+ private:
+  Counter counts[HISTOGRAM_BUCKETS];
+  Counter sum;
+};
+
+/* Everything one thread knows about the uploads it has serviced. Each thread
+ * that touches a connection gets its own (see thread_metrics()), so the hot
+ * path never shares a cache line, let alone a lock, with another thread.
+ * Durations are in microseconds. */
+struct ThreadMetrics {
+  Counter accepted;
+  Counter rejected;   // reset by admission control, never numbered
+  Counter completed;  // client closed; the file was published
+  Counter timed_out;
+  Counter failed;
+  Counter bytes_received;
+  Counter chunks_stored;  // dedup: new chunks written to the store
+  Counter chunks_reused;  // ...and chunks that were there already
+  Counter bytes_reused;
+  Counter checksum_mismatches;  // checked uploads that didn't match
+  Counter commit_rounds;        // group commits, see durable.hpp
+  Counter fetches;              // fetches answered in full (fetch.hpp)
+  Counter bytes_sent;           // of fetched files
+  Counter throttled;            // reads held back by a bandwidth limit
+
+  Histogram recv_bytes;       // per recv() or splice() off a socket
+  Histogram write_latency;    // per write of received data into a file
+  Histogram upload_duration;  // accept to published (or ERROR) file
+  Histogram commit_batch;     // uploads made durable per group commit
+};
+
+/* this thread's metrics, created the first time it asks; they outlive the
+ * thread so its counts aren't lost when a worker exits */
+ThreadMetrics& thread_metrics();
+
+/* every thread's metrics added up, in the Prometheus text format */
+std::string render_metrics();
+
+/* times a block for one of the duration histograms */
+class Stopwatch {
+ public:
+  Stopwatch() : start(std::chrono::steady_clock::now()) {}
+
+  uint64_t micros() const {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now() - start)
+        .count();
+  }
+
+ private:
+  std::chrono::steady_clock::time_point start;
+};
+
+/* A Unix-domain socket that answers every connection with render_metrics()
+ * and hangs up, so `socat - UNIX-CONNECT:PATH` (or a scraper's exporter)
+ * reads the current numbers. It runs on a thread of its own until
+ * destroyed, and removes the socket file when it goes, unless a server that
+ * took over from this one (see upgrade.hpp) has bound its own there. */
+class StatsSocket {
+ public:
+  explicit StatsSocket(const std::string& path);
+  StatsSocket(const StatsSocket&) = delete;
+  ~StatsSocket();
+
+  StatsSocket& operator=(const StatsSocket&) = delete;
+
+ private:
+  void serve();
+
+  std::string path;
+  int sockfd;
+  ino_t inode;  // of the socket file we bound
+  FileDescriptor wakeup;  // eventfd, becomes readable on destruction
+  std::thread thread;
+};
+
+#endif // METRICS_HPP
@@ -0,0 +1,80 @@
+#include "pool.hpp"
+
+#include <utility>
+
+ThreadPool::ThreadPool(size_t n, size_t queue_depth)
+    : depth(queue_depth), busy(0), stopping(false) {
+  workers.reserve(n);
+  for (size_t i = 0; i < n; i++) {
+    workers.emplace_back(&ThreadPool::work, this);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  shutdown();
+}
+
+bool ThreadPool::submit(Task task) {
+  std::unique_lock<std::mutex> guard{lock};
+  not_full.wait(guard, [this] { return stopping || tasks.size() < depth; });
+  if (stopping) {
+    return false;
+  }
+  tasks.push_back(std::move(task));
+  not_empty.notify_one();
+  return true;
+}
+
+bool ThreadPool::try_submit(Task task) {
+  std::lock_guard<std::mutex> guard{lock};
+  if (stopping || tasks.size() >= depth) {
+    return false;
+  }
+  tasks.push_back(std::move(task));
+  not_empty.notify_one();
+  return true;
+}
+
+size_t ThreadPool::load() {
+  std::lock_guard<std::mutex> guard{lock};
+  return tasks.size() + busy;
+}
+
+void ThreadPool::shutdown() {
+  {
+    std::lock_guard<std::mutex> guard{lock};
+    if (stopping && workers.empty()) {
+      return;
+    }
+    stopping = true;
+  }
+  not_empty.notify_all();
+  not_full.notify_all();
+
+  for (std::thread& t : workers) {
+    t.join();
+  }
+  workers.clear();
+}
+
+void ThreadPool::work() {
+  while (true) {
+    Task task;
+    {
+      std::unique_lock<std::mutex> guard{lock};
+      not_empty.wait(guard, [this] { return stopping || !tasks.empty(); });
+      if (tasks.empty()) {
+        return;  // stopping, and nothing left to drain
+      }
+      task = std::move(tasks.front());
+      tasks.pop_front();
+      busy++;
+    }
+    not_full.notify_one();
+
+    task();
+
+    std::lock_guard<std::mutex> guard{lock};
+    busy--;
+  }
+}
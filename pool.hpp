@@ -0,0 +1,51 @@
+#ifndef POOL_HPP
+#define POOL_HPP
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* A fixed number of worker threads fed from a bounded FIFO of tasks.
+ *
+ * submit() blocks while the queue is full, which is how a producer that can
+ * afford to wait (an accept loop) gets back-pressure; try_submit() fails
+ * instead, for producers that would rather shed the work. Destroying the pool
+ * runs whatever is still queued and joins every worker. */
+class ThreadPool {
+ public:
+  typedef std::function<void()> Task;
+
+  ThreadPool(size_t workers, size_t queue_depth);
+  ThreadPool(const ThreadPool&) = delete;
+  ~ThreadPool();
+
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  /* both return false once the pool is shutting down */
+  bool submit(Task task);
+  bool try_submit(Task task);
+
+  /* tasks that are queued or running */
+  size_t load();
+
+  /* stop taking new tasks, finish the queued ones and join the workers */
+  void shutdown();
+
+ private:
+  void work();
+
+  std::mutex lock;
+  std::condition_variable not_empty;
+  std::condition_variable not_full;
+  std::deque<Task> tasks;
+  std::vector<std::thread> workers;
+  size_t depth;
+  size_t busy;
+  bool stopping;
+};
+
+#endif // POOL_HPP
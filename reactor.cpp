@@ -0,0 +1,62 @@
+#include "reactor.hpp"
+
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+Reactor::Reactor() {
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd == -1) {
+    throw std::runtime_error{"epoll_create1(): " +
+                             std::string{strerror(errno)}};
+  }
+}
+
+Reactor::~Reactor() {
+  if (epfd > 0) {
+    close(epfd);
+  }
+}
+
+void Reactor::add(int fd, uint32_t events, void* data) {
+  struct epoll_event ev;
+  ev.events = events;
+  ev.data.ptr = data;
+
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+    throw std::runtime_error{"epoll_ctl(ADD): " +
+                             std::string{strerror(errno)}};
+  }
+}
+
+void Reactor::modify(int fd, uint32_t events, void* data) {
+  struct epoll_event ev;
+  ev.events = events;
+  ev.data.ptr = data;
+
+  if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) == -1) {
+    throw std::runtime_error{"epoll_ctl(MOD): " +
+                             std::string{strerror(errno)}};
+  }
+}
+
+void Reactor::remove(int fd) {
+  /* closing a descriptor removes it from the epoll set anyway, so a failure
+   * here is never worth tearing down the event loop for */
+  epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+int Reactor::wait(int timeout_ms) {
+  int n = epoll_wait(epfd, events, MAX_EVENTS, timeout_ms);
+  if (n == -1) {
+    if (errno == EINTR) {
+      return 0;
+    }
+    throw std::runtime_error{"epoll_wait(): " + std::string{strerror(errno)}};
+  }
+  return n;
+}
@@ -0,0 +1,35 @@
+#ifndef REACTOR_HPP
+#define REACTOR_HPP
+
+#include <sys/epoll.h>
+
+#include <cstdint>
+
+#define MAX_EVENTS 64
+
+/* A thin wrapper around an epoll instance. The Reactor only knows about file
+ * descriptors and opaque pointers; deciding what to do with a ready event is
+ * left to whoever registered it (see Server::start_evented). */
+class Reactor {
+ public:
+  Reactor();
+  Reactor(const Reactor&) = delete;
+  ~Reactor();
+
+  Reactor& operator=(const Reactor&) = delete;
+
+  void add(int fd, uint32_t events, void* data);
+  void modify(int fd, uint32_t events, void* data);
+  void remove(int fd);
+
+  /* blocks until at least one event is ready or timeout_ms elapses; returns
+   * the number of ready events (0 on timeout or if interrupted by a signal) */
+  int wait(int timeout_ms);
+  const struct epoll_event& event(int i) const { return events[i]; }
+
+ private:
+  int epfd;
+  struct epoll_event events[MAX_EVENTS];
+};
+
+#endif // REACTOR_HPP
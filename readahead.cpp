@@ -0,0 +1,109 @@
+#include "readahead.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+ReadAhead::ReadAhead(int fd, off_t offset)
+    : fd(fd), offset(offset), slots(READAHEAD_SLOTS), lens(READAHEAD_SLOTS),
+      head(0), ready(0), busy(0), stopping(false), chunk(READAHEAD_MIN),
+      calls(0) {
+  /* left uninitialised: pages the reads never reach are never touched */
+  for (auto& slot : slots) {
+    slot.reset(new char[READAHEAD_MAX]);
+  }
+  reader = std::thread{&ReadAhead::run, this};
+}
+
+ReadAhead::~ReadAhead() {
+  {
+    std::lock_guard<std::mutex> guard{lock};
+    stopping = true;
+  }
+  changed.notify_all();
+  reader.join();
+}
+
+ReadAhead::Chunk ReadAhead::next() {
+  std::unique_lock<std::mutex> guard{lock};
+  changed.wait(guard, [this] { return ready > 0 || !error.empty(); });
+  if (ready == 0) {
+    throw std::runtime_error{error};
+  }
+  ready--;
+  return Chunk{slots[head].get(), lens[head]};
+}
+
+void ReadAhead::release() {
+  {
+    std::lock_guard<std::mutex> guard{lock};
+    head = (head + 1) % READAHEAD_SLOTS;
+    busy--;
+  }
+  changed.notify_all();
+}
+
+void ReadAhead::resize(size_t len) {
+  chunk = std::min<size_t>(std::max<size_t>(len, READAHEAD_MIN),
+                           READAHEAD_MAX);
+}
+
+void ReadAhead::run() {
+  posix_fadvise(fd, offset, 0, POSIX_FADV_SEQUENTIAL);
+  size_t tail = 0;
+
+  while (true) {
+    {
+      std::unique_lock<std::mutex> guard{lock};
+      changed.wait(guard,
+                   [this] { return stopping || busy < READAHEAD_SLOTS; });
+      if (stopping) {
+        return;
+      }
+    }
+
+    /* the slot is ours until it's counted as ready */
+    size_t want = chunk;
+    char* buf = slots[tail].get();
+
+    /* while this read runs, the kernel can already fetch the ones after */
+    posix_fadvise(fd, offset + want, want * READAHEAD_SLOTS,
+                  POSIX_FADV_WILLNEED);
+
+    size_t got = 0;
+    while (got < want) {
+      calls++;
+      ssize_t n = pread(fd, buf + got, want - got, offset + got);
+      if (n == -1 && errno == EINTR) {
+        continue;
+      }
+      if (n == -1) {
+        std::lock_guard<std::mutex> guard{lock};
+        error = "pread(): " + std::string{strerror(errno)};
+        changed.notify_all();
+        return;
+      }
+      if (n == 0) {
+        break;
+      }
+      got += n;
+    }
+
+    {
+      std::lock_guard<std::mutex> guard{lock};
+      lens[tail] = got;
+      ready++;
+      busy++;
+    }
+    changed.notify_all();
+    if (got == 0) {
+      return;  // the caller gets the empty chunk as the end of the file
+    }
+    offset += got;
+    tail = (tail + 1) % READAHEAD_SLOTS;
+  }
+}
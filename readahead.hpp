@@ -0,0 +1,73 @@
+#ifndef READAHEAD_HPP
+#define READAHEAD_HPP
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define READAHEAD_SLOTS 4            // buffers in the ring
+#define READAHEAD_MIN 65536          // smallest read, and the first one
+#define READAHEAD_MAX (4 << 20)      // largest read
+#define READAHEAD_TARGET_MS 20       // how long one buffer should take to send
+
+/* A file read ahead of the socket it's being sent to.
+ *
+ * Reading and sending one block at a time leaves the disk idle while the
+ * socket drains and the socket idle while the disk seeks; on a network file
+ * system every read is a round trip. Here a reader thread fills a ring of
+ * READAHEAD_SLOTS buffers, with posix_fadvise() telling the kernel what it
+ * will want next, while the caller sends whatever is ready. The caller also
+ * says (resize()) how much each read should fetch, so a fast socket gets
+ * large reads and a slow one doesn't have megabytes held up behind it. */
+class ReadAhead {
+ public:
+  struct Chunk {
+    const char* data;
+    size_t len;  // 0 once the file is done
+  };
+
+  ReadAhead(int fd, off_t offset);
+  ReadAhead(const ReadAhead&) = delete;
+  ~ReadAhead();  // stops the reader, wherever it is
+
+  ReadAhead& operator=(const ReadAhead&) = delete;
+
+  /* waits for the next buffer the reader has filled; rethrows whatever
+   * error stopped the reader */
+  Chunk next();
+
+  /* hands the buffer next() returned back to the reader */
+  void release();
+
+  /* bytes per read from now on, clamped to READAHEAD_MIN..READAHEAD_MAX */
+  void resize(size_t len);
+
+  size_t reads() const { return calls; }  // read system calls so far
+
+ private:
+  void run();
+
+  int fd;
+  off_t offset;  // where the reader's next read starts
+  std::vector<std::unique_ptr<char[]>> slots;  // READAHEAD_MAX each
+  std::vector<size_t> lens;
+  size_t head;   // next slot the caller takes
+  size_t ready;  // slots filled and waiting for the caller
+  size_t busy;   // ...plus the one the caller has, if any
+  bool stopping;
+  std::string error;
+  std::atomic<size_t> chunk;
+  std::atomic<size_t> calls;
+  std::mutex lock;
+  std::condition_variable changed;
+  std::thread reader;
+};
+
+#endif // READAHEAD_HPP
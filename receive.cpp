@@ -0,0 +1,72 @@
+#include "receive.hpp"
+#include "metrics.hpp"
+#include "ring.hpp"
+#include "socket.hpp"
+#include "timer.hpp"
+
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+
+UploadFile::UploadFile(Layout::Dir dir, int id, bool direct,
+                       ChunkStore* chunks)
+    : dir(std::move(dir)), spool(*this->dir, std::to_string(id) + ".file"),
+      writer(spool.file(), direct),
+      dedup(chunks ? new Deduper{*chunks, spool.file()} : nullptr) {}
+
+void UploadFile::write(const char* data, size_t len) {
+  if (dedup) {
+    dedup->write(data, len);
+  } else {
+    writer.write(data, len);
+  }
+}
+
+void count_received(size_t len) {
+  ThreadMetrics& m = thread_metrics();
+  m.recv_bytes.record(len);
+  m.bytes_received.add(len);
+}
+
+uint64_t charge(Throttle* throttle, Throttle::Quota& quota, size_t n) {
+  if (!throttle) {
+    return 0;
+  }
+  uint64_t wait = throttle->charge(quota, n);
+  if (wait > 0) {
+    thread_metrics().throttled.add();
+  }
+  return wait;
+}
+
+void hold(Throttle* throttle, Throttle::Quota& quota, size_t n,
+          const std::atomic<bool>& running) {
+  uint64_t wait = charge(throttle, quota, n);
+  while (wait > 0 && running) {
+    uint64_t slice = std::min<uint64_t>(wait, TICK_MS * 1000);
+    std::this_thread::sleep_for(std::chrono::microseconds(slice));
+    wait -= slice;
+  }
+}
+
+void receive_upload(ConnectedSocket& sock, RingBuffer& ring, Digest& digest,
+                    UploadFile& upload, Throttle* throttle,
+                    Throttle::Quota& quota, const std::atomic<bool>& running) {
+  struct iovec iov[2];
+
+  while (1) {
+    sock.await();
+    size_t n = sock.recvv(iov, ring.space(iov));
+    ring.produced(n);
+    count_received(n);
+    for (int i = 0, pieces = ring.filled(iov); i < pieces; i++) {
+      char* data = static_cast<char*>(iov[i].iov_base);
+      upload.write(data, digest.feed(data, iov[i].iov_len));
+    }
+    ring.consumed(n);
+    hold(throttle, quota, n, running);
+  }
+}
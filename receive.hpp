@@ -0,0 +1,57 @@
+#ifndef RECEIVE_HPP
+#define RECEIVE_HPP
+
+#include "checksum.hpp"
+#include "dedup.hpp"
+#include "layout.hpp"
+#include "spool.hpp"
+#include "throttle.hpp"
+#include "writer.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+class ConnectedSocket;
+class RingBuffer;
+
+/* A plain upload's file while it's being received, and what writes to it,
+ * for the evented and threaded engines. Only opened once the first bytes
+ * show that a connection is one: streams and fetches never need it. */
+struct UploadFile {
+  UploadFile(Layout::Dir dir, int id, bool direct, ChunkStore* chunks);
+
+  /* len bytes of the upload, into dedup if there is one, else writer */
+  void write(const char* data, size_t len);
+
+  Layout::Dir dir;  // where its file goes, held open for spool
+  Spool spool;
+  WriteBehind writer;  // after spool, whose file it writes to
+  std::unique_ptr<Deduper> dedup;  // with a chunk store; writer goes unused
+};
+
+/* counts len bytes read off a socket in this thread's metrics */
+void count_received(size_t len);
+
+/* charges quota for n bytes received, if there are bandwidth limits
+ * (throttle isn't null); returns how many microseconds the connection
+ * should hold off for */
+uint64_t charge(Throttle* throttle, Throttle::Quota& quota, size_t n);
+
+/* charge() for a blocking connection: sleeps off whatever it owes, a tick
+ * at a time so a server that stops (clears running) isn't kept waiting */
+void hold(Throttle* throttle, Throttle::Quota& quota, size_t n,
+          const std::atomic<bool>& running);
+
+/* The threaded engine's copy loop for a plain upload: waits for data on a
+ * blocking socket, reads it into ring and passes it through digest into the
+ * upload's file, counting and charging every read, until the client closes
+ * (socket_closed_exception) or goes quiet for longer than SO_RCVTIMEO
+ * (socket_timeout_error). Once the writer has its segments, a pass round it
+ * allocates nothing; test/alloc holds it to that. */
+void receive_upload(ConnectedSocket& sock, RingBuffer& ring, Digest& digest,
+                    UploadFile& upload, Throttle* throttle,
+                    Throttle::Quota& quota, const std::atomic<bool>& running);
+
+#endif // RECEIVE_HPP
@@ -0,0 +1,40 @@
+/*
+ * Puts back together a file that a server running with -D stored as a
+ * manifest of deduplicated chunks.
+ *
+ *
+ * USAGE
+ *   ./restore <FILE-DIR> <MANIFEST> <OUTPUT>
+ *
+ * file-dir:  the server's file directory, which holds the chunk store
+ * manifest:  the <id>.file the server wrote for the upload
+ * output:    where to write the original upload
+ *
+ * Every chunk is checked against its digest on the way, so a damaged store
+ * makes this fail (with an ERROR: message and a nonzero exit code) rather
+ * than write a wrong file.
+ */
+#include "dedup.hpp"
+#include "file.hpp"
+
+#include <cstdlib>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+int main(int argc, char* argv[]) {
+  if (argc != 4) {
+    std::cerr << "Usage: " << argv[0] << " <FILE-DIR> <MANIFEST> <OUTPUT>"
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  try {
+    std::string manifest = FileDescriptor::open_r(argv[2]).read_all();
+    FileDescriptor out = FileDescriptor::create_w(argv[3]);
+    restore_manifest(argv[1], manifest, out);
+  } catch (std::runtime_error& e) {
+    std::cerr << "ERROR: " << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+}
@@ -0,0 +1,56 @@
+#include "ring.hpp"
+
+#include <algorithm>
+
+RingBuffer::RingBuffer(BufferPool& pool) : pool(pool), head(0), len(0) {}
+
+int RingBuffer::space(struct iovec iov[2]) {
+  size_t cap = capacity();
+  if (len == cap) {
+    return 0;
+  }
+  if (!buf.held()) {
+    buf = pool.borrow();
+  }
+
+  size_t tail = (head + len) % cap;
+  size_t end = tail < head ? head : cap;
+  iov[0].iov_base = buf.data() + tail;
+  iov[0].iov_len = end - tail;
+  if (tail < head || head == 0) {
+    return 1;
+  }
+  iov[1].iov_base = buf.data();
+  iov[1].iov_len = head;
+  return 2;
+}
+
+int RingBuffer::filled(struct iovec iov[2]) const {
+  if (len == 0) {
+    return 0;
+  }
+
+  size_t cap = capacity();
+  size_t first = std::min(len, cap - head);
+  iov[0].iov_base = buf.data() + head;
+  iov[0].iov_len = first;
+  if (first == len) {
+    return 1;
+  }
+  iov[1].iov_base = buf.data();
+  iov[1].iov_len = len - first;
+  return 2;
+}
+
+void RingBuffer::produced(size_t n) {
+  len += n;
+}
+
+void RingBuffer::consumed(size_t n) {
+  len -= n;
+  head = (head + n) % capacity();
+  if (len == 0) {
+    head = 0;
+    buf = BufferPool::Buffer{};
+  }
+}
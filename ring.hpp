@@ -0,0 +1,45 @@
+#ifndef RING_HPP
+#define RING_HPP
+
+#include "slab.hpp"
+
+#include <sys/uio.h>
+
+#include <cstddef>
+
+/* A byte ring over one pooled buffer, for a connection to read into and
+ * drain from again and again without a fresh allocation each time round.
+ *
+ * space() hands out the free part as at most two iovecs (it wraps around
+ * the end of the buffer), ready for ConnectedSocket::recvv(), and produced()
+ * says how much of it got filled; filled() and consumed() are the same from
+ * the other end. The buffer is only borrowed while the ring holds data or
+ * space() has been asked for it, and goes back to its pool whenever the ring
+ * drains, so like a plain borrow it costs an idle connection nothing. An
+ * empty ring also starts over at the front of its buffer, so a consumer that
+ * keeps up always sees its data in one piece. */
+class RingBuffer {
+ public:
+  explicit RingBuffer(BufferPool& pool);
+  RingBuffer(const RingBuffer&) = delete;
+
+  RingBuffer& operator=(const RingBuffer&) = delete;
+
+  /* both return how many of the two iovecs they filled in, 0 if none */
+  int space(struct iovec iov[2]);
+  int filled(struct iovec iov[2]) const;
+
+  void produced(size_t n);
+  void consumed(size_t n);
+
+  size_t size() const { return len; }
+  size_t capacity() const { return pool.size(); }
+
+ private:
+  BufferPool& pool;
+  BufferPool::Buffer buf;  // held only while needed (see above)
+  size_t head;             // where the oldest byte is
+  size_t len;              // bytes held, from head on, wrapping around
+};
+
+#endif // RING_HPP
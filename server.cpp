@@ -4,11 +4,76 @@
  *
  *
  * USAGE
- *   ./server <PORT> <FILE-DIR>
+ *   ./server [-e epoll|uring|threaded] [-t THREADS] [-c MAX-CONNS] [-r]
+ *            [-i splice|copy] [-s SHARDS] [-p] [-d] [-v] [-m STATS-SOCKET]
+ *            [-k SECONDS] [-x MAX-MIB] [-D] [-C] [-l FILES-PER-DIR]
+ *            [-f none|close|group] [-q LIMITS-FILE] [-u UPGRADE-SOCKET]
+ *            [-T TRACE-FILE] <PORT> <FILE-DIR>
  *
  * port:      the port number on which the server will listen to connections;
  *            the server must accept connections coming from any interface
  * file-dir:  directory name where to save the received files
+ * -e:        engine used to service clients; "epoll" (the default) runs a
+ *            nonblocking event loop, "uring" runs the same kind of
+ *            loop on io_uring (falling back to epoll if the kernel can't),
+ *            "threaded" hands each connection to a fixed pool of workers
+ * -t:        number of worker threads for the threaded engine
+ * -c:        most connections serviced (or waiting for a worker) at once;
+ *            past that the server stops accepting until one finishes
+ * -r:        reset connections past the -c limit instead of leaving them in
+ *            the listen backlog
+ * -i:        how received data reaches the disk; "splice" (the default)
+ *            moves it from the socket to the file through a pipe without
+ *            copying it into the server, "copy" reads it into a buffer and
+ *            writes it back out. splice falls back to copy on its own where
+ *            the kernel won't splice a socket or file
+ * -s:        number of listening sockets bound to the port with SO_REUSEPORT,
+ *            each with its own accept loop on its own thread (and, for epoll
+ *            and uring, its own event loop, so -c applies to each)
+ * -p:        pin each shard's thread to a CPU of its own
+ * -d:        write files with O_DIRECT (epoll and threaded engines) so large
+ *            uploads don't push everything else out of the page cache,
+ *            where the file system allows it; implies -i copy, since
+ *            spliced data can't be kept aligned
+ * -v:        on exit, report how many pooled I/O buffers were in use at
+ *            most and how much memory the pools hold
+ * -m:        serve live metrics (connections, bytes, outcomes, and
+ *            histograms of recv sizes, write latency and upload duration)
+ *            in the Prometheus text format on a Unix-domain socket at this
+ *            path; SIGUSR1 dumps the same text to stderr with or without it
+ * -k:        how long the partial data of a resumable upload (see
+ *            frames.hpp) is kept for the client to come back and finish it,
+ *            in seconds (default 600)
+ * -x:        largest multi-stream or resumable upload accepted, in MiB
+ *            (default 1024); a stream that announces a larger file fails
+ * -D:        deduplicate: cut every plain upload into content-defined
+ *            chunks, keep each distinct chunk once under FILE-DIR/.chunks
+ *            and make <id>.file a manifest of them (see dedup.hpp), which
+ *            ./restore turns back into the upload; implies -i copy, and
+ *            the uring engine falls back to epoll. Multi-stream and
+ *            resumable uploads are stored whole as before
+ * -C:        compute a CRC32C of every plain upload as it arrives and leave
+ *            it in <id>.file.crc32c (see checksum.hpp); implies -i copy.
+ *            Uploads the client checks itself (./client -c) get one either
+ *            way
+ * -l:        spread the files over subdirectories of FILE-DIR with at most
+ *            this many in each, FILE-DIR/<xxx>/<yyy>/<id>.file (see
+ *            layout.hpp), instead of putting them all in FILE-DIR itself
+ * -f:        when uploads are made durable (see durable.hpp): "none" (the
+ *            default) leaves it to the page cache, "close" syncs each file
+ *            and its directory before publishing it and closing the
+ *            connection, "group" does the same for every upload finished
+ *            since the last round at once, from a thread of its own
+ * -q:        bandwidth limits, read from this file (see throttle.hpp) and
+ *            read again on every SIGHUP
+ * -u:        hot upgrades through a Unix-domain socket at this path (see
+ *            upgrade.hpp): if a server is already listening there, take
+ *            over its listening sockets and connection ids instead of
+ *            binding PORT, and let it finish its uploads and exit; either
+ *            way, listen there for the next server to hand over to
+ * -T:        on every SIGUSR2 and on exit, write what the tracepoints
+ *            recorded (see trace.hpp) to this file as Chrome trace JSON;
+ *            only a build made with `make -B TRACE=1` has any
  *
  *
  * REQUIREMENTS
@@ -33,16 +98,27 @@
  *   - The server should be able to accept and save files up to 100 MiB
  */
 #include "server.hpp"
+#include "reactor.hpp"
+#include "ring.hpp"
+#include "slab.hpp"
 #include "socket.hpp"
+#include "spool.hpp"
+#include "trace.hpp"
 
 #include <fcntl.h>
 #include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <chrono>
+#include <exception>
 #include <stdexcept>
 #include <iostream>
 #include <string>
@@ -50,16 +126,225 @@
 #include <vector>
 
 #include <cerrno>
+#include <climits>
 #include <cstring>
 #include <cstdlib>
 
-Server::Server(const std::string& port, const std::string& file_directory)
-    : sock(port), n_conn(1) {
+Connection::Connection(ConnectedSocket sock, int id,
+                       const ServerConfig& config)
+    : sock(std::move(sock)), id(id), state(State::RECEIVING),
+      splice(config.splice), detected(false), committing(false),
+      queued(false), deficit(0) {
+  timer.owner = this;
+  if (config.checksum) {
+    digest.start();
+  }
+}
+
+/* what a timed out upload's file holds instead of the partial input */
+static const std::string timeout_marker{"ERROR: socket timed out"};
+
+/* ...and one whose data couldn't be put on disk, under -f close or group */
+static const std::string sync_marker{"ERROR: could not sync"};
+
+/* counts an upload that ended in state (RECEIVING when the server stopped
+ * under it, which keeps its data just like a close) */
+static void count_upload(Connection::State state, const Stopwatch& age) {
+  ThreadMetrics& m = thread_metrics();
+  switch (state) {
+    case Connection::State::RECEIVING:
+    case Connection::State::CLOSED:
+      m.completed.add();
+      break;
+    case Connection::State::TIMED_OUT:
+      m.timed_out.add();
+      break;
+    case Connection::State::FAILED:
+      m.failed.add();
+      break;
+  }
+  m.upload_duration.record(age.micros());
+}
+
+/* counts a fetch that ended in state: one answered in full is a fetch, not
+ * a completed upload, while one cut short counts like an upload would */
+static void count_fetch(Connection::State state) {
+  ThreadMetrics& m = thread_metrics();
+  switch (state) {
+    case Connection::State::CLOSED:
+      m.fetches.add();
+      break;
+    case Connection::State::TIMED_OUT:
+      m.timed_out.add();
+      break;
+    case Connection::State::RECEIVING:  // the server stopped under it
+    case Connection::State::FAILED:
+      m.failed.add();
+      break;
+  }
+}
+
+/* publishes a finished upload, first making it durable under
+ * Durability::CLOSE (a deduplicated one's chunks included) */
+static void publish_spool(Spool& spool, const Deduper* dedup,
+                          const FileDescriptor& dir, Durability durability) {
+  if (durability == Durability::CLOSE) {
+    if (dedup) {
+      dedup->sync();
+    }
+    spool.file().sync();
+  }
+  spool.publish();
+  if (durability == Durability::CLOSE) {
+    dir.sync();
+  }
+}
+
+/* what a GroupCommit does with an upload whose data it has synced, or
+ * failed to */
+static void commit_spool(Spool& spool, bool synced, int id,
+                         Connection::State& state) {
+  try {
+    if (synced) {
+      spool.publish();
+    } else {
+      spool.fail(sync_marker);
+      state = Connection::State::FAILED;
+    }
+  } catch (std::runtime_error& e) {
+    std::cerr << "ERROR: connection " << id << ": " << e.what() << std::endl;
+    state = Connection::State::FAILED;
+  }
+}
+
+/* what a GroupCommit does with a published upload once its name is on disk,
+ * or the sync that was to put it there failed. The caller closes the
+ * connection after; if the upload failed, with a reset, since a clean close
+ * is all the acknowledgement a client gets. */
+static void release_upload(bool named, int id, Connection::State& state) {
+  if (!named && state != Connection::State::FAILED) {
+    std::cerr << "ERROR: connection " << id << ": could not sync its name"
+              << std::endl;
+    state = Connection::State::FAILED;
+  }
+}
+
+/* Every way an upload can end but a timeout keeps whatever arrived. Neither
+ * of these throws, so they're safe on the way out of a loop. Under
+ * Durability::GROUP a plain upload is only written out here and marked
+ * committing; the GroupCommit it's handed to publishes it. */
+void Server::publish_upload(Connection& conn) {
+  if (conn.fetch.active()) {
+    count_fetch(conn.state);
+    return;
+  }
+  if (conn.stream.attached()) {
+    conn.stream.finish(conn.state != Connection::State::FAILED, false);
+    count_upload(conn.state, conn.age);
+    return;
+  }
+
+  try {
+    /* one that ended before it showed what it was, or whose header was
+     * refused, gets a file like a plain upload all the same */
+    open_upload(conn);
+    UploadFile& upload = *conn.upload;
+    if (upload.dedup) {
+      upload.dedup->finish();
+    } else {
+      upload.writer.finish();
+    }
+    conn.digest.seal(*upload.dir, std::to_string(conn.id) + ".file",
+                     conn.id);
+    if (config.durability == Durability::GROUP) {
+      conn.committing = true;
+      return;
+    }
+    publish_spool(upload.spool, upload.dedup.get(), *upload.dir,
+                  config.durability);
+  } catch (std::runtime_error& e) {
+    std::cerr << "ERROR: connection " << conn.id << ": " << e.what()
+              << std::endl;
+    conn.state = Connection::State::FAILED;
+  }
+  count_upload(conn.state, conn.age);
+}
+
+void Server::expire_upload(Connection& conn) {
+  if (conn.fetch.active()) {
+    count_fetch(conn.state);
+    return;
+  }
+  if (conn.stream.attached()) {
+    conn.stream.finish(false, true);
+    count_upload(conn.state, conn.age);
+    return;
+  }
+
+  std::string name = std::to_string(conn.id) + ".file";
+  try {
+    if (conn.upload) {
+      conn.upload->writer.discard();
+      conn.upload->spool.fail(timeout_marker);
+    } else {
+      /* never sent a byte: no spool to drop, just the marker to write */
+      Spool::fail_hidden(*layout->dir(conn.id), name, timeout_marker);
+    }
+  } catch (std::runtime_error& e) {
+    std::cerr << "ERROR: connection " << conn.id << ": " << e.what()
+              << std::endl;
+  }
+  count_upload(conn.state, conn.age);
+}
+
+Server::Server(const std::string& port, const std::string& file_directory,
+               const ServerConfig& config, const Handoff& inherited)
+    : config(config), next_id(inherited.counter),
+      assemblies(config.retention, config.durability != Durability::NONE,
+                 config.max_total),
+      running(true),
+      wakeup(FileDescriptor::eventfd()),
+      draining(false),
+      drained(FileDescriptor::eventfd()) {
+  if (config.direct) {
+    /* spliced data would go around WriteBehind and its aligned blocks */
+    this->config.splice = false;
+  }
+  if (config.checksum) {
+    /* ...and around the digest */
+    this->config.splice = false;
+  }
+  if (config.dedup) {
+    /* ...and around the chunker, which has to see every byte */
+    this->config.splice = false;
+    if (config.engine == Engine::URING) {
+      /* io_uring writes straight from its provided buffers */
+      std::cerr << "WARNING: -D is not supported by the uring engine; "
+                << "using epoll instead" << std::endl;
+      this->config.engine = Engine::EVENTED;
+    }
+  }
+
   /* number connections starting from 1 or we'll fail a bunch of test cases.
    * isn't this a CS class though I mean let's be real here,
    * they should be zero indexed */
 
-  dir = FileDescriptor::opendir(file_directory);
+  /* every shard binds its own socket to the port up front, so a bad port
+   * fails here rather than in some thread later on; after an upgrade, there
+   * is a shard for each socket the old server had instead */
+  bool reuseport = config.shards > 1;
+  for (int fd : inherited.listeners) {
+    listeners.emplace_back(new ListeningSocket{fd});
+  }
+  if (!listeners.empty()) {
+    this->config.shards = listeners.size();
+  }
+  for (size_t i = listeners.size(); i < this->config.shards; i++) {
+    listeners.emplace_back(new ListeningSocket{port, reuseport});
+  }
+
+  layout.reset(new Layout{FileDescriptor::opendir(file_directory),
+                          config.per_dir});
 
   /* check your privilege
    * NOTE: man pages warn that access() has a race condition, but we're not
@@ -67,6 +352,26 @@ Server::Server(const std::string& port, const std::string& file_directory)
   if (access(file_directory.c_str(), W_OK) == -1) {
     throw std::runtime_error{"no write permissions in " + file_directory};
   }
+
+  if (config.dedup) {
+    chunks.reset(new ChunkStore{layout->root()});
+  }
+  if (config.durability == Durability::GROUP) {
+    commits.reset(new GroupCommit{layout->root()});
+  }
+  if (!config.limits.empty()) {
+    throttle.reset(new Throttle{Limits::load(config.limits)});
+  }
+
+  if (config.engine == Engine::THREADED) {
+    /* whatever the cap leaves over after every worker is busy is how many
+     * connections may wait in the queue */
+    size_t depth = 1;
+    if (config.max_conns > config.workers) {
+      depth = config.max_conns - config.workers;
+    }
+    workers.reset(new ThreadPool{config.workers, depth});
+  }
 }
 
 Server::~Server() {
@@ -78,61 +383,1412 @@ Server::~Server() {
    *     server is exiting and join() each thread
    *  3. kill everything and leave a mess of unfinished files on disk
    *
-   *  I chose option 3 because I want the server to go down immediately and
-   *  the spec doesn't say anything about what the server's behavior should be
-   *  when told to exit.
-   *
-   *  TODO: the safe option is number 2, so all threads would get the chance
-   *        to destruct their ConnectedSocket objects */
+   *  Option 2 it is: stop() has already cut every tracked client short, so
+   *  joining the pool only waits for the workers to close their files. The
+   *  evented engine has nothing left to do here; its connections were closed
+   *  when the event loop returned. */
+  if (workers) {
+    workers->shutdown();
+  }
+}
+
+void Server::stop() {
+  running = false;
+
+  uint64_t one = 1;
+  if (write(wakeup.raw(), &one, sizeof(one)) == -1) {
+    std::cerr << "ERROR: write(eventfd): " << strerror(errno) << std::endl;
+  }
+
+  if (config.engine == Engine::THREADED) {
+    /* a half-closed socket reads as EOF, so every worker wraps up the file
+     * it has so far instead of waiting out the client */
+    std::lock_guard<std::mutex> guard{active_lock};
+    for (int fd : active) {
+      ::shutdown(fd, SHUT_RD);
+    }
+  }
+}
+
+void Server::drain() {
+  draining = true;
+
+  uint64_t one = 1;
+  if (write(drained.raw(), &one, sizeof(one)) == -1) {
+    std::cerr << "ERROR: write(eventfd): " << strerror(errno) << std::endl;
+  }
+}
+
+Handoff Server::handoff() const {
+  Handoff h;
+  for (auto& listener : listeners) {
+    h.listeners.push_back(listener->fd());
+  }
+  h.counter = next_id.fd();
+  return h;
+}
+
+bool Server::reload_limits() {
+  if (!throttle) {
+    return false;
+  }
+  try {
+    throttle->set(Limits::load(config.limits));
+  } catch (std::runtime_error& e) {
+    /* a typo shouldn't lift the limits, nor take the server down */
+    std::cerr << "ERROR: " << e.what() << "; keeping the old limits"
+              << std::endl;
+  }
+  return true;
+}
+
+/* puts a new connection under the bandwidth limits, if there are any */
+void Server::limit(Throttle::Quota& quota, const ConnectedSocket& client) {
+  if (!throttle) {
+    return;
+  }
+  std::string source;
+  try {
+    source = client.peer();
+  } catch (std::runtime_error& e) {
+    /* already gone; its first read will say so */
+  }
+  throttle->join(quota, source);
 }
 
+/* Shards: each listening socket gets its own accept loop (and, for the
+ * evented engines, its own event loop) on its own thread; the first one runs
+ * on the caller's. With SO_REUSEPORT the kernel hashes incoming connections
+ * across the sockets, so accepting no longer funnels through one core. The
+ * only things the shards share are the directory, the connection counter
+ * and, for the threaded engine, the worker pool.
+ *
+ * If one shard fails the others are stopped, and start() rethrows its
+ * error once they've all returned. */
 void Server::start() {
-  while (true) {
-    ConnectedSocket conn = sock.accept();
+  std::vector<std::exception_ptr> errors(listeners.size());
+  std::vector<std::thread> shards;
+
+  auto run = [this, &errors](size_t i) {
+    try {
+      run_shard(i);
+    } catch (std::runtime_error& e) {
+      errors[i] = std::current_exception();
+      stop();
+    }
+  };
 
-    /* create & detach a new thread to handle the connection and continue
-     * waiting for new connections.
-     *
-     * NOTE: the thread is detached because I don't care if it ever finishes;
-     *       if the server goes down and the threads aren't done, then what
-     *       happens to the client connections is undefined */
-    std::thread(&Server::recv_file, this, std::move(conn), n_conn).detach();
-    n_conn++;
+  for (size_t i = 1; i < listeners.size(); i++) {
+    shards.emplace_back(run, i);
+  }
+  run(0);
+  for (std::thread& t : shards) {
+    t.join();
+  }
+
+  for (std::exception_ptr& e : errors) {
+    if (e) {
+      std::rethrow_exception(e);
+    }
   }
 }
 
+void Server::run_shard(size_t shard) {
+  if (config.pin) {
+    unsigned cpus = std::thread::hardware_concurrency();
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpus > 0 ? shard % cpus : 0, &set);
+
+    /* the shard still works unpinned, so this isn't fatal */
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err != 0) {
+      std::cerr << "WARNING: pthread_setaffinity_np(): " << strerror(err)
+                << std::endl;
+    }
+  }
+
+  ListeningSocket& listener = *listeners[shard];
+  switch (config.engine) {
+    case Engine::THREADED:
+      start_threaded(listener);
+      break;
+    case Engine::EVENTED:
+      start_evented(listener);
+      break;
+    case Engine::URING:
+      start_uring(listener);
+      break;
+  }
+}
+
+/* The threaded engine: every accepted connection is queued for a fixed pool
+ * of workers, each of which blocks on one client at a time.
+ *
+ * Admission control: once max_conns connections are queued or running, the
+ * accept loop either stops accepting (leaving clients in the listen backlog
+ * until a worker frees up) or, with config.reject, resets the newcomers. A
+ * rejected connection is not numbered and gets no file. */
+void Server::start_threaded(ListeningSocket& listener) {
+  /* the listener may be shared with a server that takes over from this one
+   * (see drain()), so stop() can't shut it down to get a thread out of a
+   * blocking accept(); it's polled along with both eventfds instead */
+  listener.set_nonblocking();
+  struct pollfd fds[3] = {{listener.fd(), POLLIN, 0},
+                          {wakeup.raw(), POLLIN, 0},
+                          {drained.raw(), POLLIN, 0}};
+
+  while (running && !draining) {
+    /* wakes up once a second to expire abandoned multi-stream uploads, which
+     * no worker is left to look after */
+    if (poll(fds, 3, 1000) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error{"poll(): " + std::string{strerror(errno)}};
+    }
+    assemblies.expire();
+
+    while (running && !draining) {
+      ConnectedSocket conn = listener.accept();
+      if (!conn.valid()) {
+        break;  // taken by another shard, or another server
+      }
+
+      if (config.reject && workers->load() >= config.max_conns) {
+        conn.abort();
+        thread_metrics().rejected.add();
+        continue;
+      }
+
+      conn.set_recv_timeout();
+      if (!track(conn)) {
+        return;
+      }
+
+      /* std::function must be copyable, so the socket travels by pointer */
+      std::shared_ptr<ConnectedSocket> client =
+          std::make_shared<ConnectedSocket>(std::move(conn));
+      int id = next_id.next();
+      TRACE_EVENT("accepted", "id", id);
+      thread_metrics().accepted.add();
+      workers->submit([this, client, id] {
+        recv_file(std::move(*client), id);
+      });
+    }
+  }
+}
+
+bool Server::track(const ConnectedSocket& client) {
+  std::lock_guard<std::mutex> guard{active_lock};
+  if (!running) {
+    return false;
+  }
+  active.insert(client.fd());
+  return true;
+}
+
+void Server::untrack(const ConnectedSocket& client) {
+  std::lock_guard<std::mutex> guard{active_lock};
+  active.erase(client.fd());
+}
+
 void Server::recv_file(ConnectedSocket client, int client_id) {
+  TRACE_SCOPE("connection", "id", client_id);
   std::string fname = std::to_string(client_id) + ".file";
-  FileDescriptor outfile = FileDescriptor::openat_cw(dir, fname);
+  Stopwatch age;
+  Connection::State state = Connection::State::CLOSED;
+  bool reset = false;  // the group commit failed it: no clean close
+  Fetch fetch;
+  Throttle::Quota quota;
+  limit(quota, client);
 
   try {
-    while (1) {
-      std::string chunk = client.recv();
-      outfile.write_all(chunk);
+    /* opened once the header (or its absence) shows this is a plain upload */
+    std::unique_ptr<UploadFile> upload;
+    Stream stream;
+    Digest digest;
+    if (config.checksum) {
+      digest.start();
     }
+    /* every read lands here and is drained before the next, so once the
+     * writer has its segments the loops below allocate nothing */
+    RingBuffer ring{socket_buffers()};
+    struct iovec iov[2];
 
-  } catch (socket_timeout_error& e) {
-    outfile.clear();
-    outfile.write_all("ERROR: socket timed out");
-    /* TODO: if these methods throw std::runtime_error the thread will call
-     *       std::terminate() */
-    return;
+    try {
+      FrameHeader header;
+      int framed = read_frame_header(client, header, true);
+      if (framed == 1 && header.fetch) {
+        /* nothing to receive: once it's answered, the connection is done */
+        fetch.start(*layout, header);
+        fetch.send(client);
+      } else if (framed == 1 && !header.check) {
+        /* one range of a multi-stream upload, written into its assembly */
+        uint64_t start = stream.attach(assemblies, header, *layout, client_id);
+        if (header.resume) {
+          send_resume_offset(client, start);
+        }
+        while (1) {
+          client.await();
+          size_t n = client.recvv(iov, ring.space(iov));
+          ring.produced(n);
+          count_received(n);
+          for (int i = 0, pieces = ring.filled(iov); i < pieces; i++) {
+            stream.write(static_cast<char*>(iov[i].iov_base), iov[i].iov_len);
+          }
+          ring.consumed(n);
+          hold(throttle.get(), quota, n, running);
+        }
+      } else {
+        if (framed == 1) {
+          digest.expect(header.length);
+        }
+        upload.reset(new UploadFile{layout->dir(client_id), client_id,
+                                    config.direct, chunks.get()});
+        if (config.splice && !digest.active()) {
+          try {
+            Pipe pipe;
+            while (1) {
+              ssize_t n = upload->spool.file().splice_from(client, pipe);
+              if (n == -1) {
+                throw socket_timeout_error();  // SO_RCVTIMEO ran out
+              }
+              count_received(n);
+              upload->writer.spliced(n);
+              hold(throttle.get(), quota, n, running);
+            }
+          } catch (splice_unsupported& e) {
+            /* carry on below with the copy path */
+            upload->writer.resync();
+          }
+        }
+
+        receive_upload(client, ring, digest, *upload, throttle.get(), quota,
+                       running);
+      }
+
+    } catch (socket_timeout_error& e) {
+      TRACE_EVENT("timeout", "id", client_id);
+      state = Connection::State::TIMED_OUT;
+
+    } catch (socket_closed_exception& e) {
+
+    } catch (std::runtime_error& e) {
+      /* only a timeout throws the data away; this keeps what arrived */
+      std::cerr << "ERROR: connection " << client_id << ": " << e.what()
+                << std::endl;
+      state = Connection::State::FAILED;
+    }
+
+    if (fetch.active()) {
+      /* answered, or not; either way there's no file to write */
+    } else if (stream.attached()) {
+      stream.finish(state == Connection::State::CLOSED,
+                    state == Connection::State::TIMED_OUT);
+    } else if (state == Connection::State::TIMED_OUT && !upload) {
+      /* never sent a byte: no spool to drop, just the marker to write */
+      Spool::fail_hidden(*layout->dir(client_id), fname, timeout_marker);
+    } else if (state == Connection::State::TIMED_OUT) {
+      upload->writer.discard();
+      upload->spool.fail(timeout_marker);
+    } else {
+      /* a refused header still gets a file, like any plain upload */
+      if (!upload) {
+        upload.reset(new UploadFile{layout->dir(client_id), client_id,
+                                    config.direct, chunks.get()});
+      }
+      if (upload->dedup) {
+        upload->dedup->finish();
+      } else {
+        upload->writer.finish();
+      }
+      digest.seal(*upload->dir, fname, client_id);
+      if (config.durability == Durability::GROUP) {
+        commits->wait(
+            [&](bool synced) {
+              commit_spool(upload->spool, synced, client_id, state);
+            },
+            [&](bool named) {
+              release_upload(named, client_id, state);
+              reset = state == Connection::State::FAILED;
+            });
+      } else {
+        publish_spool(upload->spool, upload->dedup.get(), *upload->dir,
+                      config.durability);
+      }
+    }
+
+  } catch (std::runtime_error& e) {
+    std::cerr << "ERROR: connection " << client_id << ": " << e.what()
+              << std::endl;
+    state = Connection::State::FAILED;
+  }
+  if (fetch.active()) {
+    count_fetch(state);
+  } else {
+    count_upload(state, age);
+  }
+
+  /* before the socket is closed, so stop() never shuts down a reused fd */
+  untrack(client);
+  if (reset) {
+    client.abort();
+  }
+}
+
+/* The evented engine: the listening socket and every client socket are
+ * nonblocking and registered edge-triggered with a single epoll instance.
+ * A client socket that becomes ready joins the loop's ready queue, and each
+ * pass of the loop reads from the queued sockets in turn (see run_round())
+ * into their files through a pooled buffer borrowed just for the read, so
+ * the cost of an idle connection is just its Connection object.
+ * Disk writes are still blocking; regular files are always "ready" as far as
+ * epoll is concerned.
+ *
+ * Idle timeouts live on a timer wheel whose timerfd sits in the same epoll
+ * set, so the whole engine never needs more than one epoll_wait() to find
+ * out what to do next. */
+/* how long the loop may wait for events: not at all if a queued connection
+ * can be read right away, or until the first one a Throttle holds back can */
+static int round_wait(const EventLoop& loop) {
+  if (loop.ready.empty()) {
+    return -1;
+  }
+  Connection::Time now = std::chrono::steady_clock::now();
+  Connection::Time first = Connection::Time::max();
+  for (Connection* conn : loop.ready) {
+    if (conn->held <= now) {
+      return 0;
+    }
+    first = std::min(first, conn->held);
+  }
+  return std::chrono::duration_cast<std::chrono::milliseconds>(first - now)
+             .count() +
+         1;
+}
+
+void Server::start_evented(ListeningSocket& listener) {
+  EventLoop loop{listener};
+
+  listener.set_nonblocking();
+  loop.reactor.add(listener.fd(), EPOLLIN | EPOLLET, &listener);
+  loop.reactor.add(loop.timers.fd(), EPOLLIN, &loop.timers);
+  loop.reactor.add(wakeup.raw(), EPOLLIN, &wakeup);
+  loop.reactor.add(drained.raw(), EPOLLIN, &drained);
+
+  /* after drain(), keep going until every connection has finished */
+  while (running && !(draining && loop.conns.empty())) {
+    int n = loop.reactor.wait(round_wait(loop));
+
+    for (int i = 0; i < n && running; i++) {
+      void* tag = loop.reactor.event(i).data.ptr;
+      if (tag == &loop.listener) {
+        accept_all(loop);
+        continue;
+      }
+      if (tag == &loop.timers) {
+        expire_timeouts(loop);
+        continue;
+      }
+      if (tag == &wakeup) {
+        continue;  // stop(); the loop condition takes care of the rest
+      }
+      if (tag == &drained) {
+        /* the server taking over accepts from here on */
+        loop.reactor.remove(listener.fd());
+        loop.reactor.remove(drained.raw());
+        continue;
+      }
+
+      Connection* conn = static_cast<Connection*>(tag);
+      if (!conn->queued) {
+        conn->queued = true;
+        loop.ready.push_back(conn);
+      }
+    }
+    run_round(loop);
+  }
+
+  /* stop(): whatever each client has sent so far is its file */
+  for (auto& it : loop.conns) {
+    publish_upload(*it.second);
+    if (it.second->committing) {
+      commit(loop, std::move(it.second));
+    }
+  }
+}
+
+/* Admission control: with max_conns connections open the loop stops
+ * accepting and leaves newcomers in the listen backlog, or resets them when
+ * config.reject is set. Running out of descriptors also pauses accepting.
+ * Either way reap() resumes as soon as a connection goes away. */
+void Server::accept_all(EventLoop& loop) {
+  while (running && !draining) {
+    bool full = loop.conns.size() >= config.max_conns;
+    if (full && !config.reject) {
+      loop.paused = true;
+      return;
+    }
+
+    try {
+      ConnectedSocket client = loop.listener.try_accept();
+      if (!client.valid()) {
+        return;
+      }
+      if (full) {
+        client.abort();
+        thread_metrics().rejected.add();
+        continue;
+      }
+
+      int fd = client.fd();
+      int id = next_id.next();
+      TRACE_EVENT("accepted", "id", id);
+      std::unique_ptr<Connection> conn{
+          new Connection{std::move(client), id, config}};
+      limit(conn->quota, conn->sock);
+      loop.timers.schedule(conn->timer, TIMEOUT_TICKS);
+      loop.reactor.add(fd, EPOLLIN | EPOLLRDHUP | EPOLLET, conn.get());
+      loop.conns[fd] = std::move(conn);
+      thread_metrics().accepted.add();
+
+    } catch (std::runtime_error& e) {
+      /* most likely EMFILE; try again once something has been closed */
+      std::cerr << "ERROR: " << e.what() << std::endl;
+      loop.paused = true;
+      return;
+    }
+  }
+}
+
+void Server::reap(EventLoop& loop, Connection& conn) {
+  auto it = loop.conns.find(conn.sock.fd());
+  if (conn.committing) {
+    commit(loop, std::move(it->second));
+  }
+  loop.conns.erase(it);  // closing drops it from the epoll set
+
+  if (loop.paused) {
+    loop.paused = false;
+    accept_all(loop);
+  }
+}
+
+/* opens the spool of a connection that turns out to be a plain upload,
+ * unless it has one already */
+void Server::open_upload(Connection& conn) {
+  if (!conn.upload) {
+    conn.upload.reset(new UploadFile{layout->dir(conn.id), conn.id,
+                                     config.direct, chunks.get()});
+  }
+}
+
+/* Hands a finished upload to the group commit, which publishes it and, once
+ * its name is on disk too, counts it and closes its connection (resets it,
+ * if it failed). The loop is done with it and doesn't count it against
+ * max_conns any more. */
+void Server::commit(EventLoop& loop, std::unique_ptr<Connection> owned) {
+  loop.reactor.remove(owned->sock.fd());
+  owned->timer.unlink();
+
+  std::shared_ptr<Connection> conn{std::move(owned)};
+  commits->add(
+      [conn](bool synced) {
+        commit_spool(conn->upload->spool, synced, conn->id, conn->state);
+      },
+      [conn](bool named) {
+        release_upload(named, conn->id, conn->state);
+        if (conn->state == Connection::State::FAILED) {
+          conn->sock.abort();
+        }
+        count_upload(conn->state, conn->age);
+      });
+}
+
+/* Deficit round robin over the ready queue: each connection in it gets
+ * DRR_QUANTUM more bytes to read, and goes to the back of the queue once it
+ * has read them, or leaves it once its socket runs dry (see service()). A
+ * read can overdraw, and the connection makes up for it next round, so a
+ * client with a fast link gets no more of the loop than one trickling data
+ * in, and a small upload waits at most a round behind a big one. One the
+ * Throttle holds back keeps its place, but reads nothing until it may. */
+void Server::run_round(EventLoop& loop) {
+  TRACE_SCOPE("round", "ready", loop.ready.size());
+  Connection::Time now = std::chrono::steady_clock::now();
+
+  for (size_t i = loop.ready.size(); i > 0 && running; i--) {
+    Connection* conn = loop.ready.front();
+    loop.ready.pop_front();
+    if (conn->held > now) {
+      loop.ready.push_back(conn);
+      continue;
+    }
+
+    conn->deficit += DRR_QUANTUM;
+    service(loop, *conn);
+    if (conn->state != Connection::State::RECEIVING) {
+      reap(loop, *conn);
+    } else if (conn->queued) {
+      loop.ready.push_back(conn);
+    }
+  }
+}
+
+/* Edge-triggered, so a connection stays queued until the socket would
+ * block: this reads until it does, the connection's deficit runs out or
+ * the Throttle says to hold off, and only dequeues it in the first case.
+ * A fetch just sends as much as the socket takes. */
+void Server::service(EventLoop& loop, Connection& conn) {
+  TRACE_SCOPE("service", "id", conn.id);
+  try {
+    if (!conn.detected) {
+      FrameHeader header;
+      int framed = read_frame_header(conn.sock, header, false);
+      if (framed == -1) {
+        conn.queued = false;
+        loop.timers.touch(conn.timer, TIMEOUT_TICKS);
+        return;  // part of what may be a header; wait for the rest
+      }
+      if (framed == 1 && header.fetch) {
+        /* from here on the socket is only ever written to */
+        conn.fetch.start(*layout, header);
+        loop.reactor.modify(conn.sock.fd(), EPOLLOUT | EPOLLRDHUP | EPOLLET,
+                            &conn);
+      } else if (framed == 1 && !header.check) {
+        uint64_t start =
+            conn.stream.attach(assemblies, header, *layout, conn.id);
+        if (header.resume) {
+          send_resume_offset(conn.sock, start);
+        }
+      } else {
+        if (framed == 1) {
+          conn.digest.expect(header.length);
+          conn.splice = false;
+        }
+        open_upload(conn);
+      }
+      conn.detected = true;
+    }
+
+    if (conn.fetch.active()) {
+      if (conn.fetch.pump(conn.sock)) {
+        conn.state = Connection::State::CLOSED;
+        publish_upload(conn);
+      }
+      conn.queued = false;
+      loop.timers.touch(conn.timer, TIMEOUT_TICKS);
+      return;
+    }
+
+    while (conn.deficit > 0) {
+      ssize_t n = pump(loop, conn);
+      if (n <= 0) {
+        conn.queued = false;
+        conn.deficit = 0;
+        break;
+      }
+      conn.deficit -= n;
+      uint64_t wait = charge(throttle.get(), conn.quota, n);
+      if (wait > 0) {
+        conn.held =
+            std::chrono::steady_clock::now() + std::chrono::microseconds(wait);
+        break;
+      }
+    }
+    loop.timers.touch(conn.timer, TIMEOUT_TICKS);
 
   } catch (socket_closed_exception& e) {
+    conn.state = Connection::State::CLOSED;
+    publish_upload(conn);
+
+  } catch (std::runtime_error& e) {
+    /* one bad client must not take down the whole loop */
+    std::cerr << "ERROR: connection " << conn.id << ": " << e.what()
+              << std::endl;
+    conn.state = Connection::State::FAILED;
+    loop.pipe.drain();
+    publish_upload(conn);
+  }
+}
+
+/* moves one chunk from the socket into the file, through the loop's pipe if
+ * splicing or a pooled buffer if not; returns -1 once the socket would block */
+ssize_t Server::pump(EventLoop& loop, Connection& conn) {
+  if (conn.stream.attached()) {
+    BufferPool::Buffer buf = socket_buffers().borrow();
+    ssize_t n = conn.sock.try_recv(buf.data(), buf.size());
+    if (n > 0) {
+      count_received(n);
+      conn.stream.write(buf.data(), n);
+    }
+    return n;
+  }
+
+  UploadFile& upload = *conn.upload;
+  if (conn.splice) {
+    try {
+      ssize_t n = upload.spool.file().splice_from(conn.sock, loop.pipe);
+      if (n > 0) {
+        count_received(n);
+        upload.writer.spliced(n);
+      }
+      return n;
+    } catch (splice_unsupported& e) {
+      conn.splice = false;
+      upload.writer.resync();
+    }
+  }
+
+  BufferPool::Buffer buf = socket_buffers().borrow();
+  ssize_t n = conn.sock.try_recv(buf.data(), buf.size());
+  if (n > 0) {
+    count_received(n);
+    upload.write(buf.data(), conn.digest.feed(buf.data(), n));
+  }
+  return n;
+}
+
+void Server::expire_timeouts(EventLoop& loop) {
+  loop.expired.clear();
+  loop.timers.advance(loop.expired);
+  assemblies.expire();
+
+  for (void* owner : loop.expired) {
+    Connection& conn = *static_cast<Connection*>(owner);
+    if (conn.queued) {
+      /* it has data waiting, it just isn't being read yet */
+      loop.timers.schedule(conn.timer, TIMEOUT_TICKS);
+      continue;
+    }
+    TRACE_EVENT("timeout", "id", conn.id);
+    conn.state = Connection::State::TIMED_OUT;
+    expire_upload(conn);
+    reap(loop, conn);
+  }
+}
+
+/* The io_uring engine: one ring carries every accept, recv, open and write,
+ * so a busy loop pays for one io_uring_enter() per batch of completions
+ * rather than a syscall or two per chunk.
+ *
+ *   - a multishot accept keeps handing us new connections
+ *   - each file is opened with IORING_OP_OPENAT on the directory descriptor
+ *     straight into the ring's table of direct descriptors
+ *   - a multishot recv per connection picks buffers out of a group of
+ *     provided buffers, so idle connections pin no memory
+ *   - each received buffer goes straight back out as a positional write
+ *     into the file and returns to the group once that completes
+ *
+ * The idle timer wheel is the same one the evented engine uses; its timerfd
+ * is watched with a multishot poll. */
+
+enum UringOp : uint64_t {
+  U_ACCEPT = 1, U_OPEN, U_RECV, U_WRITE, U_CLOSE, U_TIMER, U_WAKEUP, U_CANCEL,
+  U_PEEK, U_FETCH, U_THROTTLE, U_DRAIN
+};
+
+#ifdef TRACING
+/* what a completion is traced as */
+static const char* uring_op_name(uint64_t op) {
+  static const char* names[] = {
+      "uring_buffer", "uring_accept", "uring_open",   "uring_recv",
+      "uring_write",  "uring_close",  "uring_timer",  "uring_wakeup",
+      "uring_cancel", "uring_peek",   "uring_fetch",  "uring_throttle",
+      "uring_drain"};
+  return op < sizeof(names) / sizeof(names[0]) ? names[op] : "uring_other";
+}
+#endif
+
+/* user_data: the operation in the top byte, a pointer or buffer id below */
+static uint64_t tag(UringOp op, uint64_t payload = 0) {
+  return static_cast<uint64_t>(op) << 56 | payload;
+}
+
+static uint64_t tag(UringOp op, const UringConnection* conn) {
+  return tag(op, reinterpret_cast<uintptr_t>(conn));
+}
+
+UringConnection::UringConnection(ConnectedSocket sock, int id,
+                                 const ServerConfig& config)
+    : sock(std::move(sock)), name(std::to_string(id) + ".file"),
+      spool(Spool::hidden_name(name)), id(id),
+      slot(-1), offset(0), inflight(0), opening(false), receiving(false),
+      starved(false), peeking(false), peeked_all(false), polling(false),
+      throttled(false), state(Connection::State::RECEIVING) {
+  timer.owner = this;
+  if (config.checksum) {
+    digest.start();
+  }
+}
+
+UringLoop::UringLoop(size_t max_files, ListeningSocket& listener)
+    : listener(listener), ring(URING_ENTRIES), bufs(ring, URING_BUFS, URING_BUFSIZE, 0),
+      writes(URING_BUFS), accepting(false), cancelling(false),
+      accepted_any(false) {
+  static const unsigned needed[] = {
+      IORING_OP_ACCEPT, IORING_OP_OPENAT, IORING_OP_RECV, IORING_OP_WRITE,
+      IORING_OP_CLOSE, IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL,
+      IORING_OP_TIMEOUT};
+  for (unsigned op : needed) {
+    if (!ring.supports(op)) {
+      throw uring_unsupported{"opcode " + std::to_string(op)};
+    }
+  }
+  ring.register_files(max_files);
+}
+
+static void uring_poll(Ring& ring, int fd, uint64_t user_data, bool multi,
+                       unsigned events = POLLIN) {
+  struct io_uring_sqe* sqe = ring.sqe();
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = events;
+  sqe->len = multi ? IORING_POLL_ADD_MULTI : 0;
+  sqe->user_data = user_data;
+}
+
+static void uring_cancel(Ring& ring, uint64_t target) {
+  struct io_uring_sqe* sqe = ring.sqe();
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = target;
+  sqe->user_data = tag(U_CANCEL);
+}
+
+static void uring_arm_recv(UringLoop& loop, UringConnection* conn) {
+  struct io_uring_sqe* sqe = loop.ring.sqe();
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = conn->sock.fd();
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = loop.bufs.group();
+  sqe->user_data = tag(U_RECV, conn);
+  conn->receiving = true;
+}
+
+/* looks at the start of the stream for a FrameHeader; with all, waits for
+ * the whole of one */
+static void uring_peek(UringLoop& loop, UringConnection* conn, bool all) {
+  struct io_uring_sqe* sqe = loop.ring.sqe();
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = conn->sock.fd();
+  sqe->addr = reinterpret_cast<uintptr_t>(conn->head);
+  sqe->len = sizeof(conn->head);
+  sqe->msg_flags = MSG_PEEK | (all ? MSG_WAITALL : 0);
+  sqe->user_data = tag(U_PEEK, conn);
+  conn->peeking = true;
+}
+
+static void uring_write(UringLoop& loop, uint16_t bid) {
+  UringLoop::PendingWrite& w = loop.writes[bid];
+  struct io_uring_sqe* sqe = loop.ring.sqe();
+  sqe->opcode = IORING_OP_WRITE;
+  if (w.conn->stream.attached()) {
+    sqe->fd = w.conn->stream.fd();  // the assembly's, a plain descriptor
+  } else {
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = w.conn->slot;
+  }
+  sqe->addr = reinterpret_cast<uintptr_t>(loop.bufs.buffer(bid) + w.done);
+  sqe->len = w.len - w.done;
+  sqe->off = w.offset + w.done;
+  sqe->user_data = tag(U_WRITE, bid);
+}
+
+void Server::start_uring(ListeningSocket& listener) {
+  std::unique_ptr<UringLoop> loop;
+
+  try {
+    /* some slack over max_conns for accepts that race with a pause */
+    loop.reset(new UringLoop{config.max_conns + URING_ENTRIES, listener});
+    run_uring(*loop);
+    return;
+  } catch (uring_unsupported& e) {
+    std::cerr << "WARNING: " << e.what() << "; using epoll instead"
+              << std::endl;
+  }
+
+  loop.reset();
+  start_evented(listener);
+}
+
+void Server::run_uring(UringLoop& loop) {
+  uring_admit(loop);
+  uring_poll(loop.ring, loop.timers.fd(), tag(U_TIMER), true);
+  uring_poll(loop.ring, wakeup.raw(), tag(U_WAKEUP), false);
+  uring_poll(loop.ring, drained.raw(), tag(U_DRAIN), false);
+
+  /* after stop() or drain(), keep going until every connection has wrapped
+   * up and the multishot accept's cancellation has come back (its last CQE
+   * may still bring in a connection to finish) */
+  while ((running && !draining) || !loop.conns.empty() || loop.accepting) {
+    loop.ring.submit(1);
+
+    struct io_uring_cqe* cqe;
+    while ((cqe = loop.ring.peek()) != nullptr) {
+      uint64_t user_data = cqe->user_data;
+      int res = cqe->res;
+      unsigned flags = cqe->flags;
+      loop.ring.seen();
+
+      uint64_t payload = user_data & ((1ULL << 56) - 1);
+      UringConnection* conn = reinterpret_cast<UringConnection*>(payload);
+      TRACE_SCOPE(uring_op_name(user_data >> 56), "res", res);
+
+      switch (static_cast<UringOp>(user_data >> 56)) {
+        case U_ACCEPT:
+          uring_accept(loop, res, flags);
+          break;
+        case U_PEEK:
+          uring_peeked(loop, conn, res);
+          break;
+        case U_OPEN:
+          uring_opened(loop, conn, res);
+          break;
+        case U_RECV:
+          uring_recv(loop, conn, res, flags);
+          break;
+        case U_WRITE:
+          uring_written(loop, payload, res);
+          break;
+        case U_FETCH:
+          conn->polling = false;
+          if (res < 0 && res != -ECANCELED) {
+            std::cerr << "ERROR: connection " << conn->id
+                      << ": poll(): " << strerror(-res) << std::endl;
+            conn->state = Connection::State::FAILED;
+          }
+          loop.timers.touch(conn->timer, TIMEOUT_TICKS);
+          uring_fetch(loop, conn);
+          break;
+        case U_THROTTLE:
+          /* -ETIME when the pause is over, -ECANCELED if cut short */
+          conn->throttled = false;
+          if (conn->state == Connection::State::RECEIVING &&
+              !conn->receiving && !conn->starved) {
+            loop.timers.touch(conn->timer, TIMEOUT_TICKS);
+            uring_arm_recv(loop, conn);
+          }
+          uring_finish(loop, conn);
+          break;
+        case U_TIMER:
+          uring_expire(loop);
+          if (!(flags & IORING_CQE_F_MORE)) {
+            uring_poll(loop.ring, loop.timers.fd(), tag(U_TIMER), true);
+          }
+          break;
+        case U_WAKEUP:
+          /* stop(): no more accepting, and whatever each client has sent
+           * so far is its file */
+          running = false;
+          uring_admit(loop);
+          for (auto& it : loop.conns) {
+            UringConnection* c = it.first;
+            if (c->state == Connection::State::RECEIVING) {
+              /* a fetch can't be cut short like an upload can */
+              c->state = c->fetch.active() ? Connection::State::FAILED
+                                           : Connection::State::CLOSED;
+            }
+            if (c->receiving) {
+              uring_cancel(loop.ring, tag(U_RECV, c));
+            }
+            if (c->peeking) {
+              uring_cancel(loop.ring, tag(U_PEEK, c));
+            }
+            if (c->polling) {
+              uring_cancel(loop.ring, tag(U_FETCH, c));
+            }
+            if (c->throttled) {
+              uring_cancel(loop.ring, tag(U_THROTTLE, c));
+            }
+          }
+          loop.expired.clear();
+          for (auto& it : loop.conns) {
+            loop.expired.push_back(it.first);
+          }
+          for (void* c : loop.expired) {
+            uring_finish(loop, static_cast<UringConnection*>(c));
+          }
+          break;
+        case U_DRAIN:
+          /* the server taking over accepts from here on; any accept that
+           * completes meanwhile is still ours to finish */
+          uring_admit(loop);
+          break;
+        case U_CLOSE:
+        case U_CANCEL:
+          break;
+        default:
+          break;  // user_data 0: a buffer handed back to the kernel
+      }
+    }
+  }
+}
+
+/* Admission control mirrors the evented engine: at max_conns the multishot
+ * accept is cancelled (leaving clients in the listen backlog) unless
+ * config.reject asks for newcomers to be reset instead. */
+void Server::uring_admit(UringLoop& loop) {
+  bool wanted = running && !draining &&
+                (config.reject || loop.conns.size() < config.max_conns);
+
+  if (wanted && !loop.accepting) {
+    struct io_uring_sqe* sqe = loop.ring.sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = loop.listener.fd();
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = tag(U_ACCEPT);
+    loop.accepting = true;
+  } else if (!wanted && loop.accepting && !loop.cancelling) {
+    uring_cancel(loop.ring, tag(U_ACCEPT));
+    loop.cancelling = true;
+  }
+}
+
+void Server::uring_accept(UringLoop& loop, int res, unsigned flags) {
+  if (!(flags & IORING_CQE_F_MORE)) {
+    loop.accepting = false;
+    loop.cancelling = false;
+  }
+
+  if (res < 0) {
+    if (res == -EINVAL && !loop.accepted_any) {
+      throw uring_unsupported{"multishot accept"};  // pre-5.19 kernel
+    }
+    if (res != -ECANCELED) {
+      std::cerr << "ERROR: accept(): " << strerror(-res) << std::endl;
+    }
+  } else {
+    loop.accepted_any = true;
+    ConnectedSocket client = ConnectedSocket::adopt(res);
+
+    if (!running) {
+      /* raced with stop(); dropping the socket closes it */
+    } else if (config.reject && loop.conns.size() >= config.max_conns) {
+      client.abort();
+      thread_metrics().rejected.add();
+    } else {
+      std::unique_ptr<UringConnection> conn{
+          new UringConnection{std::move(client), next_id.next(), config}};
+      UringConnection* c = conn.get();
+      TRACE_EVENT("accepted", "id", c->id);
+      limit(c->quota, c->sock);
+      loop.conns[c] = std::move(conn);
+      loop.timers.schedule(c->timer, TIMEOUT_TICKS);
+      thread_metrics().accepted.add();
+      uring_peek(loop, c, false);
+    }
+  }
+
+  uring_admit(loop);
+}
+
+/* A plain upload gets its spool opened; a stream attaches to its assembly
+ * and goes straight to receiving, so it never opens a file of its own, and
+ * neither does a fetch, which goes to uring_fetch().
+ * Clients that send less than a header before pausing are peeked at again
+ * with MSG_WAITALL, which comes back early on EOF. */
+void Server::uring_peeked(UringLoop& loop, UringConnection* conn, int res) {
+  conn->peeking = false;
+
+  if (conn->state == Connection::State::TIMED_OUT) {
+    uring_finish(loop, conn);
+    return;
+  }
+  if (res < 0 && res != -ECANCELED) {
+    std::cerr << "ERROR: connection " << conn->id
+              << ": recv(): " << strerror(-res) << std::endl;
+    conn->state = Connection::State::FAILED;
+    uring_finish(loop, conn);
+    return;
+  }
+
+  /* EOF, or cancelled by stop(): a plain upload of whatever there is */
+  FrameHeader header;
+  int framed = res > 0 ? header.decode(conn->head, res) : 0;
+  if (framed == -1 && !conn->peeked_all &&
+      conn->state == Connection::State::RECEIVING) {
+    conn->peeked_all = true;
+    uring_peek(loop, conn, true);
+    return;
+  }
+
+  if (framed != 1) {
+    uring_open(loop, conn);
+    return;
+  }
+
+  try {
+    /* the peek saw the whole header, so this takes it without blocking */
+    if (conn->sock.try_recv(conn->head, FRAME_HEADER) != FRAME_HEADER) {
+      throw std::runtime_error{"recv(): short frame header"};
+    }
+    if (header.fetch) {
+      conn->sock.set_nonblocking();
+      conn->fetch.start(*layout, header);
+      uring_fetch(loop, conn);
+      return;
+    }
+    if (header.check) {
+      conn->digest.expect(header.length);
+      uring_open(loop, conn);
+      return;
+    }
+    uint64_t start = conn->stream.attach(assemblies, header, *layout, conn->id);
+    if (header.resume) {
+      send_resume_offset(conn->sock, start);
+    }
+  } catch (std::runtime_error& e) {
+    /* a bad header fails like any plain upload, empty file and all */
+    std::cerr << "ERROR: connection " << conn->id << ": " << e.what()
+              << std::endl;
+    conn->state = Connection::State::FAILED;
+    uring_open(loop, conn);
+    return;
+  }
+
+  if (conn->state == Connection::State::RECEIVING) {
+    uring_arm_recv(loop, conn);
+  } else {
+    uring_finish(loop, conn);
+  }
+}
+
+/* Sends a fetch with sendfile() straight from the loop, as much as its
+ * socket takes, then polls for room for the rest. The file is read from the
+ * page cache more often than not, so this rarely blocks for long; sending
+ * through the ring instead would mean copying it into buffers first. */
+void Server::uring_fetch(UringLoop& loop, UringConnection* conn) {
+  if (conn->state == Connection::State::RECEIVING) {
+    try {
+      if (!conn->fetch.pump(conn->sock)) {
+        uring_poll(loop.ring, conn->sock.fd(), tag(U_FETCH, conn), false,
+                   POLLOUT);
+        conn->polling = true;
+        return;
+      }
+      conn->state = Connection::State::CLOSED;
+    } catch (std::runtime_error& e) {
+      std::cerr << "ERROR: connection " << conn->id << ": " << e.what()
+                << std::endl;
+      conn->state = Connection::State::FAILED;
+    }
+  }
+  uring_finish(loop, conn);
+}
+
+void Server::uring_open(UringLoop& loop, UringConnection* conn) {
+  struct io_uring_sqe* sqe = loop.ring.sqe();
+  sqe->opcode = IORING_OP_OPENAT;
+  conn->dir = layout->dir(conn->id);  // held until the open completes, at least
+  sqe->fd = conn->dir->raw();
+  sqe->addr = reinterpret_cast<uintptr_t>(conn->spool.c_str());
+  /* no O_CLOEXEC: direct descriptors */
+  sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+  sqe->len = S_IWUSR | S_IRUSR;
+  sqe->file_index = IORING_FILE_INDEX_ALLOC;
+  sqe->user_data = tag(U_OPEN, conn);
+  conn->opening = true;
+}
+
+void Server::uring_opened(UringLoop& loop, UringConnection* conn, int res) {
+  conn->opening = false;
+
+  if (res < 0) {
+    std::cerr << "ERROR: connection " << conn->id
+              << ": openat(): " << strerror(-res) << std::endl;
+    conn->state = Connection::State::FAILED;
+  } else {
+    conn->slot = res;
+    if (conn->state == Connection::State::RECEIVING) {
+      uring_arm_recv(loop, conn);
+      return;
+    }
+  }
+  uring_finish(loop, conn);
+}
+
+void Server::uring_recv(UringLoop& loop, UringConnection* conn, int res,
+                        unsigned flags) {
+  if (!(flags & IORING_CQE_F_MORE)) {
+    conn->receiving = false;
+  }
+
+  if (res > 0) {
+    uint16_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+    uint64_t offset = conn->offset;
+    unsigned len = res;  // the part that's file, not trailer
+    if (conn->state == Connection::State::RECEIVING) {
+      try {
+        if (conn->stream.attached()) {
+          offset = conn->stream.claim(res);
+        } else {
+          len = conn->digest.feed(loop.bufs.buffer(bid), res);
+        }
+      } catch (std::runtime_error& e) {
+        std::cerr << "ERROR: connection " << conn->id << ": " << e.what()
+                  << std::endl;
+        conn->state = Connection::State::FAILED;
+        if (conn->receiving) {
+          uring_cancel(loop.ring, tag(U_RECV, conn));
+        }
+      }
+    }
+
+    if (conn->state == Connection::State::TIMED_OUT ||
+        conn->state == Connection::State::FAILED) {
+      loop.bufs.give_back(bid);  // about to be replaced by ERROR anyway
+    } else if (len == 0) {
+      loop.timers.touch(conn->timer, TIMEOUT_TICKS);
+      count_received(res);
+      uring_throttle(loop, conn, res);
+      loop.bufs.give_back(bid);
+    } else {
+      loop.timers.touch(conn->timer, TIMEOUT_TICKS);
+      count_received(res);
+      uring_throttle(loop, conn, res);
+      loop.writes[bid] = UringLoop::PendingWrite{conn, offset, len, 0};
+      conn->offset += len;
+      conn->inflight++;
+      uring_write(loop, bid);
+    }
+
+  } else if (res == 0) {
+    if (conn->state == Connection::State::RECEIVING) {
+      conn->state = Connection::State::CLOSED;
+    }
+
+  } else if (res == -ENOBUFS) {
+    /* every buffer is waiting on a write; uring_written() rearms us */
+    conn->starved = true;
+    loop.starved.push_back(conn);
+    return;
+
+  } else if (res != -ECANCELED) {
+    std::cerr << "ERROR: connection " << conn->id
+              << ": recv(): " << strerror(-res) << std::endl;
+    conn->state = Connection::State::FAILED;
+  }
+
+  if (!conn->receiving && !conn->throttled &&
+      conn->state == Connection::State::RECEIVING) {
+    uring_arm_recv(loop, conn);
+  }
+  uring_finish(loop, conn);
+}
+
+/* Charges a connection for what it just received. One the Throttle holds
+ * back has its multishot recv cancelled (buffers already picked still
+ * arrive and are written as usual) and a timeout armed, whose completion
+ * rearms the recv; meanwhile its data waits in the socket. */
+void Server::uring_throttle(UringLoop& loop, UringConnection* conn,
+                            size_t n) {
+  uint64_t wait = charge(throttle.get(), conn->quota, n);
+  if (wait == 0 || conn->throttled ||
+      conn->state != Connection::State::RECEIVING) {
+    return;
+  }
+
+  conn->pause.tv_sec = wait / 1000000;
+  conn->pause.tv_nsec = wait % 1000000 * 1000;
+  struct io_uring_sqe* sqe = loop.ring.sqe();
+  sqe->opcode = IORING_OP_TIMEOUT;
+  sqe->addr = reinterpret_cast<uintptr_t>(&conn->pause);
+  sqe->len = 1;
+  sqe->user_data = tag(U_THROTTLE, conn);
+  conn->throttled = true;
+
+  if (conn->receiving) {
+    uring_cancel(loop.ring, tag(U_RECV, conn));
+  }
+}
+
+void Server::uring_written(UringLoop& loop, uint16_t bid, int res) {
+  UringLoop::PendingWrite& w = loop.writes[bid];
+  UringConnection* conn = w.conn;
+
+  if (res > 0 && w.done + res < w.len) {
+    w.done += res;  // short write, carry on from where it stopped
+    uring_write(loop, bid);
+    return;
+  }
+  if (res <= 0) {
+    std::cerr << "ERROR: connection " << conn->id << ": write(): "
+              << (res < 0 ? strerror(-res) : "no progress") << std::endl;
+    conn->state = Connection::State::FAILED;
+    if (conn->stream.attached()) {
+      conn->stream.fault();
+    }
+    if (conn->receiving) {
+      uring_cancel(loop.ring, tag(U_RECV, conn));
+    }
+  } else {
+    thread_metrics().write_latency.record(w.issued.micros());
+  }
+
+  loop.bufs.give_back(bid);
+  conn->inflight--;
+
+  /* a buffer is free again, so someone who ran out can go on receiving */
+  while (!loop.starved.empty()) {
+    UringConnection* next = loop.starved.back();
+    loop.starved.pop_back();
+    next->starved = false;
+    if (next->state == Connection::State::RECEIVING && !next->throttled) {
+      uring_arm_recv(loop, next);
+      break;
+    }
+    uring_finish(loop, next);
+  }
+
+  uring_finish(loop, conn);
+}
+
+void Server::uring_expire(UringLoop& loop) {
+  loop.expired.clear();
+  loop.timers.advance(loop.expired);
+  assemblies.expire();
+
+  for (void* owner : loop.expired) {
+    UringConnection* conn = static_cast<UringConnection*>(owner);
+    if (conn->state != Connection::State::RECEIVING) {
+      continue;
+    }
+    if (conn->throttled) {
+      /* it isn't idle, the Throttle is holding it back */
+      loop.timers.schedule(conn->timer, TIMEOUT_TICKS);
+      continue;
+    }
+    TRACE_EVENT("timeout", "id", conn->id);
+    conn->state = Connection::State::TIMED_OUT;
+    if (conn->receiving) {
+      uring_cancel(loop.ring, tag(U_RECV, conn));
+    }
+    if (conn->peeking) {
+      uring_cancel(loop.ring, tag(U_PEEK, conn));
+    }
+    if (conn->polling) {
+      uring_cancel(loop.ring, tag(U_FETCH, conn));
+    }
+    uring_finish(loop, conn);
+  }
+}
+
+/* Tears a connection down once it's done and the kernel holds no more
+ * requests that refer to it. */
+void Server::uring_finish(UringLoop& loop, UringConnection* conn) {
+  if (conn->state == Connection::State::RECEIVING || conn->receiving ||
+      conn->inflight > 0 || conn->opening || conn->starved ||
+      conn->peeking || conn->polling || conn->throttled) {
     return;
   }
+
+  if (conn->slot >= 0) {
+    struct io_uring_sqe* sqe = loop.ring.sqe();
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = conn->slot + 1;
+    sqe->user_data = tag(U_CLOSE);
+  }
+
+  /* every write through the direct descriptor has completed, so the spool
+   * is complete; closing it can wait for the next submission */
+  try {
+    if (conn->fetch.active()) {
+      /* sent, or not; either way there's no file to write */
+    } else if (conn->stream.attached()) {
+      conn->stream.finish(conn->state == Connection::State::CLOSED,
+                          conn->state == Connection::State::TIMED_OUT);
+    } else if (conn->state == Connection::State::TIMED_OUT) {
+      Spool::fail_hidden(*layout->dir(conn->id), conn->name, timeout_marker);
+    } else if (conn->slot >= 0) {
+      conn->digest.seal(*conn->dir, conn->name, conn->id);
+      if (config.durability == Durability::GROUP) {
+        uring_commit(loop, conn);
+        return;
+      }
+      if (config.durability == Durability::CLOSE) {
+        /* the ring's descriptor for it is a direct one, which fsync can't
+         * take outside the ring */
+        FileDescriptor::openat_cw(*conn->dir, conn->spool).sync();
+      }
+      Spool::publish_hidden(*conn->dir, conn->name);
+      if (config.durability == Durability::CLOSE) {
+        conn->dir->sync();
+      }
+    }
+  } catch (std::runtime_error& e) {
+    std::cerr << "ERROR: connection " << conn->id << ": " << e.what()
+              << std::endl;
+    conn->state = Connection::State::FAILED;
+  }
+  if (conn->fetch.active()) {
+    count_fetch(conn->state);
+  } else {
+    count_upload(conn->state, conn->age);
+  }
+
+  loop.conns.erase(conn);
+  uring_admit(loop);
+}
+
+/* uring_finish() for an upload under Durability::GROUP: the group commit
+ * renames it into place and, once the name is on disk, counts it and closes
+ * (or resets) its socket, which is all that outlives the UringConnection */
+void Server::uring_commit(UringLoop& loop, UringConnection* conn) {
+  struct Committing {
+    ConnectedSocket sock;
+    Layout::Dir dir;
+    std::string name;
+    int id;
+    Connection::State state;
+    Stopwatch age;
+  };
+  std::shared_ptr<Committing> c{new Committing{std::move(conn->sock),
+                                               conn->dir, conn->name,
+                                               conn->id, conn->state,
+                                               conn->age}};
+
+  commits->add(
+      [c](bool synced) {
+        try {
+          if (synced) {
+            Spool::publish_hidden(*c->dir, c->name);
+          } else {
+            Spool::fail_hidden(*c->dir, c->name, sync_marker);
+            c->state = Connection::State::FAILED;
+          }
+        } catch (std::runtime_error& e) {
+          std::cerr << "ERROR: connection " << c->id << ": " << e.what()
+                    << std::endl;
+          c->state = Connection::State::FAILED;
+        }
+      },
+      [c](bool named) {
+        release_upload(named, c->id, c->state);
+        if (c->state == Connection::State::FAILED) {
+          c->sock.abort();
+        }
+        count_upload(c->state, c->age);
+      });
+
+  loop.conns.erase(conn);
+  uring_admit(loop);
 }
 
 /* main code block */
 
-/* Blocks SIGQUIT and SIGTERM signals in current thread (main); any threads
- * spawned by main will inherit this signal mask.
+/* Blocks SIGQUIT, SIGTERM, SIGUSR1, SIGUSR2 and SIGHUP in current thread
+ * (main); any threads spawned by main will inherit this signal mask.
  * Replaces block_mask with the set of signals that have been blocked */
 static void block_signals(sigset_t *block_mask) {
   sigemptyset(block_mask);
   sigaddset(block_mask, SIGINT);
   sigaddset(block_mask, SIGQUIT);
   sigaddset(block_mask, SIGTERM);
+  sigaddset(block_mask, SIGUSR1);
+  sigaddset(block_mask, SIGUSR2);
+  sigaddset(block_mask, SIGHUP);
 
   if (pthread_sigmask(SIG_BLOCK, block_mask, NULL) == -1) {
     throw std::runtime_error{"pthread_sigmask(): " +
@@ -140,45 +1796,225 @@ static void block_signals(sigset_t *block_mask) {
   }
 }
 
-/* A thread routine that unblocks and handles SIGQUIT and SIGTERM signals.
- * 'arg' is a pointer to a sigset_t which specifies signals to wait for */
-static void handle_signals(sigset_t* sigset) {
+/* A thread routine that unblocks and handles SIGQUIT and SIGTERM signals,
+ * dumps the metrics to stderr on every SIGUSR1, the trace to 'trace_path'
+ * (if there is one) on every SIGUSR2 and rereads the limits file on every
+ * SIGHUP.
+ * 'sigset' specifies signals to wait for, 'server' is told to stop */
+static void handle_signals(sigset_t* sigset, Server* server,
+                           std::string trace_path) {
   int sig_caught;
 
-  if (sigwait(sigset, &sig_caught) == -1) {
-    throw std::runtime_error{"sigwait(): " + std::string{strerror(errno)}};
-    // XXX: will call std::terminate()
-  }
-
-  switch (sig_caught) {
-    case SIGINT:
-    case SIGQUIT:
-    case SIGTERM:
-      /* _exit() will kill the process immediately and won't clean up our
-       * server object appropriately :(
-       * There's not much we can do about this because we can't propogate
-       * exceptions out of threads without keeping the main thread waiting.
-       *
-       * Potential workaround:
-       * Send a signal to the main thread which handles it by using setjmp? */
-      _exit(EXIT_SUCCESS);
-      break;
+  while (true) {
+    if (sigwait(sigset, &sig_caught) == -1) {
+      throw std::runtime_error{"sigwait(): " + std::string{strerror(errno)}};
+      // XXX: will call std::terminate()
+    }
+
+    switch (sig_caught) {
+      case SIGUSR1:
+        std::cerr << render_metrics() << std::flush;
+        break;
+      case SIGUSR2:
+        if (trace_path.empty()) {
+          break;
+        }
+        try {
+          dump_trace(trace_path);
+        } catch (std::runtime_error& e) {
+          std::cerr << "ERROR: " << e.what() << std::endl;
+        }
+        break;
+      case SIGHUP:
+        if (server->reload_limits()) {
+          break;
+        }
+        /* no limits to reload: hang up like it always has */
+      case SIGINT:
+      case SIGQUIT:
+      case SIGTERM:
+        /* rather than _exit()ing from here, have start() return in the main
+         * thread so the server object gets to clean up after itself */
+        server->stop();
+        return;
+    }
   }
 }
 
-int main(int argc, char* argv[]) {
-  if (argc != 3) {
-    std::cerr << "Usage: " << argv[0] << " <PORT> <FILE-DIR>" << std::endl;
-    return EXIT_FAILURE;
+static std::string usage =
+    " [-e epoll|uring|threaded] [-t THREADS] [-c MAX-CONNS] [-r] [-i splice|copy]"
+    " [-s SHARDS] [-p] [-d] [-v] [-m STATS-SOCKET] [-k SECONDS] [-x MAX-MIB]"
+    " [-D]"
+    " [-C] [-l FILES-PER-DIR] [-f none|close|group] [-q LIMITS-FILE]"
+    " [-u UPGRADE-SOCKET] [-T TRACE-FILE] <PORT> <FILE-DIR>";
+
+/* parses a positive count, no more than max, for a command line option */
+static size_t parse_count(char opt, const char* arg,
+                          unsigned long max = ULONG_MAX) {
+  char* end;
+  errno = 0;
+  unsigned long val = strtoul(arg, &end, 10);
+  if (*arg == '\0' || *end != '\0' || val == 0 || val > max ||
+      errno == ERANGE) {
+    throw std::runtime_error{std::string{"invalid value for -"} + opt + ": " +
+                             arg};
   }
+  return val;
+}
+
+static void report_pool(const std::string& name, BufferPool& pool) {
+  BufferPool::Usage u = pool.usage();
+  std::cerr << name << ": size=" << pool.size() << " in_use=" << u.in_use
+            << " high_water=" << u.high_water << " slabs=" << u.slabs
+            << " bytes=" << u.bytes << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+  ServerConfig config;
+  bool verbose = false;
+  std::string stats_path;
+  std::string upgrade_path;
+  std::string trace_path;
+  int opt;
 
   try {
+    while ((opt = getopt(argc, argv, "e:t:c:ri:s:pdvm:k:x:DCl:f:q:u:T:")) != -1) {
+      switch (opt) {
+        case 'e':
+          if (std::string{optarg} == "epoll") {
+            config.engine = Engine::EVENTED;
+          } else if (std::string{optarg} == "threaded") {
+            config.engine = Engine::THREADED;
+          } else if (std::string{optarg} == "uring") {
+            config.engine = Engine::URING;
+          } else {
+            throw std::runtime_error{"unknown engine " + std::string{optarg}};
+          }
+          break;
+        case 't':
+          config.workers = parse_count(opt, optarg);
+          break;
+        case 'c':
+          config.max_conns = parse_count(opt, optarg);
+          break;
+        case 'r':
+          config.reject = true;
+          break;
+        case 'i':
+          if (std::string{optarg} == "splice") {
+            config.splice = true;
+          } else if (std::string{optarg} == "copy") {
+            config.splice = false;
+          } else {
+            throw std::runtime_error{"unknown I/O path " +
+                                     std::string{optarg}};
+          }
+          break;
+        case 's':
+          config.shards = parse_count(opt, optarg);
+          break;
+        case 'p':
+          config.pin = true;
+          break;
+        case 'd':
+          config.direct = true;
+          break;
+        case 'v':
+          verbose = true;
+          break;
+        case 'm':
+          stats_path = optarg;
+          break;
+        case 'k':
+          config.retention = parse_count(opt, optarg);
+          break;
+        case 'x':
+          /* MiB, so as many as still fit in bytes */
+          config.max_total =
+              static_cast<uint64_t>(parse_count(opt, optarg, UINT64_MAX >> 20))
+              << 20;
+          break;
+        case 'D':
+          config.dedup = true;
+          break;
+        case 'C':
+          config.checksum = true;
+          break;
+        case 'l':
+          config.per_dir = parse_count(opt, optarg);
+          break;
+        case 'f':
+          if (std::string{optarg} == "none") {
+            config.durability = Durability::NONE;
+          } else if (std::string{optarg} == "close") {
+            config.durability = Durability::CLOSE;
+          } else if (std::string{optarg} == "group") {
+            config.durability = Durability::GROUP;
+          } else {
+            throw std::runtime_error{"unknown fsync policy " +
+                                     std::string{optarg}};
+          }
+          break;
+        case 'q':
+          config.limits = optarg;
+          break;
+        case 'u':
+          upgrade_path = optarg;
+          break;
+        case 'T':
+          trace_path = optarg;
+          break;
+        default:
+          std::cerr << "Usage: " << argv[0] << usage << std::endl;
+          return EXIT_FAILURE;
+      }
+    }
+
+    if (argc - optind != 2) {
+      std::cerr << "Usage: " << argv[0] << usage << std::endl;
+      return EXIT_FAILURE;
+    }
+
+    if (!trace_path.empty() && !tracing_built()) {
+      std::cerr << "WARNING: built without tracepoints (make -B TRACE=1); "
+                << "the trace will be empty" << std::endl;
+    }
+
+    /* a fetch's client may go away in the middle of a sendfile(); that's
+     * an error for its connection, not a reason to die */
+    signal(SIGPIPE, SIG_IGN);
+
     sigset_t blocked;
     block_signals(&blocked);
-    std::thread{handle_signals, &blocked}.detach();
-    Server s{argv[1], argv[2]};
+    std::unique_ptr<Takeover> takeover;
+    Handoff inherited;
+    if (!upgrade_path.empty()) {
+      takeover.reset(new Takeover{upgrade_path});
+      inherited = takeover->handoff();
+    }
+    Server s{argv[optind], argv[optind + 1], config, inherited};
+    std::unique_ptr<StatsSocket> stats;
+    if (!stats_path.empty()) {
+      stats.reset(new StatsSocket{stats_path});
+    }
+    std::unique_ptr<UpgradeSocket> upgrade;
+    if (!upgrade_path.empty()) {
+      upgrade.reset(new UpgradeSocket{upgrade_path, s.handoff(),
+                                      [&s] { s.drain(); }});
+      takeover->accepting();  // the old server drains from here on
+    }
+    std::thread{handle_signals, &blocked, &s, trace_path}.detach();
     s.start();
 
+    if (!trace_path.empty()) {
+      dump_trace(trace_path);  // whatever came after the last SIGUSR2
+    }
+    if (verbose) {
+      report_pool("socket_buffers", socket_buffers());
+      report_pool("block_buffers", block_buffers());
+      report_pool("write_buffers", write_buffers());
+    }
+
   } catch (std::runtime_error& e) {
     std::cerr << "ERROR: " << e.what() << std::endl;
     return EXIT_FAILURE;
@@ -2,18 +2,183 @@
 #define SERVER_HPP
 
 #include "socket.hpp"
+#include "checksum.hpp"
+#include "dedup.hpp"
+#include "durable.hpp"
+#include "fetch.hpp"
 #include "file.hpp"
+#include "frames.hpp"
+#include "layout.hpp"
+#include "metrics.hpp"
+#include "pool.hpp"
+#include "reactor.hpp"
+#include "receive.hpp"
+#include "timer.hpp"
+#include "spool.hpp"
+#include "throttle.hpp"
+#include "upgrade.hpp"
+#include "uring.hpp"
+#include "writer.hpp"
 
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
-#define BACKLOG 10
-#define THREADS 10
+#define BACKLOG 512  // per listening socket; a connection storm overflows a short one
+#define THREADS 64       // worker threads for the threaded engine
+#define MAX_CONNS 4096   // connections being serviced or waiting for a worker
+#define TIMEOUT_TICKS (TIMEOUT * 1000 / TICK_MS)
+#define URING_BUFS 256       // provided recv buffers
+#define URING_BUFSIZE 65536
+#define DRR_QUANTUM SOCKBUF  // bytes a connection may read per round
+
+/* how the server services its clients:
+ *   THREADED  a pool of worker threads, blocking I/O
+ *   EVENTED   an edge-triggered epoll loop per shard, nonblocking sockets
+ *   URING     an io_uring per shard; falls back to EVENTED where unsupported */
+enum class Engine { THREADED, EVENTED, URING };
+
+struct ServerConfig {
+  ServerConfig()
+      : engine(Engine::EVENTED), workers(THREADS), max_conns(MAX_CONNS),
+        reject(false), splice(true), shards(1), pin(false), direct(false),
+        retention(RESUME_RETENTION), max_total(ASSEMBLY_MAX_TOTAL),
+        dedup(false), checksum(false), per_dir(0),
+        durability(Durability::NONE) {}
+
+  Engine engine;
+  size_t workers;    // threaded engine only
+  size_t max_conns;  // admission cap, per shard for the event loops
+  bool reject;       // when full, reset new connections instead of pausing
+  bool splice;       // move data socket -> pipe -> file, never into user space
+  size_t shards;     // listening sockets (SO_REUSEPORT), each with its own loop
+  bool pin;          // pin shard i to CPU i
+  bool direct;       // write files with O_DIRECT; turns splice off
+  unsigned retention;  // seconds a broken resumable upload is kept
+  uint64_t max_total;  // bytes a multi-stream or resumable upload may have
+  bool dedup;        // store chunks once, files as manifests; turns splice off
+  bool checksum;     // a CRC32C sidecar for every plain upload; ditto
+  unsigned per_dir;  // files per subdirectory of the file dir; 0 for none
+  Durability durability;  // of finished uploads
+  std::string limits;     // bandwidth limits file (see Limits); "" for none
+};
+
+/* A connection serviced by the evented engine. Each one is a tiny state
+ * machine that starts out RECEIVING and is reaped by the event loop as soon
+ * as it reaches any other state. */
+struct Connection {
+  enum class State { RECEIVING, CLOSED, TIMED_OUT, FAILED };
+  typedef std::chrono::steady_clock::time_point Time;
+
+  Connection(ConnectedSocket sock, int id, const ServerConfig& config);
+
+  ConnectedSocket sock;
+  std::unique_ptr<UploadFile> upload;  // once it's known to be a plain one
+  int id;
+  State state;
+  bool splice;  // cleared for good the first time splice() is refused
+  bool detected;  // has sent enough to tell whether it's a stream
+  bool committing;  // finished, for a GroupCommit to publish and close
+  Stream stream;  // attached if so; it never opens an upload then
+  Fetch fetch;    // active if it's a fetch; nor does that, it's written to
+  Digest digest;
+  TimerWheel::Entry timer;  // idle timeout, refreshed on every read
+  Stopwatch age;            // since accept(), for upload_duration
+  bool queued;              // in the loop's ready queue, see Server::service
+  long deficit;             // bytes it may still read this round
+  Time held;                // not to be read before, under a Throttle
+  Throttle::Quota quota;
+};
+
+/* everything owned by one evented loop */
+struct EventLoop {
+  typedef std::unordered_map<int, std::unique_ptr<Connection>> ConnectionMap;
+
+  explicit EventLoop(ListeningSocket& listener)
+      : listener(listener), paused(false) {}
+
+  ListeningSocket& listener;  // this shard's
+  Reactor reactor;
+  TimerWheel timers;
+  ConnectionMap conns;  // declared after timers: must be destroyed first
+  std::deque<Connection*> ready;  // with more to read (or send) than a round
+  Pipe pipe;
+  std::vector<void*> expired;
+  bool paused;  // stopped accepting because the server is full
+};
+
+/* A connection serviced by the io_uring engine. Unlike a Connection it can't
+ * simply be destroyed when it's done: the kernel may still hold requests
+ * that point at it, so it lingers until every one of them has completed. */
+struct UringConnection {
+  UringConnection(ConnectedSocket sock, int id, const ServerConfig& config);
+
+  ConnectedSocket sock;
+  std::string name;
+  std::string spool;    // hidden name while receiving; outlives the openat
+  Layout::Dir dir;      // ...in here, once uring_open() has picked it
+  int id;
+  int slot;             // direct descriptor of the file, -1 until opened
+  uint64_t offset;      // where the next received chunk goes in the file
+  unsigned inflight;    // writes submitted but not completed
+  bool opening;
+  bool receiving;       // a multishot recv is armed
+  bool starved;         // recv ran out of provided buffers, see UringLoop
+  bool peeking;         // looking for a FrameHeader, see Server::uring_peeked
+  bool peeked_all;      // ...and waiting for the whole of one
+  bool polling;         // a fetch waiting for room on its socket
+  bool throttled;       // recv stopped until a Throttle's pause is over
+  struct __kernel_timespec pause;  // ...this long, read by the kernel
+  char head[FRAME_HEADER];
+  Stream stream;        // attached if it's a stream; never opens a spool then
+  Fetch fetch;          // active if it's a fetch; nor does that
+  Digest digest;
+  Connection::State state;
+  TimerWheel::Entry timer;
+  Stopwatch age;
+  Throttle::Quota quota;
+};
+
+/* everything owned by the io_uring engine */
+struct UringLoop {
+  /* what a write in flight is doing with provided buffer 'bid' */
+  struct PendingWrite {
+    UringConnection* conn;
+    uint64_t offset;
+    unsigned len;
+    unsigned done;
+    Stopwatch issued;  // for write_latency, across short writes
+  };
+
+  UringLoop(size_t max_files, ListeningSocket& listener);
+
+  ListeningSocket& listener;  // this shard's
+  Ring ring;
+  ProvidedBuffers bufs;
+  TimerWheel timers;
+  std::unordered_map<UringConnection*, std::unique_ptr<UringConnection>> conns;
+  std::vector<PendingWrite> writes;         // indexed by buffer id
+  std::vector<UringConnection*> starved;    // waiting for a free buffer
+  std::vector<void*> expired;
+  bool accepting;         // the multishot accept is armed
+  bool cancelling;        // ...and we've asked for it to be cancelled
+  bool accepted_any;
+};
 
 class Server {
  public:
-  Server(const std::string& port, const std::string& file_directory);
+  /* with a handoff from an older server (see upgrade.hpp), takes over its
+   * listening sockets and connection counter instead of binding the port */
+  Server(const std::string& port, const std::string& file_directory,
+         const ServerConfig& config = ServerConfig{},
+         const Handoff& inherited = Handoff{});
   Server(const Server& that) = delete; /* server's threads cannot be copied! */
   /* TODO: perhaps declare a move constructor & move assignment */
   ~Server();
@@ -21,10 +186,75 @@ class Server {
   void start();
   void recv_file(ConnectedSocket client, int client_id);
 
+  /* makes start() return; safe to call from any thread */
+  void stop();
+
+  /* stops accepting and lets start() return once every connection in hand
+   * has finished on its own, for a server that has handed its listening
+   * sockets to another; safe to call from any thread */
+  void drain();
+
+  /* what to hand a server taking over from this one; still ours */
+  Handoff handoff() const;
+
+  /* reads the limits file again, if there is one, and returns whether
+   * there was; safe to call from any thread */
+  bool reload_limits();
+
  private:
-  FileDescriptor dir;
-  ListeningSocket sock;
-  int n_conn;
+  void run_shard(size_t shard);
+
+  void start_threaded(ListeningSocket& listener);
+  void limit(Throttle::Quota& quota, const ConnectedSocket& client);
+  bool track(const ConnectedSocket& client);
+  void untrack(const ConnectedSocket& client);
+
+  void start_evented(ListeningSocket& listener);
+  void accept_all(EventLoop& loop);
+  void service(EventLoop& loop, Connection& conn);
+  void run_round(EventLoop& loop);
+  ssize_t pump(EventLoop& loop, Connection& conn);
+  void expire_timeouts(EventLoop& loop);
+  void reap(EventLoop& loop, Connection& conn);
+  void open_upload(Connection& conn);
+  void publish_upload(Connection& conn);
+  void expire_upload(Connection& conn);
+  void commit(EventLoop& loop, std::unique_ptr<Connection> conn);
+
+  void start_uring(ListeningSocket& listener);
+  void run_uring(UringLoop& loop);
+  void uring_admit(UringLoop& loop);
+  void uring_accept(UringLoop& loop, int res, unsigned flags);
+  void uring_peeked(UringLoop& loop, UringConnection* conn, int res);
+  void uring_fetch(UringLoop& loop, UringConnection* conn);
+  void uring_open(UringLoop& loop, UringConnection* conn);
+  void uring_opened(UringLoop& loop, UringConnection* conn, int res);
+  void uring_recv(UringLoop& loop, UringConnection* conn, int res,
+                  unsigned flags);
+  void uring_written(UringLoop& loop, uint16_t bid, int res);
+  void uring_throttle(UringLoop& loop, UringConnection* conn, size_t n);
+  void uring_expire(UringLoop& loop);
+  void uring_finish(UringLoop& loop, UringConnection* conn);
+  void uring_commit(UringLoop& loop, UringConnection* conn);
+
+  std::unique_ptr<Layout> layout;  // of the file dir
+  std::vector<std::unique_ptr<ListeningSocket>> listeners;  // one per shard
+  ServerConfig config;
+  SharedCounter next_id;  // shared by every shard so ids never repeat
+  Assemblies assemblies;     // multi-stream and resumable uploads, shared
+  std::unique_ptr<ChunkStore> chunks;  // config.dedup only
+  std::unique_ptr<GroupCommit> commits;  // Durability::GROUP only
+  std::unique_ptr<Throttle> throttle;    // config.limits only
+
+  std::atomic<bool> running;
+  FileDescriptor wakeup;  // eventfd, becomes readable on stop()
+  std::atomic<bool> draining;
+  FileDescriptor drained;  // eventfd, becomes readable on drain()
+
+  /* sockets handed to the worker pool, so stop() can cut them short */
+  std::mutex active_lock;
+  std::unordered_set<int> active;
+  std::unique_ptr<ThreadPool> workers;  // last: joined before the rest goes
 };
 
 #endif // SERVER_HPP
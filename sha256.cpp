@@ -0,0 +1,232 @@
+#include "sha256.hpp"
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+#include <cstring>
+
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+static inline uint32_t rotr(uint32_t x, unsigned n) {
+  return (x >> n) | (x << (32 - n));
+}
+
+static void compress_portable(uint32_t state[8], const unsigned char* block,
+                              size_t count) {
+  for (; count > 0; count--, block += SHA256_BLOCK) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+      w[i] = static_cast<uint32_t>(block[4 * i]) << 24 |
+             static_cast<uint32_t>(block[4 * i + 1]) << 16 |
+             static_cast<uint32_t>(block[4 * i + 2]) << 8 | block[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+      uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++) {
+      uint32_t s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+      uint32_t ch = (e & f) ^ (~e & g);
+      uint32_t t1 = h + s1 + ch + K[i] + w[i];
+      uint32_t s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+      uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+      uint32_t t2 = s0 + maj;
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+  }
+}
+
+/* The SHA extensions work on the state as ABEF/CDGH pairs and do two rounds
+ * per sha256rnds2; each group of four rounds also advances the message
+ * schedule for the groups after it (sha256msg1/msg2). */
+__attribute__((target("sha,sse4.1"))) static void compress_shani(
+    uint32_t state[8], const unsigned char* block, size_t count) {
+  const __m128i shuffle =
+      _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+  __m128i tmp = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&state[0]));
+  __m128i state1 =
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(&state[4]));
+  tmp = _mm_shuffle_epi32(tmp, 0xB1);                // CDAB
+  state1 = _mm_shuffle_epi32(state1, 0x1B);          // EFGH
+  __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);  // ABEF
+  state1 = _mm_blend_epi16(state1, tmp, 0xF0);       // CDGH
+
+  for (; count > 0; count--, block += SHA256_BLOCK) {
+    __m128i abef = state0;
+    __m128i cdgh = state1;
+    __m128i msgs[4];
+
+    /* unrolled, so msgs[] lives in registers */
+#pragma GCC unroll 16
+    for (int i = 0; i < 16; i++) {
+      if (i < 4) {
+        msgs[i] = _mm_shuffle_epi8(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + 16 * i)),
+            shuffle);
+      }
+      __m128i msg = _mm_add_epi32(
+          msgs[i % 4],
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(&K[4 * i])));
+      state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+      if (i >= 3 && i <= 14) {
+        __m128i& next = msgs[(i + 1) % 4];
+        next = _mm_add_epi32(
+            next, _mm_alignr_epi8(msgs[i % 4], msgs[(i + 3) % 4], 4));
+        next = _mm_sha256msg2_epu32(next, msgs[i % 4]);
+      }
+      msg = _mm_shuffle_epi32(msg, 0x0E);
+      state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+      if (i >= 1 && i <= 12) {
+        msgs[(i + 3) % 4] = _mm_sha256msg1_epu32(msgs[(i + 3) % 4], msgs[i % 4]);
+      }
+    }
+
+    state0 = _mm_add_epi32(state0, abef);
+    state1 = _mm_add_epi32(state1, cdgh);
+  }
+
+  tmp = _mm_shuffle_epi32(state0, 0x1B);          // FEBA
+  state1 = _mm_shuffle_epi32(state1, 0xB1);       // DCHG
+  state0 = _mm_blend_epi16(tmp, state1, 0xF0);    // DCBA
+  state1 = _mm_alignr_epi8(state1, tmp, 8);       // HGFE
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(&state[0]), state0);
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(&state[4]), state1);
+}
+
+static bool have_shani() {
+  static const bool have = [] {
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+      return false;
+    }
+    bool sha = ebx & (1u << 29);
+    __get_cpuid(1, &eax, &ebx, &ecx, &edx);
+    return sha && (ecx & bit_SSE4_1) && (ecx & bit_SSSE3);
+  }();
+  return have;
+}
+
+static bool shani_wanted = true;
+
+bool Sha256::accelerated() {
+  return shani_wanted && have_shani();
+}
+
+void Sha256::accelerate(bool on) {
+  shani_wanted = on;
+}
+
+Sha256::Sha256() : fill(0), total(0) {
+  static const uint32_t initial[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372,
+                                      0xa54ff53a, 0x510e527f, 0x9b05688c,
+                                      0x1f83d9ab, 0x5be0cd19};
+  memcpy(state, initial, sizeof(state));
+}
+
+void Sha256::compress(const unsigned char* blocks, size_t count) {
+  if (accelerated()) {
+    compress_shani(state, blocks, count);
+  } else {
+    compress_portable(state, blocks, count);
+  }
+}
+
+void Sha256::update(const char* data, size_t len) {
+  const unsigned char* in = reinterpret_cast<const unsigned char*>(data);
+  total += len;
+
+  if (fill > 0) {
+    size_t n = std::min(len, static_cast<size_t>(SHA256_BLOCK) - fill);
+    memcpy(pending + fill, in, n);
+    fill += n;
+    in += n;
+    len -= n;
+    if (fill < SHA256_BLOCK) {
+      return;
+    }
+    compress(pending, 1);
+    fill = 0;
+  }
+
+  size_t blocks = len / SHA256_BLOCK;
+  if (blocks > 0) {
+    compress(in, blocks);
+    in += blocks * SHA256_BLOCK;
+    len -= blocks * SHA256_BLOCK;
+  }
+  memcpy(pending, in, len);
+  fill = len;
+}
+
+void Sha256::finish(unsigned char digest[SHA256_BYTES]) {
+  uint64_t bits = total * 8;
+
+  /* a one bit, zeros up to 8 bytes short of a block, then the length */
+  pending[fill++] = 0x80;
+  if (fill > SHA256_BLOCK - 8) {
+    memset(pending + fill, 0, SHA256_BLOCK - fill);
+    compress(pending, 1);
+    fill = 0;
+  }
+  memset(pending + fill, 0, SHA256_BLOCK - 8 - fill);
+  for (int i = 0; i < 8; i++) {
+    pending[SHA256_BLOCK - 1 - i] = static_cast<unsigned char>(bits >> (8 * i));
+  }
+  compress(pending, 1);
+
+  for (int i = 0; i < 8; i++) {
+    digest[4 * i] = state[i] >> 24;
+    digest[4 * i + 1] = state[i] >> 16;
+    digest[4 * i + 2] = state[i] >> 8;
+    digest[4 * i + 3] = state[i];
+  }
+}
+
+std::string Sha256::hex(const char* data, size_t len) {
+  Sha256 sha;
+  unsigned char digest[SHA256_BYTES];
+  sha.update(data, len);
+  sha.finish(digest);
+  return hex(digest);
+}
+
+std::string Sha256::hex(const unsigned char digest[SHA256_BYTES]) {
+  static const char digits[] = "0123456789abcdef";
+  std::string out(2 * SHA256_BYTES, '0');
+  for (int i = 0; i < SHA256_BYTES; i++) {
+    out[2 * i] = digits[digest[i] >> 4];
+    out[2 * i + 1] = digits[digest[i] & 0xf];
+  }
+  return out;
+}
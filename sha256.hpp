@@ -0,0 +1,39 @@
+#ifndef SHA256_HPP
+#define SHA256_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#define SHA256_BYTES 32
+#define SHA256_BLOCK 64
+
+/* SHA-256, one-shot or streaming. Blocks are compressed with the SHA
+ * extensions (SHA-NI) on CPUs that have them, which is several times faster
+ * than the portable rounds used everywhere else. */
+class Sha256 {
+ public:
+  Sha256();
+
+  void update(const char* data, size_t len);
+  void finish(unsigned char digest[SHA256_BYTES]);
+
+  static std::string hex(const char* data, size_t len);
+  static std::string hex(const unsigned char digest[SHA256_BYTES]);
+
+  /* whether blocks go through SHA-NI; on by default where the CPU has it.
+   * Turning it off sends every block through the portable rounds, so
+   * test/sha256 can check those on any machine. */
+  static bool accelerated();
+  static void accelerate(bool on);
+
+ private:
+  void compress(const unsigned char* blocks, size_t count);
+
+  uint32_t state[8];
+  unsigned char pending[SHA256_BLOCK];
+  size_t fill;     // bytes in pending
+  uint64_t total;  // bytes hashed
+};
+
+#endif // SHA256_HPP
@@ -0,0 +1,93 @@
+#include "slab.hpp"
+#include "file.hpp"
+#include "socket.hpp"
+#include "writer.hpp"
+
+#include <cstdlib>
+#include <new>
+#include <utility>
+
+BufferPool::Buffer::Buffer(Buffer&& other) noexcept
+    : pool(other.pool), buf(other.buf) {
+  other.buf = nullptr;
+}
+
+BufferPool::Buffer::~Buffer() {
+  if (buf != nullptr) {
+    pool->give_back(buf);
+  }
+}
+
+BufferPool::Buffer& BufferPool::Buffer::operator=(Buffer&& other) noexcept {
+  if (this != &other) {
+    if (buf != nullptr) {
+      pool->give_back(buf);
+    }
+    pool = other.pool;
+    buf = other.buf;
+    other.buf = nullptr;
+  }
+  return *this;
+}
+
+BufferPool::BufferPool(size_t size)
+    : bufsize(size), in_use(0), high_water(0) {}
+
+BufferPool::Buffer BufferPool::borrow() {
+  std::lock_guard<std::mutex> guard{lock};
+
+  if (spare.empty()) {
+    void* mem;
+    if (posix_memalign(&mem, SLAB_ALIGN, bufsize * SLAB_BUFFERS) != 0) {
+      throw std::bad_alloc{};
+    }
+    char* slab = static_cast<char*>(mem);
+    slabs.emplace_back(slab);
+    for (size_t i = SLAB_BUFFERS; i > 0; i--) {
+      spare.push_back(slab + (i - 1) * bufsize);
+    }
+  }
+
+  char* buf = spare.back();
+  spare.pop_back();
+  if (++in_use > high_water) {
+    high_water = in_use;
+  }
+  return Buffer{this, buf};
+}
+
+void BufferPool::FreeSlab::operator()(char* slab) const {
+  free(slab);
+}
+
+void BufferPool::give_back(char* buf) {
+  std::lock_guard<std::mutex> guard{lock};
+  spare.push_back(buf);
+  in_use--;
+}
+
+BufferPool::Usage BufferPool::usage() {
+  std::lock_guard<std::mutex> guard{lock};
+
+  Usage u;
+  u.in_use = in_use;
+  u.high_water = high_water;
+  u.slabs = slabs.size();
+  u.bytes = slabs.size() * SLAB_BUFFERS * bufsize;
+  return u;
+}
+
+BufferPool& socket_buffers() {
+  static BufferPool pool{SOCKBUF};
+  return pool;
+}
+
+BufferPool& block_buffers() {
+  static BufferPool pool{BLOCKSIZE};
+  return pool;
+}
+
+BufferPool& write_buffers() {
+  static BufferPool pool{COALESCE_CHUNK};
+  return pool;
+}
@@ -0,0 +1,84 @@
+#ifndef SLAB_HPP
+#define SLAB_HPP
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#define SLAB_BUFFERS 16  // buffers carved out of each slab
+#define SLAB_ALIGN 4096  // slabs start on a page, good enough for O_DIRECT
+
+/* A pool of equally sized buffers, carved out of slabs of SLAB_BUFFERS at a
+ * time and handed out one by one for as long as an I/O call needs them.
+ *
+ * Buffers used to live inside every ConnectedSocket and FileDescriptor, so
+ * each idle connection pinned one whether it was reading or not; borrowing
+ * from a pool instead means memory follows the number of reads in progress,
+ * not the number of connections. Slabs are never given back to the system:
+ * the high-water mark is what the pool settles at. Safe to use from any
+ * number of threads. */
+class BufferPool {
+ public:
+  /* a borrowed buffer; goes back to its pool when destroyed */
+  class Buffer {
+   public:
+    Buffer() : pool(nullptr), buf(nullptr) {}  // holds nothing
+    Buffer(Buffer&& other) noexcept;
+    Buffer(const Buffer&) = delete;
+    ~Buffer();
+
+    Buffer& operator=(const Buffer&) = delete;
+    Buffer& operator=(Buffer&& other) noexcept;
+
+    char* data() const { return buf; }
+    size_t size() const { return pool->bufsize; }
+    bool held() const { return buf != nullptr; }
+
+   private:
+    friend class BufferPool;
+    Buffer(BufferPool* pool, char* buf) : pool(pool), buf(buf) {}
+
+    BufferPool* pool;
+    char* buf;
+  };
+
+  struct Usage {
+    size_t in_use;      // buffers borrowed right now
+    size_t high_water;  // most ever borrowed at once
+    size_t slabs;
+    size_t bytes;       // everything the slabs hold
+  };
+
+  explicit BufferPool(size_t size);
+  BufferPool(const BufferPool&) = delete;
+
+  BufferPool& operator=(const BufferPool&) = delete;
+
+  Buffer borrow();
+  Usage usage();
+  size_t size() const { return bufsize; }
+
+ private:
+  void give_back(char* buf);
+
+  std::mutex lock;
+  struct FreeSlab {
+    void operator()(char* slab) const;
+  };
+
+  std::vector<std::unique_ptr<char, FreeSlab>> slabs;
+  std::vector<char*> spare;
+  size_t bufsize;
+  size_t in_use;
+  size_t high_water;
+};
+
+/* the process-wide pools: SOCKBUF-sized ones for recv(), BLOCKSIZE-sized
+ * ones for copying to and from files, and COALESCE_CHUNK-sized ones for
+ * WriteBehind */
+BufferPool& socket_buffers();
+BufferPool& block_buffers();
+BufferPool& write_buffers();
+
+#endif // SLAB_HPP
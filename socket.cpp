@@ -1,5 +1,8 @@
 #include "socket.hpp"
+#include "slab.hpp"
+#include "trace.hpp"
 
+#include <fcntl.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <sys/socket.h>
@@ -24,7 +27,7 @@ static void set_socket_sndtimeout(int sockfd) {
 }
 
 static void set_socket_rcvtimeout(int sockfd) {
-  // affects accept() and recv()
+  // affects recv()
   struct timeval val;
   val.tv_sec = TIMEOUT;
   val.tv_usec = 0;
@@ -44,7 +47,16 @@ static void set_socket_reuseaddr(int sockfd) {
   }
 }
 
-ListeningSocket::ListeningSocket(const std::string& port) {
+static void set_socket_reuseport(int sockfd) {
+  int val = 1;
+
+  if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val)) == -1) {
+    throw std::runtime_error{"setsockopt(SO_REUSEPORT): " +
+                             std::string{strerror(errno)}};
+  }
+}
+
+ListeningSocket::ListeningSocket(const std::string& port, bool reuseport) {
   struct addrinfo hints = {0};
   struct addrinfo *res, *res_i;
 
@@ -78,6 +90,9 @@ ListeningSocket::ListeningSocket(const std::string& port) {
 
     try {
       set_socket_reuseaddr(sockfd);
+      if (reuseport) {
+        set_socket_reuseport(sockfd);
+      }
     } catch (std::runtime_error& e) {
       cause = e.what();
       close(sockfd);
@@ -115,22 +130,54 @@ ListeningSocket::~ListeningSocket() {
 }
 
 ConnectedSocket ListeningSocket::accept() {
+  TRACE_SCOPE("accept", "fd", -1);
   int connfd;
 
-  connfd = ::accept(sockfd, nullptr, nullptr);
+  do {
+    connfd = ::accept4(sockfd, nullptr, nullptr, SOCK_CLOEXEC);
+  } while (connfd == -1 && (errno == EINTR || errno == ECONNABORTED));
+
   if (connfd == -1) {
+    if (errno == EAGAIN) {
+      return ConnectedSocket{-1};
+    }
     throw std::runtime_error{"accept(): " + std::string{strerror(errno)}};
   }
-  set_socket_rcvtimeout(connfd);  // TODO: server class should set timeout
+  TRACE_ARG(connfd);
   return ConnectedSocket{connfd};
 }
 
+void ListeningSocket::set_nonblocking() {
+  int flags = fcntl(sockfd, F_GETFL);
+  if (flags == -1 || fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) == -1) {
+    throw std::runtime_error{"fcntl(O_NONBLOCK): " +
+                             std::string{strerror(errno)}};
+  }
+}
 
-ConnectedSocket::ConnectedSocket(const std::string& host,
-                                 const std::string& port) {
+ConnectedSocket ListeningSocket::try_accept() {
+  TRACE_SCOPE("accept", "fd", -1);
+  int connfd;
+
+  /* the event loop tracks timeouts itself, so no SO_RCVTIMEO here */
+  do {
+    connfd = ::accept4(sockfd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  } while (connfd == -1 && (errno == EINTR || errno == ECONNABORTED));
+
+  if (connfd == -1) {
+    if (errno == EAGAIN) {
+      return ConnectedSocket{-1};
+    }
+    throw std::runtime_error{"accept4(): " + std::string{strerror(errno)}};
+  }
+  TRACE_ARG(connfd);
+  return ConnectedSocket{connfd};
+}
+
+
+Address::Address(const std::string& host, const std::string& port) {
   struct addrinfo hints = {0};
   struct addrinfo *res, *res_i;
-  std::string cause;
   int err;
 
   hints.ai_family = AF_INET;        // IPV4
@@ -143,7 +190,26 @@ ConnectedSocket::ConnectedSocket(const std::string& host,
   }
 
   for (res_i = res; res_i != nullptr; res_i = res_i->ai_next) {
-    sockfd = socket(res_i->ai_family, res_i->ai_socktype, res_i->ai_protocol);
+    Endpoint e;
+    e.family = res_i->ai_family;
+    e.socktype = res_i->ai_socktype;
+    e.protocol = res_i->ai_protocol;
+    memcpy(&e.addr, res_i->ai_addr, res_i->ai_addrlen);
+    e.len = res_i->ai_addrlen;
+    endpoints.push_back(e);
+  }
+  freeaddrinfo(res);
+}
+
+ConnectedSocket::ConnectedSocket(const std::string& host,
+                                 const std::string& port)
+    : ConnectedSocket(Address{host, port}) {}
+
+ConnectedSocket::ConnectedSocket(const Address& addr) : sockfd(-1) {
+  std::string cause = "connect(): no address to connect to";
+
+  for (const Address::Endpoint& ep : addr.endpoints) {
+    sockfd = socket(ep.family, ep.socktype, ep.protocol);
     if (sockfd == -1) {
       cause = "socket(): " + std::string{strerror(errno)};
       continue;
@@ -158,7 +224,8 @@ ConnectedSocket::ConnectedSocket(const std::string& host,
       continue;
     }
 
-    if (connect(sockfd, res_i->ai_addr, res->ai_addrlen) == -1) {
+    if (connect(sockfd, reinterpret_cast<const struct sockaddr*>(&ep.addr),
+                ep.len) == -1) {
       switch (errno) {
         case EINPROGRESS:
           cause = "connect(): connection timed out";
@@ -172,13 +239,10 @@ ConnectedSocket::ConnectedSocket(const std::string& host,
       continue;
     }
 
-    break;
+    return;
   }
 
-  freeaddrinfo(res);
-  if (res_i == nullptr) {
-    throw std::runtime_error{cause};
-  }
+  throw std::runtime_error{cause};
 }
 
 ConnectedSocket::ConnectedSocket(int fd) : sockfd(fd) {}
@@ -200,32 +264,188 @@ ConnectedSocket& ConnectedSocket::operator=(ConnectedSocket&& other) {
   return *this;
 }
 
-std::string ConnectedSocket::recv() {
-  ssize_t nbytes;
-
-  nbytes = ::recv(sockfd, buf, SOCKBUF, 0);
+/* what recv() and friends throw for a read that brought nothing */
+static void recv_failed(ssize_t nbytes, const char* call) {
   if (nbytes == -1) {
     switch (errno) {
       case EAGAIN:
         throw socket_timeout_error();
       default:
-        throw std::runtime_error{"recv(): " + std::string{strerror(errno)}};
+        throw std::runtime_error{std::string{call} + "(): " +
+                                 std::string{strerror(errno)}};
     }
   }
+  throw socket_closed_exception();
+}
+
+void ConnectedSocket::await() {
+  TRACE_SCOPE("await", "fd", sockfd);
+  /* the peek honours SO_RCVTIMEO like a plain recv() */
+  char probe;
+  ssize_t nbytes;
+  do {
+    nbytes = ::recv(sockfd, &probe, 1, MSG_PEEK);
+  } while (nbytes == -1 && errno == EINTR);
+
+  if (nbytes <= 0) {
+    recv_failed(nbytes, "recv");
+  }
+}
+
+std::string ConnectedSocket::recv() {
+  /* wait for data without a buffer, so a worker blocked on an idle client
+   * doesn't hold one */
+  await();
+
+  TRACE_SCOPE("recv", "bytes", 0);
+  /* held only until the data is in the string */
+  BufferPool::Buffer buf = socket_buffers().borrow();
+  ssize_t nbytes = ::recv(sockfd, buf.data(), buf.size(), MSG_DONTWAIT);
+  if (nbytes <= 0) {
+    recv_failed(nbytes, "recv");
+  }
+  TRACE_ARG(nbytes);
+  return std::string{buf.data(), static_cast<size_t>(nbytes)};
+}
+
+size_t ConnectedSocket::recvv(struct iovec* iov, int iovcnt) {
+  TRACE_SCOPE("recv", "bytes", 0);
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = iovcnt;
+
+  ssize_t nbytes;
+  do {
+    nbytes = ::recvmsg(sockfd, &msg, 0);
+  } while (nbytes == -1 && errno == EINTR);
+
+  if (nbytes <= 0) {
+    recv_failed(nbytes, "recvmsg");
+  }
+  TRACE_ARG(nbytes);
+  return nbytes;
+}
+
+void ConnectedSocket::set_recv_timeout() {
+  set_socket_rcvtimeout(sockfd);
+}
+
+void ConnectedSocket::finish() {
+  if (::shutdown(sockfd, SHUT_WR) == -1) {
+    throw std::runtime_error{"shutdown(): " + std::string{strerror(errno)}};
+  }
+  set_recv_timeout();
+  try {
+    for (;;) {
+      recv();
+    }
+  } catch (socket_closed_exception& e) {
+  }
+}
+
+std::string ConnectedSocket::peer() const {
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
+  if (getpeername(sockfd, reinterpret_cast<struct sockaddr*>(&addr), &len) ==
+      -1) {
+    throw std::runtime_error{"getpeername(): " +
+                             std::string{strerror(errno)}};
+  }
+
+  char host[NI_MAXHOST];
+  int err = getnameinfo(reinterpret_cast<struct sockaddr*>(&addr), len, host,
+                        sizeof(host), nullptr, 0, NI_NUMERICHOST);
+  if (err != 0) {
+    throw std::runtime_error{"getnameinfo(): " +
+                             std::string{gai_strerror(err)}};
+  }
+  return host;
+}
+
+void ConnectedSocket::abort() {
+  struct linger val;
+  val.l_onoff = 1;
+  val.l_linger = 0;
+
+  setsockopt(sockfd, SOL_SOCKET, SO_LINGER, &val, sizeof(val));
+  close(sockfd);
+  sockfd = -1;
+}
+
+ssize_t ConnectedSocket::try_recv(char* dst, size_t len) {
+  TRACE_SCOPE("recv", "bytes", -1);
+  ssize_t nbytes;
+
+  do {
+    nbytes = ::recv(sockfd, dst, len, 0);
+  } while (nbytes == -1 && errno == EINTR);
+
+  if (nbytes == -1) {
+    if (errno == EAGAIN) {
+      return -1;
+    }
+    throw std::runtime_error{"recv(): " + std::string{strerror(errno)}};
+  }
   else if (nbytes == 0) {
     throw socket_closed_exception();
   }
-  return std::string{buf, static_cast<size_t>(nbytes)};
+  TRACE_ARG(nbytes);
+  return nbytes;
+}
+
+ssize_t ConnectedSocket::peek(char* dst, size_t len, bool all) {
+  ssize_t nbytes;
+
+  do {
+    nbytes = ::recv(sockfd, dst, len, MSG_PEEK | (all ? MSG_WAITALL : 0));
+  } while (nbytes == -1 && errno == EINTR);
+
+  if (nbytes == -1) {
+    if (errno == EAGAIN) {
+      return -1;
+    }
+    throw std::runtime_error{"recv(): " + std::string{strerror(errno)}};
+  }
+  return nbytes;
+}
+
+void ConnectedSocket::set_nonblocking() {
+  int flags = fcntl(sockfd, F_GETFL);
+  if (flags == -1 || fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) == -1) {
+    throw std::runtime_error{"fcntl(O_NONBLOCK): " +
+                             std::string{strerror(errno)}};
+  }
+}
+
+ssize_t ConnectedSocket::try_send(const char* src, size_t len) {
+  ssize_t nbytes;
+
+  do {
+    nbytes = ::send(sockfd, src, len, 0);
+  } while (nbytes == -1 && errno == EINTR);
+
+  if (nbytes == -1) {
+    if (errno == EAGAIN) {
+      return -1;
+    }
+    throw std::runtime_error{"send(): " + std::string{strerror(errno)}};
+  }
+  return nbytes;
 }
 
 void ConnectedSocket::send_all(const std::string& data) {
-  const char *buf = data.c_str();
-  size_t nbytes = data.size();
+  send_all(data.c_str(), data.size());
+}
+
+size_t ConnectedSocket::send_all(const char* data, size_t nbytes) {
   size_t total = 0;
+  size_t calls = 0;
   ssize_t n;
 
   do {
-    if ((n = ::send(sockfd, buf + total, nbytes - total, 0)) == -1) {
+    calls++;
+    if ((n = ::send(sockfd, data + total, nbytes - total, 0)) == -1) {
       switch (errno) {
         case EAGAIN:
           throw std::runtime_error{"send(): connection timed out"};
@@ -237,4 +457,6 @@ void ConnectedSocket::send_all(const std::string& data) {
     }
     total += n;
   } while (total < nbytes);
+
+  return calls;
 }
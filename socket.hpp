@@ -1,10 +1,15 @@
 #ifndef SOCKET_HPP
 #define SOCKET_HPP
 
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
 #include <string>
 #include <stdexcept>
+#include <vector>
 
-#define BACKLOG 10
+#define BACKLOG 512  // per listening socket; a connection storm overflows a short one
 #define SOCKBUF 87380  // chosen using cat /proc/sys/net/ipv4/tcp_rmem
 #define REUSEADDR 1
 #define TIMEOUT 10
@@ -18,17 +23,51 @@ class socket_timeout_error : public std::runtime_error {
 class ConnectedSocket;
 class ListeningSocket {
  public:
-  ListeningSocket(const std::string& port);
+  /* with reuseport, any number of these can listen on the same port and the
+   * kernel spreads incoming connections across them */
+  ListeningSocket(const std::string& port, bool reuseport = false);
+  /* takes ownership of a socket that's already listening, handed over by
+   * another process (see upgrade.hpp) */
+  explicit ListeningSocket(int fd) : sockfd(fd) {}
   ListeningSocket(const ListeningSocket&) = delete;
   ~ListeningSocket();
   // TODO: declare move constructor & move assignment for ListeningSocket?
   ListeningSocket& operator=(const ListeningSocket&) = delete;
+  /* a blocking socket, for a worker thread; blocks unless set_nonblocking()
+   * was called, in which case it returns an invalid socket (see
+   * ConnectedSocket::valid) when there are no more pending connections */
   ConnectedSocket accept();
 
+  /* nonblocking interface used by the event loop: after set_nonblocking(),
+   * try_accept() returns an invalid socket when there are no more pending
+   * connections */
+  void set_nonblocking();
+  ConnectedSocket try_accept();
+  int fd() const { return sockfd; }
+
  private:
   int sockfd;
 };
 
+/* A server's address, looked up once (getaddrinfo() may well go out to DNS)
+ * for any number of connections to it */
+class Address {
+ public:
+  Address(const std::string& host, const std::string& port);
+
+ private:
+  friend class ConnectedSocket;
+
+  struct Endpoint {
+    int family;
+    int socktype;
+    int protocol;
+    struct sockaddr_storage addr;
+    socklen_t len;
+  };
+  std::vector<Endpoint> endpoints;  // in the order to try them
+};
+
 class FileDescriptor;
 class ConnectedSocket {
  friend ListeningSocket;
@@ -36,6 +75,7 @@ class ConnectedSocket {
 
  public:
   ConnectedSocket(const std::string& host, const std::string& port);
+  explicit ConnectedSocket(const Address& addr);
   ConnectedSocket(const ListeningSocket&) = delete;
   ConnectedSocket(ConnectedSocket&&);
   ~ConnectedSocket();
@@ -43,13 +83,59 @@ class ConnectedSocket {
   ConnectedSocket& operator=(const ConnectedSocket&) = delete;
   ConnectedSocket& operator=(ConnectedSocket&&);
 
+  /* takes ownership of a descriptor that was connected elsewhere (accepted
+   * through io_uring, say) */
+  static ConnectedSocket adopt(int fd) { return ConnectedSocket{fd}; }
+
   std::string recv();
   void send_all(const std::string& data);
 
+  /* The allocation-free way in: await() blocks until there's something to
+   * read (throwing like recv() on EOF, error or SO_RCVTIMEO), without
+   * needing a buffer to do it; recvv() then reads into the caller's buffers,
+   * filling them in order, and returns how many bytes came in. */
+  void await();
+  size_t recvv(struct iovec* iov, int iovcnt);
+
+  /* returns how many send() calls it took */
+  size_t send_all(const char* data, size_t nbytes);
+
+  /* makes a blocking recv() give up with socket_timeout_error after TIMEOUT
+   * seconds without data */
+  void set_recv_timeout();
+
+  /* ends the sending side and waits (up to TIMEOUT seconds) for the peer
+   * to close its own, i.e. to have read everything sent; anything it sends
+   * meanwhile is discarded */
+  void finish();
+
+  /* the numeric address of the other end, without its port */
+  std::string peer() const;
+
+  /* closes the connection with a reset rather than an orderly shutdown, so
+   * the peer's next send() fails instead of appearing to succeed */
+  void abort();
+
+  /* reads whatever is available on a nonblocking socket into dst; returns the
+   * number of bytes read or -1 if the read would block */
+  ssize_t try_recv(char* dst, size_t len);
+
+  /* copies up to len bytes into dst without taking them off the socket, or
+   * with all, waits until there are len of them (or EOF). Returns 0 on EOF
+   * and -1 if nothing is available on a nonblocking socket or SO_RCVTIMEO
+   * ran out */
+  ssize_t peek(char* dst, size_t len, bool all);
+
+  /* the other direction: sends as much of src as fits, or returns -1 */
+  void set_nonblocking();
+  ssize_t try_send(const char* src, size_t len);
+
+  bool valid() const { return sockfd != -1; }
+  int fd() const { return sockfd; }
+
  private:
   ConnectedSocket(int fd);
   int sockfd;
-  char buf[SOCKBUF];
 };
 
 #endif // SOCKET_HPP
@@ -0,0 +1,82 @@
+#include "spool.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+Spool::Spool(const FileDescriptor& dir, const std::string& name)
+    : dir(dir), name(name), hidden(false), settled(false) {
+  fd = FileDescriptor::openat_tmpfile(dir);
+  if (!fd.valid()) {
+    hidden = true;
+    fd = FileDescriptor::openat_ctw(dir, hidden_name(name));
+  }
+}
+
+Spool::~Spool() {
+  if (!settled && hidden) {
+    unlinkat(dir.raw(), hidden_name(name).c_str(), 0);
+  }
+  /* an O_TMPFILE goes away with its last descriptor */
+}
+
+void Spool::publish() {
+  if (hidden) {
+    publish_hidden(dir, name);
+    settled = true;
+    return;
+  }
+
+  /* linking an open descriptor back into the tree takes a path through
+   * /proc; AT_EMPTY_PATH would need CAP_DAC_READ_SEARCH */
+  std::string path = "/proc/self/fd/" + std::to_string(fd.raw());
+  int err = linkat(AT_FDCWD, path.c_str(), dir.raw(), name.c_str(),
+                   AT_SYMLINK_FOLLOW);
+  if (err == -1 && errno == EEXIST) {
+    /* left over from an earlier run into the same directory */
+    unlinkat(dir.raw(), name.c_str(), 0);
+    err = linkat(AT_FDCWD, path.c_str(), dir.raw(), name.c_str(),
+                 AT_SYMLINK_FOLLOW);
+  }
+  if (err == -1) {
+    throw std::runtime_error{"linkat(): " + std::string{strerror(errno)}};
+  }
+  settled = true;
+}
+
+void Spool::fail(const std::string& message) {
+  if (hidden) {
+    fail_hidden(dir, name, message);
+  } else {
+    fd = FileDescriptor{};  // drops the data without it ever being named
+    write_message(dir, name, message);
+  }
+  settled = true;
+}
+
+std::string Spool::hidden_name(const std::string& name) {
+  return "." + name + ".part";
+}
+
+void Spool::publish_hidden(const FileDescriptor& dir,
+                           const std::string& name) {
+  if (renameat(dir.raw(), hidden_name(name).c_str(), dir.raw(),
+               name.c_str()) == -1) {
+    throw std::runtime_error{"renameat(): " + std::string{strerror(errno)}};
+  }
+}
+
+void Spool::fail_hidden(const FileDescriptor& dir, const std::string& name,
+                        const std::string& message) {
+  unlinkat(dir.raw(), hidden_name(name).c_str(), 0);
+  write_message(dir, name, message);
+}
+
+void Spool::write_message(const FileDescriptor& dir, const std::string& name,
+                          const std::string& message) {
+  FileDescriptor file = FileDescriptor::openat_ctw(dir, name);
+  file.write_all(message);
+}
@@ -0,0 +1,48 @@
+#ifndef SPOOL_HPP
+#define SPOOL_HPP
+
+#include "file.hpp"
+
+#include <string>
+
+/* Where an upload lives until it's over.
+ *
+ * The data goes into an anonymous O_TMPFILE in the target directory (or,
+ * where the file system can't do that, a hidden ".<name>.part") and only
+ * appears under its real name once publish() links it in, so nobody ever
+ * sees half an upload. If the upload fails, fail() puts a short message
+ * there instead and the data is simply dropped; a spool destroyed before
+ * either leaves nothing behind. */
+class Spool {
+ public:
+  Spool(const FileDescriptor& dir, const std::string& name);
+  Spool(const Spool&) = delete;
+  ~Spool();
+
+  Spool& operator=(const Spool&) = delete;
+
+  FileDescriptor& file() { return fd; }
+
+  void publish();
+  void fail(const std::string& message);
+
+  /* The same thing for a spool that was opened somewhere else (by io_uring,
+   * which has no descriptor number to link from) under hidden_name(name) */
+  static std::string hidden_name(const std::string& name);
+  static void publish_hidden(const FileDescriptor& dir,
+                             const std::string& name);
+  static void fail_hidden(const FileDescriptor& dir, const std::string& name,
+                          const std::string& message);
+
+ private:
+  static void write_message(const FileDescriptor& dir, const std::string& name,
+                            const std::string& message);
+
+  const FileDescriptor& dir;
+  std::string name;
+  FileDescriptor fd;
+  bool hidden;   // spooling to hidden_name(name) rather than an O_TMPFILE
+  bool settled;  // published or failed
+};
+
+#endif // SPOOL_HPP
@@ -0,0 +1,182 @@
+/* Checks that the steady-state upload path allocates nothing: the client's
+ * copy loop (FileDescriptor::send_copy) on one end of a socketpair, and on
+ * the other receive_upload(), the loop the threaded engine's recv_file()
+ * runs for a plain upload, RingBuffer through recvv() into an UploadFile,
+ * with the metrics and throttle charges it makes on the way.
+ *
+ * Every operator new is counted per thread. The file goes over twice, each
+ * time over a socketpair of its own: the first pass warms up (the pools fill
+ * their slabs, WriteBehind sizes its segment list, thread_metrics()
+ * registers), and the second, into the same UploadFile, has to get through
+ * without a single allocation.
+ *
+ * Build and run with: make check */
+#include "../file.hpp"
+#include "../receive.hpp"
+#include "../ring.hpp"
+#include "../socket.hpp"
+#include "../throttle.hpp"
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#define TEST_FILE_SIZE (32 << 20)
+
+static thread_local size_t allocations = 0;
+
+void* operator new(size_t size) {
+  allocations++;
+  void* p = malloc(size == 0 ? 1 : size);
+  if (p == nullptr) {
+    throw std::bad_alloc{};
+  }
+  return p;
+}
+
+void* operator new[](size_t size) {
+  return operator new(size);
+}
+
+void operator delete(void* p) noexcept {
+  free(p);
+}
+
+void operator delete[](void* p) noexcept {
+  free(p);
+}
+
+/* a file of TEST_FILE_SIZE bytes to send; it goes away when closed */
+static FileDescriptor test_file() {
+  std::string path = "/tmp/accio-alloc-in";
+  {
+    FileDescriptor file = FileDescriptor::create_w(path);
+    std::string block(1 << 20, 'a');
+    for (int i = 0; i < TEST_FILE_SIZE >> 20; i++) {
+      block[0] = static_cast<char>(i);
+      file.write_all(block);
+    }
+  }
+  FileDescriptor file = FileDescriptor::open_r(path);
+  unlink(path.c_str());
+  return file;
+}
+
+/* a connected pair of sockets: one end to send on, one to receive */
+struct Pair {
+  Pair() : Pair(connected()) {}
+
+  ConnectedSocket sender;
+  ConnectedSocket receiver;
+
+ private:
+  struct Fds {
+    int fds[2];
+  };
+
+  explicit Pair(Fds f)
+      : sender(ConnectedSocket::adopt(f.fds[0])),
+        receiver(ConnectedSocket::adopt(f.fds[1])) {}
+
+  static Fds connected() {
+    Fds f;
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, f.fds) == -1) {
+      throw std::runtime_error{"socketpair() failed"};
+    }
+    return f;
+  }
+};
+
+/* sends the file once over each pair, closing it after; returns what the
+ * second pass allocated */
+static size_t send_twice(Pair pairs[2], FileDescriptor& in) {
+  TransferStats stats;
+  size_t counted = 0;
+  for (int pass = 0; pass < 2; pass++) {
+    if (lseek(in.raw(), 0, SEEK_SET) == -1) {
+      throw std::runtime_error{"lseek() failed"};
+    }
+    size_t before = allocations;
+    in.send_copy(pairs[pass].sender, stats);
+    counted = allocations - before;
+    shutdown(pairs[pass].sender.fd(), SHUT_WR);  // EOF for the receiver
+  }
+  return counted;
+}
+
+/* receive_upload() over each pair in turn, into one file; returns what the
+ * second pass allocated */
+static size_t receive_twice(Pair pairs[2]) {
+  Throttle throttle{Limits{}};
+  Throttle::Quota quota;
+  throttle.join(quota, "local");
+  std::atomic<bool> running{true};
+  Layout::Dir dir =
+      std::make_shared<FileDescriptor>(FileDescriptor::opendir("/tmp"));
+  UploadFile upload{dir, 0, false, nullptr};  // never published
+  RingBuffer ring{socket_buffers()};
+  Digest digest;
+
+  size_t counted = 0;
+  for (int pass = 0; pass < 2; pass++) {
+    size_t before = allocations;
+    try {
+      receive_upload(pairs[pass].receiver, ring, digest, upload, &throttle,
+                     quota, running);
+    } catch (socket_closed_exception& e) {
+    }
+    counted = allocations - before;
+  }
+
+  upload.writer.finish();
+  off_t size = lseek(upload.spool.file().raw(), 0, SEEK_END);
+  if (size != 2 * TEST_FILE_SIZE) {
+    throw std::runtime_error{"received " + std::to_string(size) +
+                             " bytes, expected " +
+                             std::to_string(2 * TEST_FILE_SIZE)};
+  }
+  return counted;
+}
+
+int main() {
+  try {
+    FileDescriptor in = test_file();
+    Pair pairs[2];
+
+    size_t sent = 0;
+    std::thread client{[&] {
+      try {
+        sent = send_twice(pairs, in);
+      } catch (std::runtime_error& e) {
+        std::cerr << "send: " << e.what() << std::endl;
+        sent = SIZE_MAX;
+        shutdown(pairs[0].sender.fd(), SHUT_WR);
+        shutdown(pairs[1].sender.fd(), SHUT_WR);
+      }
+    }};
+    size_t received = receive_twice(pairs);
+    client.join();
+
+    std::cout << "client send loop: " << sent << " allocations" << std::endl;
+    std::cout << "server recv loop: " << received << " allocations"
+              << std::endl;
+    if (sent != 0 || received != 0) {
+      std::cout << "FAIL" << std::endl;
+      return EXIT_FAILURE;
+    }
+    std::cout << "ok" << std::endl;
+  } catch (std::runtime_error& e) {
+    std::cerr << "ERROR: " << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
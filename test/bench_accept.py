@@ -0,0 +1,53 @@
+#!/usr/bin/env python3
+# Connection storm: how many connections per second the server accepts (and
+# turns into empty files) with different numbers of SO_REUSEPORT shards.
+#
+#   ./test/bench_accept.py [CONNECTIONS] [CLIENTS] [SHARDS...]
+import sys, os
+import multiprocessing
+import socket
+import subprocess
+import time
+
+conns = int(sys.argv[1]) if len(sys.argv) > 1 else 20000
+clients = int(sys.argv[2]) if len(sys.argv) > 2 else 8
+shard_counts = [int(n) for n in sys.argv[3:]] or [1, 2, 4]
+
+srv_port = 3002
+srv_host = 'localhost'
+srv_dir = 'bench_save/'
+
+def storm(n):
+  for _ in range(n):
+    s = socket.create_connection((srv_host, srv_port))
+    s.close()
+
+def wait_for_files(n, deadline):
+  while len(os.listdir(srv_dir)) < n and time.time() < deadline:
+    time.sleep(0.01)
+
+print('{:>6} {:>8} {:>10}'.format('shards', 'conns', 'conn/s'))
+for shards in shard_counts:
+  subprocess.run(['rm', '-rf', srv_dir])
+  os.mkdir(srv_dir)
+  server = subprocess.Popen(['./server', '-s', str(shards), '-p',
+                             str(srv_port), srv_dir])
+  time.sleep(1)
+
+  per_client = conns // clients
+  start = time.time()
+  with multiprocessing.Pool(clients) as pool:
+    pool.map(storm, [per_client] * clients)
+  wait_for_files(per_client * clients, time.time() + 30)
+  elapsed = time.time() - start
+
+  done = len(os.listdir(srv_dir))
+  if done != per_client * clients:
+    print('{} shards: only {} of {} connections saved'.format(
+        shards, done, per_client * clients))
+  print('{:>6} {:>8} {:>10.0f}'.format(shards, done, done / elapsed))
+
+  server.terminate()
+  server.wait()
+
+subprocess.run(['rm', '-rf', srv_dir])
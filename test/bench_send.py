@@ -0,0 +1,57 @@
+#!/usr/bin/env python3
+# Compares the client's transmit paths: how many system calls and how much
+# CPU time each one needs to push the same file to a local server.
+#
+#   ./test/bench_send.py [SIZE-IN-MiB] [RUNS]
+import sys, os
+import filecmp
+import subprocess
+import time
+
+size = int(sys.argv[1]) * 1048576 if len(sys.argv) > 1 else 104857600
+runs = int(sys.argv[2]) if len(sys.argv) > 2 else 3
+methods = ['copy', 'pipeline', 'sendfile', 'zerocopy']
+
+srv_port = '3001'
+srv_host = 'localhost'
+srv_dir = 'bench_save/'
+infile = 'bench_infile.bin'
+
+subprocess.run(['rm', '-rf', srv_dir])
+os.mkdir(srv_dir)
+with open(infile, 'wb') as f:
+  f.write(os.urandom(size))
+
+server = subprocess.Popen(['./server', srv_port, srv_dir])
+time.sleep(1)
+
+conn = 0
+print('{:>9} {:>10} {:>10} {:>10} {:>10}'.format(
+    'method', 'syscalls', 'user_ms', 'sys_ms', 'MB/s'))
+for method in methods:
+  totals = {'syscalls': 0.0, 'user_ms': 0.0, 'sys_ms': 0.0}
+  elapsed = 0.0
+  for _ in range(runs):
+    start = time.time()
+    out = subprocess.run(['./client', '-v', '-m', method,
+                          srv_host, srv_port, infile],
+                         stdout=subprocess.PIPE, check=True)
+    elapsed += time.time() - start
+    conn += 1
+    for field in out.stdout.decode().split():
+      key, val = field.split('=')
+      if key in totals:
+        totals[key] += float(val)
+
+    time.sleep(0.1)
+    if not filecmp.cmp(infile, srv_dir + '{}.file'.format(conn),
+                       shallow=False):
+      print('{}: file transfer failed'.format(method))
+
+  print('{:>9} {:>10.0f} {:>10.1f} {:>10.1f} {:>10.1f}'.format(
+      method, totals['syscalls'] / runs, totals['user_ms'] / runs,
+      totals['sys_ms'] / runs, size * runs / elapsed / 1e6))
+
+server.terminate()
+server.wait()
+subprocess.run(['rm', '-rf', srv_dir, infile])
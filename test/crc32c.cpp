@@ -0,0 +1,128 @@
+/* Checks crc32c() through both of its paths: the crc32 instruction on three
+ * lanes at a time, stitched together with the zeros tables (where the CPU
+ * has SSE4.2), and the slicing-by-8 tables, which crc32c_accelerate(false)
+ * forces.
+ *
+ * Each path has to give the known answers, and on messages long enough for
+ * the three-lane loops (3 x 8192 and 3 x 256 bytes, either side of those
+ * and past them) it has to agree with the other and with itself when the
+ * message comes in two pieces.
+ *
+ * Build and run with: make check */
+#include "../checksum.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+static const struct {
+  const char* name;
+  std::string message;
+  uint32_t crc;
+} vectors[] = {
+    {"\"123456789\"", "123456789", 0xe3069283},  // the usual check value
+    /* RFC 3720, appendix B.4 */
+    {"32 zeros", std::string(32, '\0'), 0x8a9136aa},
+    {"32 x ff", std::string(32, '\xff'), 0x62a8ab43},
+    {"00 to 1f",
+     std::string(
+         "\x00\x01\x02\x03\x04\x05\x06\x07\x08\x09\x0a\x0b\x0c\x0d\x0e\x0f"
+         "\x10\x11\x12\x13\x14\x15\x16\x17\x18\x19\x1a\x1b\x1c\x1d\x1e\x1f",
+         32),
+     0x46dd794e},
+    {"1f to 00",
+     std::string(
+         "\x1f\x1e\x1d\x1c\x1b\x1a\x19\x18\x17\x16\x15\x14\x13\x12\x11\x10"
+         "\x0f\x0e\x0d\x0c\x0b\x0a\x09\x08\x07\x06\x05\x04\x03\x02\x01\x00",
+         32),
+     0x113fdb5c},
+};
+
+/* around and past where the long (3 x 8192) and short (3 x 256) lane loops
+ * take over */
+static const size_t lengths[] = {
+    0,         1,         7,     8,     9,     767,   768,    769,
+    24575,     24576,     24577, 25343, 25344, 25351, 49152 + 768 + 13,
+    100003};
+
+static const size_t splits[] = {1, 7, 8, 256, 768, 8192, 24576, 25344};
+
+static int failures = 0;
+
+static std::string hex32(uint32_t value) {
+  char out[9];
+  snprintf(out, sizeof(out), "%08x", value);
+  return out;
+}
+
+static void expect(const std::string& what, uint32_t got, uint32_t want) {
+  if (got != want) {
+    std::cout << what << ": got " << hex32(got) << ", expected "
+              << hex32(want) << std::endl;
+    failures++;
+  }
+}
+
+static void known_answers(const std::string& path) {
+  for (const auto& v : vectors) {
+    expect(path + " " + v.name, crc32c(0, v.message.data(), v.message.size()),
+           v.crc);
+  }
+}
+
+/* the message's CRC in two pieces, carrying the first on into the second */
+static uint32_t split_crc(const std::string& data, size_t len, size_t split) {
+  return crc32c(crc32c(0, data.data(), split), data.data() + split,
+                len - split);
+}
+
+/* every length through every path, one-shot and split, against the
+ * portable one-shot CRC */
+static void agreement(bool sse42) {
+  std::string data;
+  uint32_t x = 1;
+  while (data.size() < lengths[sizeof(lengths) / sizeof(lengths[0]) - 1]) {
+    x = x * 1103515245 + 12345;
+    data.push_back(static_cast<char>(x >> 16));
+  }
+
+  for (size_t len : lengths) {
+    crc32c_accelerate(false);
+    uint32_t want = crc32c(0, data.data(), len);
+    for (int on = 0; on <= (sse42 ? 1 : 0); on++) {
+      crc32c_accelerate(on);
+      std::string what =
+          std::string{on ? "sse4.2 " : "portable "} + std::to_string(len);
+      expect(what + " bytes", crc32c(0, data.data(), len), want);
+      expect(what + " bytes split in half", split_crc(data, len, len / 2),
+             want);
+      for (size_t split : splits) {
+        if (split < len) {
+          expect(what + " bytes split at " + std::to_string(split),
+                 split_crc(data, len, split), want);
+        }
+      }
+    }
+  }
+}
+
+int main() {
+  bool sse42 = crc32c_accelerated();
+  if (sse42) {
+    known_answers("sse4.2");
+  } else {
+    std::cout << "no SSE4.2 here; checking the tables only" << std::endl;
+  }
+  crc32c_accelerate(false);
+  known_answers("portable");
+  agreement(sse42);
+  crc32c_accelerate(true);
+
+  if (failures > 0) {
+    std::cout << "FAIL" << std::endl;
+    return EXIT_FAILURE;
+  }
+  std::cout << "ok" << std::endl;
+  return EXIT_SUCCESS;
+}
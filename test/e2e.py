@@ -0,0 +1,215 @@
+#!/usr/bin/env python3
+# Runs ./server on one engine and puts ./client through it end to end: a
+# multi-stream round trip, stream ranges that overlap or run past the end
+# of their file, a resumable upload carried on after its connection was
+# killed, checked uploads with a good and a corrupted CRC32C, and fetching
+# part of a file back.
+#
+#   ./test/e2e.py epoll|uring|threaded
+#
+# Prints "ok", or what went wrong and "FAIL" (and exits nonzero). Build and
+# run with: make check
+import sys, os
+import glob
+import shutil
+import socket
+import struct
+import subprocess
+import tempfile
+import time
+
+engine = sys.argv[1] if len(sys.argv) > 1 else 'epoll'
+
+srv_port = '3002'
+srv_host = '127.0.0.1'
+
+FRAME_MAGIC = b'\x7fACCIOMS'
+RESUME_MAGIC = b'\x7fACCIORS'
+CHECK_MAGIC = b'\x7fACCIOCK'
+
+failures = 0
+
+def expect(what, ok):
+  global failures
+  if not ok:
+    print('{}: {}'.format(engine, what))
+    failures += 1
+
+def wait_for(pred, seconds=10):
+  deadline = time.time() + seconds
+  while time.time() < deadline:
+    if pred():
+      return True
+    time.sleep(0.05)
+  return pred()
+
+def read(path):
+  with open(path, 'rb') as f:
+    return f.read()
+
+def create_file(name, size):
+  with open(name, 'wb') as f:
+    f.write(os.urandom(size))
+  return read(name)
+
+def client(*args):
+  return subprocess.run(['./client'] + list(args), stdout=subprocess.PIPE,
+                        stderr=subprocess.PIPE, timeout=60)
+
+def header(magic, upload, offset, length, total):
+  return magic + struct.pack('>QQQQ', upload, offset, length, total)
+
+def connect():
+  return socket.create_connection((srv_host, int(srv_port)))
+
+# the stored file whose contents are data, or None
+def stored(data):
+  for path in glob.glob(os.path.join(srv_dir, '*.file')):
+    if os.path.getsize(path) == len(data) and read(path) == data:
+      return path
+  return None
+
+# an empty upload of its own if so, which nothing below looks for
+def listening():
+  try:
+    connect().close()
+    return True
+  except OSError:
+    return False
+
+def log():
+  return read(srv_log).decode(errors='replace')
+
+# whether the server closes (or resets) a stream it was sent
+def refused(sock):
+  sock.settimeout(5)
+  try:
+    return sock.recv(1) == b''
+  except ConnectionResetError:
+    return True
+  except socket.timeout:
+    return False
+  finally:
+    sock.close()
+
+def crc32c(data):
+  crc = 0xffffffff
+  for b in data:
+    crc ^= b
+    for _ in range(8):
+      crc = (crc >> 1) ^ (0x82f63b78 if crc & 1 else 0)
+  return crc ^ 0xffffffff
+
+work = tempfile.mkdtemp(prefix='e2e.')
+srv_dir = os.path.join(work, 'save')
+srv_log = os.path.join(work, 'server.err')
+os.mkdir(srv_dir)
+
+with open(srv_log, 'wb') as err:
+  server = subprocess.Popen(['./server', '-e', engine, srv_port, srv_dir],
+                            stderr=err)
+wait_for(listening)
+
+try:
+  # -n 4: four ranges over four connections, put back together
+  multi = os.path.join(work, 'multi')
+  data = create_file(multi, 3 * 1048576 + 7)
+  r = client('-n', '4', srv_host, srv_port, multi)
+  expect('client -n 4 exited {}: {}'.format(r.returncode, r.stderr),
+         r.returncode == 0)
+  expect('client -n 4: no stored file matches',
+         wait_for(lambda: stored(data) is not None))
+  path = stored(data)
+
+  # -g with -o and -l: a range of it, and the rest of it, back again
+  if path is not None:
+    conn_id = os.path.basename(path).split('.')[0]
+    part = os.path.join(work, 'part')
+    r = client('-g', conn_id, '-o', '1000', '-l', '70000', srv_host,
+               srv_port, part)
+    expect('client -g -o -l exited {}: {}'.format(r.returncode, r.stderr),
+           r.returncode == 0)
+    expect('client -g -o -l: wrong bytes',
+           os.path.exists(part) and read(part) == data[1000:71000])
+    r = client('-g', conn_id, '-o', str(len(data) - 5), srv_host,
+               srv_port, part)
+    expect('client -g -o exited {}: {}'.format(r.returncode, r.stderr),
+           r.returncode == 0)
+    expect('client -g -o: wrong bytes',
+           os.path.exists(part) and read(part) == data[-5:])
+
+  # a range that takes in another stream's, and one past the end of the file
+  held = connect()
+  held.sendall(header(FRAME_MAGIC, 1001, 0, 60, 100) + b'a' * 10)
+  time.sleep(0.2)
+  overlap = connect()
+  overlap.sendall(header(FRAME_MAGIC, 1001, 50, 30, 100))
+  expect('overlapping range: not refused', refused(overlap))
+  held.close()
+  expect('overlapping range: not reported',
+         wait_for(lambda: "overlaps another stream's" in log()))
+  past = connect()
+  past.sendall(header(FRAME_MAGIC, 1002, 90, 20, 100))
+  expect('over-long range: not refused', refused(past))
+  expect('over-long range: not reported',
+         wait_for(lambda: 'runs past the end' in log()))
+
+  # -r: half of it on a connection that's then reset, the rest by the client
+  resumed = os.path.join(work, 'resumed')
+  data = create_file(resumed, 1048576)
+  killed = connect()
+  killed.sendall(header(RESUME_MAGIC, 1003, 0, len(data), len(data)))
+  killed.settimeout(5)
+  expect('resumable upload: no offset',
+         struct.unpack('>Q', killed.recv(8))[0] == 0)
+  killed.sendall(data[:len(data) // 2])
+  time.sleep(0.3)
+  killed.setsockopt(socket.SOL_SOCKET, socket.SO_LINGER,
+                    struct.pack('ii', 1, 0))
+  killed.close()
+  time.sleep(0.3)
+  r = client('-r', '-u', '1003', '-v', srv_host, srv_port, resumed)
+  expect('client -r exited {}: {}'.format(r.returncode, r.stderr),
+         r.returncode == 0)
+  sent = [int(f[len('bytes='):]) for f in r.stdout.decode().split()
+          if f.startswith('bytes=')]
+  expect('client -r: sent {} bytes, not the rest'.format(sent),
+         len(sent) == 1 and 0 < sent[0] < len(data))
+  expect('client -r: no stored file matches',
+         wait_for(lambda: stored(data) is not None))
+
+  # -c: a checked upload, then one whose CRC32C was corrupted on the way
+  checked = os.path.join(work, 'checked')
+  data = create_file(checked, 70001)
+  r = client('-c', srv_host, srv_port, checked)
+  expect('client -c exited {}: {}'.format(r.returncode, r.stderr),
+         r.returncode == 0)
+  expect('client -c: no stored file matches',
+         wait_for(lambda: stored(data) is not None))
+  path = stored(data)
+  expect('client -c: sidecar not ok',
+         path is not None and
+         wait_for(lambda: os.path.exists(path + '.crc32c')) and
+         read(path + '.crc32c').split()[-1] == b'ok')
+
+  data = data[:4096]
+  corrupt = connect()
+  corrupt.sendall(header(CHECK_MAGIC, 0, 0, len(data), len(data)) + data +
+                  struct.pack('>I', crc32c(data) ^ 1))
+  corrupt.close()
+  expect('corrupted CRC32C: no stored file matches',
+         wait_for(lambda: stored(data) is not None))
+  path = stored(data)
+  expect('corrupted CRC32C: sidecar has no mismatch',
+         path is not None and
+         wait_for(lambda: os.path.exists(path + '.crc32c')) and
+         b'mismatch' in read(path + '.crc32c'))
+finally:
+  server.terminate()
+  server.wait()
+  shutil.rmtree(work)
+
+if failures > 0:
+  print('FAIL')
+  sys.exit(1)
+print('ok')
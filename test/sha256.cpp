@@ -0,0 +1,116 @@
+/* Checks Sha256 against the FIPS 180-2 test vectors, through both ways it
+ * can compress a block: the SHA-NI rounds (where the CPU has them) and the
+ * portable ones, which Sha256::accelerate(false) forces.
+ *
+ * Around the block boundaries, where finish() pads into one block or two
+ * (55, 56, 63, 64 and 65 bytes, and the same a block on), every message is
+ * also hashed in two pieces split at each point, and with each path, and
+ * all of them have to agree.
+ *
+ * Build and run with: make check */
+#include "../sha256.hpp"
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+/* the FIPS 180-2 examples, plus the two-block message from its appendix */
+static const struct {
+  const char* message;
+  const char* digest;
+} vectors[] = {
+    {"", "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"},
+    {"abc",
+     "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"},
+    {"abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+     "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1"},
+    {"abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmnhijklmnoijklmno"
+     "pjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu",
+     "cf5b16a778af8380036ce59e7b0492370b249b11e8f07a51afac45037afee9d1"},
+};
+
+#define MILLION_A \
+  "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0"
+
+#define LONGEST 200  // bytes of the messages split at every point
+
+static int failures = 0;
+
+static void expect(const std::string& what, const std::string& got,
+                   const std::string& want) {
+  if (got != want) {
+    std::cout << what << ": got " << got << ", expected " << want
+              << std::endl;
+    failures++;
+  }
+}
+
+/* data hashed in two updates, the first of split bytes */
+static std::string split_hex(const std::string& data, size_t split) {
+  Sha256 sha;
+  unsigned char digest[SHA256_BYTES];
+  sha.update(data.data(), split);
+  sha.update(data.data() + split, data.size() - split);
+  sha.finish(digest);
+  return Sha256::hex(digest);
+}
+
+/* the vectors, and a million 'a's in pieces that don't line up with the
+ * blocks */
+static void known_answers(const std::string& path) {
+  for (const auto& v : vectors) {
+    std::string message = v.message;
+    expect(path + " \"" + message + "\"",
+           Sha256::hex(message.data(), message.size()), v.digest);
+  }
+
+  Sha256 sha;
+  unsigned char digest[SHA256_BYTES];
+  std::string piece(1000, 'a');
+  for (int i = 0; i < 1000; i++) {
+    sha.update(piece.data(), piece.size());
+  }
+  sha.finish(digest);
+  expect(path + " a million 'a'", Sha256::hex(digest), MILLION_A);
+}
+
+/* every message up to LONGEST bytes, split at every point and through
+ * every path, against the portable one-shot digest */
+static void boundaries(bool shani) {
+  std::string data;
+  for (size_t len = 0; len <= LONGEST; len++) {
+    Sha256::accelerate(false);
+    std::string want = Sha256::hex(data.data(), data.size());
+    for (int on = 0; on <= (shani ? 1 : 0); on++) {
+      Sha256::accelerate(on);
+      std::string path = on ? "sha-ni" : "portable";
+      for (size_t split = 0; split <= len; split++) {
+        expect(path + " " + std::to_string(len) + " bytes split at " +
+                   std::to_string(split),
+               split_hex(data, split), want);
+      }
+    }
+    data.push_back(static_cast<char>(len * 7 + 1));
+  }
+}
+
+int main() {
+  bool shani = Sha256::accelerated();
+  if (shani) {
+    known_answers("sha-ni");
+  } else {
+    std::cout << "no SHA-NI here; checking the portable rounds only"
+              << std::endl;
+  }
+  Sha256::accelerate(false);
+  known_answers("portable");
+  boundaries(shani);
+  Sha256::accelerate(true);
+
+  if (failures > 0) {
+    std::cout << "FAIL" << std::endl;
+    return EXIT_FAILURE;
+  }
+  std::cout << "ok" << std::endl;
+  return EXIT_SUCCESS;
+}
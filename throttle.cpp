@@ -0,0 +1,128 @@
+#include "throttle.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+static uint64_t now_micros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+/* a rate such as 512K or 10M */
+static uint64_t parse_rate(const std::string& word) {
+  char* end;
+  uint64_t rate = strtoull(word.c_str(), &end, 10);
+  if (end == word.c_str() || word[0] == '-') {
+    throw std::runtime_error{"bad rate " + word};
+  }
+  std::string unit{end};
+  if (unit == "K") {
+    rate <<= 10;
+  } else if (unit == "M") {
+    rate <<= 20;
+  } else if (unit == "G") {
+    rate <<= 30;
+  } else if (!unit.empty()) {
+    throw std::runtime_error{"bad rate " + word};
+  }
+  return rate;
+}
+
+Limits Limits::load(const std::string& path) {
+  std::ifstream in{path};
+  if (!in) {
+    throw std::runtime_error{"can't read limits file " + path};
+  }
+
+  Limits limits;
+  std::string line;
+  for (int n = 1; std::getline(in, line); n++) {
+    std::istringstream words{line.substr(0, line.find('#'))};
+    std::string key, rate, extra;
+    if (!(words >> key)) {
+      continue;  // blank, or only a comment
+    }
+    try {
+      if (!(words >> rate) || words >> extra) {
+        throw std::runtime_error{"expected a limit and a rate"};
+      }
+      if (key == "global") {
+        limits.global = parse_rate(rate);
+      } else if (key == "source") {
+        limits.source = parse_rate(rate);
+      } else if (key == "connection") {
+        limits.connection = parse_rate(rate);
+      } else {
+        throw std::runtime_error{"unknown limit " + key};
+      }
+    } catch (std::runtime_error& e) {
+      throw std::runtime_error{path + ":" + std::to_string(n) + ": " +
+                               e.what()};
+    }
+  }
+  return limits;
+}
+
+uint64_t TokenBucket::take(uint64_t rate, size_t n, uint64_t now) {
+  if (rate == 0) {
+    last = 0;  // full again if a limit is set later
+    return 0;
+  }
+
+  double burst = rate * (THROTTLE_BURST_MS / 1000.0);
+  if (last == 0) {
+    tokens = burst;
+  } else {
+    tokens = std::min(burst, tokens + (now - last) * (rate / 1e6));
+  }
+  last = now;
+
+  tokens -= n;
+  return tokens >= 0 ? 0 : std::ceil(-tokens * 1e6 / rate);
+}
+
+Throttle::Throttle(const Limits& limits) : prune_at(64) { set(limits); }
+
+void Throttle::set(const Limits& limits) {
+  global_rate = limits.global;
+  source_rate = limits.source;
+  connection_rate = limits.connection;
+}
+
+void Throttle::join(Quota& quota, const std::string& source) {
+  std::lock_guard<std::mutex> guard{lock};
+  std::weak_ptr<TokenBucket>& slot = sources[source];
+  quota.source = slot.lock();
+  if (!quota.source) {
+    quota.source = std::make_shared<TokenBucket>();
+    slot = quota.source;
+  }
+
+  if (sources.size() >= prune_at) {
+    for (auto it = sources.begin(); it != sources.end();) {
+      it = it->second.expired() ? sources.erase(it) : std::next(it);
+    }
+    prune_at = std::max<size_t>(64, sources.size() * 2);
+  }
+}
+
+uint64_t Throttle::charge(Quota& quota, size_t n) {
+  uint64_t now = now_micros();
+  uint64_t wait = quota.own.take(connection_rate, n, now);
+
+  uint64_t per_source = source_rate;
+  uint64_t overall = global_rate;
+  if (per_source == 0 && overall == 0) {
+    return wait;
+  }
+
+  std::lock_guard<std::mutex> guard{lock};
+  wait = std::max(wait, quota.source->take(per_source, n, now));
+  return std::max(wait, global.take(overall, n, now));
+}
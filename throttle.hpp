@@ -0,0 +1,87 @@
+#ifndef THROTTLE_HPP
+#define THROTTLE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#define THROTTLE_BURST_MS 100  // how far ahead of its rate a bucket may run
+
+/* bytes a second; 0 for no limit */
+struct Limits {
+  Limits() : global(0), source(0), connection(0) {}
+
+  uint64_t global;      // everything the server receives, every shard
+  uint64_t source;      // ...from one client address
+  uint64_t connection;  // ...over one connection
+
+  /* Reads a limits file: one "global", "source" or "connection" line each,
+   * followed by the rate, which may end in K, M or G (powers of 1024).
+   * Anything after a '#' is a comment; a limit not given is no limit. */
+  static Limits load(const std::string& path);
+};
+
+/* A token bucket that can go into debt: a read is charged after the fact,
+ * since nobody knows how much a recv() will bring before making it, and the
+ * reader is told how long to hold off until the debt is paid back. A full
+ * bucket holds THROTTLE_BURST_MS worth of its rate, so an idle connection
+ * can't save up for a burst that swamps everybody else. */
+class TokenBucket {
+ public:
+  TokenBucket() : tokens(0), last(0) {}
+
+  /* takes n bytes from the bucket, which has refilled at rate since it was
+   * last charged; returns how many microseconds until it's out of debt */
+  uint64_t take(uint64_t rate, size_t n, uint64_t now);
+
+ private:
+  double tokens;
+  uint64_t last;  // microseconds; 0 for a bucket never charged, i.e. full
+};
+
+/* Bandwidth limits for the receive path.
+ *
+ * Every connection is charged for what it reads against three buckets: its
+ * own, one shared by every connection from the same address, and one for
+ * the whole server. Whichever is deepest in debt says how long it has to
+ * wait before reading again. The limits can be changed at any time (see
+ * set()), and take effect at each bucket's next charge. */
+class Throttle {
+ public:
+  /* what a connection is charged against, besides the global bucket */
+  struct Quota {
+    TokenBucket own;  // only ever touched by the connection's own thread
+    std::shared_ptr<TokenBucket> source;
+  };
+
+  explicit Throttle(const Limits& limits);
+  Throttle(const Throttle&) = delete;
+
+  Throttle& operator=(const Throttle&) = delete;
+
+  void set(const Limits& limits);
+
+  /* sets up quota for a new connection from address source */
+  void join(Quota& quota, const std::string& source);
+
+  /* charges quota for n bytes received; returns how many microseconds the
+   * connection should hold off for, 0 if it needn't */
+  uint64_t charge(Quota& quota, size_t n);
+
+ private:
+  std::atomic<uint64_t> global_rate;
+  std::atomic<uint64_t> source_rate;
+  std::atomic<uint64_t> connection_rate;
+
+  std::mutex lock;  // guards the rest
+  TokenBucket global;
+  /* a source's bucket lives as long as one of its connections does */
+  std::unordered_map<std::string, std::weak_ptr<TokenBucket>> sources;
+  size_t prune_at;  // sources drops its dead buckets when it gets this big
+};
+
+#endif // THROTTLE_HPP
@@ -0,0 +1,97 @@
+#include "timer.hpp"
+
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+TimerWheel::TimerWheel() : current(0) {
+  for (Entry& head : slots) {
+    head.prev = head.next = &head;
+  }
+
+  timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (timerfd == -1) {
+    throw std::runtime_error{"timerfd_create(): " +
+                             std::string{strerror(errno)}};
+  }
+
+  struct itimerspec spec;
+  spec.it_interval.tv_sec = TICK_MS / 1000;
+  spec.it_interval.tv_nsec = (TICK_MS % 1000) * 1000000L;
+  spec.it_value = spec.it_interval;
+
+  if (timerfd_settime(timerfd, 0, &spec, nullptr) == -1) {
+    close(timerfd);
+    throw std::runtime_error{"timerfd_settime(): " +
+                             std::string{strerror(errno)}};
+  }
+}
+
+TimerWheel::~TimerWheel() {
+  if (timerfd > 0) {
+    close(timerfd);
+  }
+}
+
+void TimerWheel::link(Entry& e) {
+  Entry& head = slots[e.expires % WHEEL_SLOTS];
+  e.next = &head;
+  e.prev = head.prev;
+  head.prev->next = &e;
+  head.prev = &e;
+}
+
+void TimerWheel::schedule(Entry& e, uint64_t ticks) {
+  cancel(e);
+  touch(e, ticks);
+  link(e);
+}
+
+void TimerWheel::Entry::unlink() {
+  if (next == nullptr) {
+    return;
+  }
+  prev->next = next;
+  next->prev = prev;
+  prev = next = nullptr;
+}
+
+void TimerWheel::advance(std::vector<void*>& expired) {
+  uint64_t ticks;
+
+  if (read(timerfd, &ticks, sizeof(ticks)) != sizeof(ticks)) {
+    if (errno == EAGAIN) {
+      return;
+    }
+    throw std::runtime_error{"read(timerfd): " + std::string{strerror(errno)}};
+  }
+
+  while (ticks-- > 0) {
+    current++;
+    Entry& head = slots[current % WHEEL_SLOTS];
+    if (head.next == &head) {
+      continue;
+    }
+
+    /* detach the whole slot first: entries that get relinked may land right
+     * back in it when their deadline is a full revolution away */
+    Entry* e = head.next;
+    head.prev->next = nullptr;
+    head.prev = head.next = &head;
+
+    while (e != nullptr) {
+      Entry* next = e->next;
+      if (e->expires > current) {
+        link(*e);
+      } else {
+        e->prev = e->next = nullptr;
+        expired.push_back(e->owner);
+      }
+      e = next;
+    }
+  }
+}
@@ -0,0 +1,63 @@
+#ifndef TIMER_HPP
+#define TIMER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#define TICK_MS 100   // timer wheel resolution
+#define WHEEL_SLOTS 128 // > TIMEOUT * 1000 / TICK_MS, so no entry wraps
+
+/* A hashed timing wheel driven by a single timerfd.
+ *
+ * Entries hang off one of WHEEL_SLOTS intrusive lists, chosen by their expiry
+ * tick. Refreshing a deadline with touch() only stores a new expiry tick in
+ * the entry -- no syscall and no relinking. When the wheel reaches a slot it
+ * looks at each entry there: entries that were touched in the meantime are
+ * moved to the slot of their new deadline, the rest have expired. Every entry
+ * is therefore visited about once per timeout period no matter how often it
+ * was refreshed, and a tick only costs as much as the entries hashed to it. */
+class TimerWheel {
+ public:
+  struct Entry {
+    Entry() : prev(nullptr), next(nullptr), expires(0), owner(nullptr) {}
+    Entry(const Entry&) = delete;
+    ~Entry() { unlink(); }  // destroying an owner cancels its timer
+
+    Entry& operator=(const Entry&) = delete;
+    void unlink();
+
+    Entry* prev;
+    Entry* next;
+    uint64_t expires;  // absolute tick
+    void* owner;
+  };
+
+  TimerWheel();
+  TimerWheel(const TimerWheel&) = delete;
+  ~TimerWheel();
+
+  TimerWheel& operator=(const TimerWheel&) = delete;
+
+  int fd() const { return timerfd; }
+  uint64_t now() const { return current; }
+
+  /* ticks is a duration; the entry expires no earlier than that many full
+   * ticks from now */
+  void schedule(Entry& e, uint64_t ticks);
+  void touch(Entry& e, uint64_t ticks) { e.expires = current + ticks + 1; }
+  void cancel(Entry& e) { e.unlink(); }
+
+  /* consumes the timerfd's expirations, advances the wheel and appends the
+   * owners of every expired entry to 'expired' (already unlinked) */
+  void advance(std::vector<void*>& expired);
+
+ private:
+  void link(Entry& e);
+
+  int timerfd;
+  uint64_t current;
+  Entry slots[WHEEL_SLOTS];  // list heads; only prev/next are used
+};
+
+#endif // TIMER_HPP
@@ -0,0 +1,128 @@
+#include "trace.hpp"
+#include "file.hpp"
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#ifdef TRACING
+
+uint64_t trace_now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+/* nanoseconds as the microseconds Chrome traces count in */
+static void append_micros(std::string& out, uint64_t ns) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%llu.%03llu",
+           static_cast<unsigned long long>(ns / 1000),
+           static_cast<unsigned long long>(ns % 1000));
+  out += buf;
+}
+
+void TraceRing::render(std::string& out, long pid) const {
+  uint64_t end = done.load(std::memory_order_acquire);
+  uint64_t begin = end > TRACE_EVENTS ? end - TRACE_EVENTS : 0;
+
+  struct Copy {
+    const char* name;
+    uint64_t start;
+    uint64_t duration;
+    const char* key;
+    int64_t value;
+  };
+  std::vector<Copy> copies;
+  copies.reserve(end - begin);
+  for (uint64_t i = begin; i < end; i++) {
+    const Event& e = events[i % TRACE_EVENTS];
+    copies.push_back(Copy{e.name.load(std::memory_order_relaxed),
+                          e.start.load(std::memory_order_relaxed),
+                          e.duration.load(std::memory_order_relaxed),
+                          e.key.load(std::memory_order_relaxed),
+                          e.value.load(std::memory_order_relaxed)});
+  }
+
+  /* an event whose slot the thread has started to reuse since may be half
+   * old and half new */
+  std::atomic_thread_fence(std::memory_order_acquire);
+  uint64_t reused = started.load(std::memory_order_relaxed);
+  uint64_t first = reused > TRACE_EVENTS ? reused - TRACE_EVENTS : 0;
+
+  std::string ids = ",\"pid\":" + std::to_string(pid) +
+                    ",\"tid\":" + std::to_string(tid);
+  for (uint64_t i = std::max(begin, first); i < end; i++) {
+    const Copy& c = copies[i - begin];
+    out += "{\"name\":\"";
+    out += c.name;
+    if (c.duration == UINT64_MAX) {
+      out += "\",\"ph\":\"i\",\"s\":\"t\",\"ts\":";
+      append_micros(out, c.start);
+    } else {
+      out += "\",\"ph\":\"X\",\"ts\":";
+      append_micros(out, c.start);
+      out += ",\"dur\":";
+      append_micros(out, c.duration);
+    }
+    out += ids;
+    out += ",\"args\":{\"";
+    out += c.key;
+    out += "\":" + std::to_string(c.value) + "}},\n";
+  }
+}
+
+/* Every thread's ring, in the order they were first asked for. The lock
+ * is only taken to register a thread and to render, never to record. */
+static std::mutex registry_lock;
+static std::vector<std::unique_ptr<TraceRing>> registry;
+
+TraceRing& thread_trace() {
+  static thread_local TraceRing* mine = nullptr;
+  if (mine == nullptr) {
+    std::lock_guard<std::mutex> guard{registry_lock};
+    registry.emplace_back(new TraceRing{syscall(SYS_gettid)});
+    mine = registry.back().get();
+  }
+  return *mine;
+}
+
+bool tracing_built() {
+  return true;
+}
+
+#else
+
+bool tracing_built() {
+  return false;
+}
+
+#endif // TRACING
+
+std::string render_trace() {
+  std::string out = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+#ifdef TRACING
+  {
+    std::lock_guard<std::mutex> guard{registry_lock};
+    for (auto& ring : registry) {
+      ring->render(out, getpid());
+    }
+  }
+#endif
+  if (out.back() == '\n' && out[out.size() - 2] == ',') {
+    out.erase(out.size() - 2, 1);  // JSON wants no comma after the last
+  }
+  out += "]}\n";
+  return out;
+}
+
+void dump_trace(const std::string& path) {
+  std::string text = render_trace();
+  FileDescriptor::create_w(path).write_all(text);
+}
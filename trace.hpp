@@ -0,0 +1,128 @@
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#define TRACE_EVENTS 16384  // kept per thread; the newest overwrite the oldest
+
+/* Tracepoints, for finding out where an upload's time went: accepting,
+ * waiting on the socket, reading it, writing the file, or timing out.
+ *
+ * They only exist in a build made with `make -B TRACE=1` (which defines
+ * TRACING). Anywhere else TRACE_SCOPE() and friends expand to nothing,
+ * arguments and all, so the hot path is exactly what it was without them.
+ *
+ *   TRACE_SCOPE(name, key, value)   a span from here to the end of the
+ *                                   enclosing block, with one argument
+ *   TRACE_ARG(value)                changes that argument (say, to the
+ *                                   bytes a read brought) before it ends
+ *   TRACE_EVENT(name, key, value)   a single point in time
+ *
+ * name and key must be string literals (only the pointers are kept). Each
+ * thread records into a ring of its own without taking a lock, and
+ * render_trace() turns every ring into Chrome trace JSON, which
+ * chrome://tracing and ui.perfetto.dev both open. */
+
+#ifdef TRACING
+
+#define TRACE_SCOPE(name, key, value) TraceSpan trace_span(name, key, value)
+#define TRACE_ARG(value) trace_span.arg(value)
+#define TRACE_EVENT(name, key, value) trace_instant(name, key, value)
+
+/* nanoseconds on the monotonic clock */
+uint64_t trace_now();
+
+/* One thread's events. Only its own thread ever writes, so recording is a
+ * handful of relaxed stores; a reader can copy the ring at any time and
+ * tells from the two counters which events were overwritten while it
+ * copied them, seqlock style. */
+class TraceRing {
+ public:
+  explicit TraceRing(long tid) : tid(tid), started(0), done(0) {}
+  TraceRing(const TraceRing&) = delete;
+
+  TraceRing& operator=(const TraceRing&) = delete;
+
+  void record(const char* name, uint64_t start, uint64_t duration,
+              const char* key, int64_t value) {
+    uint64_t n = done.load(std::memory_order_relaxed);
+    started.store(n + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    Event& e = events[n % TRACE_EVENTS];
+    e.name.store(name, std::memory_order_relaxed);
+    e.start.store(start, std::memory_order_relaxed);
+    e.duration.store(duration, std::memory_order_relaxed);
+    e.key.store(key, std::memory_order_relaxed);
+    e.value.store(value, std::memory_order_relaxed);
+    done.store(n + 1, std::memory_order_release);
+  }
+
+  /* appends this ring's events to out as JSON objects, each one followed by
+   * a comma */
+  void render(std::string& out, long pid) const;
+
+ private:
+  struct Event {
+    std::atomic<const char*> name;
+    std::atomic<uint64_t> start;
+    std::atomic<uint64_t> duration;  // UINT64_MAX for an instant
+    std::atomic<const char*> key;
+    std::atomic<int64_t> value;
+  };
+
+  long tid;
+  std::atomic<uint64_t> started;  // events begun, ever
+  std::atomic<uint64_t> done;     // ...and finished
+  Event events[TRACE_EVENTS];
+};
+
+/* this thread's ring, created the first time it records; like its metrics,
+ * it outlives the thread */
+TraceRing& thread_trace();
+
+class TraceSpan {
+ public:
+  TraceSpan(const char* name, const char* key, int64_t value)
+      : name(name), key(key), value(value), start(trace_now()) {}
+  TraceSpan(const TraceSpan&) = delete;
+  ~TraceSpan() {
+    thread_trace().record(name, start, trace_now() - start, key, value);
+  }
+
+  TraceSpan& operator=(const TraceSpan&) = delete;
+
+  void arg(int64_t v) { value = v; }
+
+ private:
+  const char* name;
+  const char* key;
+  int64_t value;
+  uint64_t start;
+};
+
+inline void trace_instant(const char* name, const char* key, int64_t value) {
+  thread_trace().record(name, trace_now(), UINT64_MAX, key, value);
+}
+
+#else
+
+#define TRACE_SCOPE(name, key, value) do {} while (0)
+#define TRACE_ARG(value) do {} while (0)
+#define TRACE_EVENT(name, key, value) do {} while (0)
+
+#endif // TRACING
+
+/* whether this build has tracepoints at all */
+bool tracing_built();
+
+/* every thread's events as a Chrome trace; empty of events unless
+ * tracing_built() */
+std::string render_trace();
+
+/* render_trace() into a file at path, replacing it */
+void dump_trace(const std::string& path);
+
+#endif // TRACE_HPP
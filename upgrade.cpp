@@ -0,0 +1,253 @@
+#include "upgrade.hpp"
+
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <new>
+#include <stdexcept>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2,
+              "a counter shared between processes has to be lock-free");
+
+static struct sockaddr_un unix_address(const std::string& path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    throw std::runtime_error{"upgrade socket path too long: " + path};
+  }
+  strcpy(addr.sun_path, path.c_str());
+  return addr;
+}
+
+SharedCounter::SharedCounter(int fd) {
+  bool fresh = fd == -1;
+  if (fresh) {
+    fd = memfd_create("accio-next-id", MFD_CLOEXEC);
+    if (fd == -1) {
+      throw std::runtime_error{"memfd_create(): " +
+                               std::string{strerror(errno)}};
+    }
+  }
+  memfd = FileDescriptor::adopt(fd);
+
+  if (fresh && ftruncate(fd, sizeof(std::atomic<int>)) == -1) {
+    throw std::runtime_error{"ftruncate(): " + std::string{strerror(errno)}};
+  }
+  void* addr = mmap(nullptr, sizeof(std::atomic<int>), PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fd, 0);
+  if (addr == MAP_FAILED) {
+    throw std::runtime_error{"mmap(): " + std::string{strerror(errno)}};
+  }
+
+  /* ids count from 1; a counter handed over already holds the next one */
+  value = fresh ? new (addr) std::atomic<int>{1}
+                : static_cast<std::atomic<int>*>(addr);
+}
+
+SharedCounter::~SharedCounter() {
+  munmap(value, sizeof(std::atomic<int>));
+}
+
+UpgradeSocket::UpgradeSocket(const std::string& path, const Handoff& handoff,
+                             std::function<void()> drain)
+    : path(path), handoff(handoff), drain(drain),
+      wakeup(FileDescriptor::eventfd()) {
+  struct sockaddr_un addr = unix_address(path);
+
+  sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sockfd == -1) {
+    throw std::runtime_error{"socket(): " + std::string{strerror(errno)}};
+  }
+
+  /* the old server's, if we just took over from one, or a file left behind
+   * by a server that didn't get to clean up */
+  unlink(path.c_str());
+  struct stat st;
+  if (bind(sockfd, reinterpret_cast<struct sockaddr*>(&addr),
+           sizeof(addr)) == -1 ||
+      listen(sockfd, 1) == -1 || stat(path.c_str(), &st) == -1) {
+    std::string err{strerror(errno)};
+    close(sockfd);
+    throw std::runtime_error{"bind(" + path + "): " + err};
+  }
+  inode = st.st_ino;
+
+  thread = std::thread{&UpgradeSocket::serve, this};
+}
+
+UpgradeSocket::~UpgradeSocket() {
+  uint64_t one = 1;
+  if (write(wakeup.raw(), &one, sizeof(one)) == -1) {
+    std::cerr << "ERROR: write(eventfd): " << strerror(errno) << std::endl;
+  }
+  thread.join();
+  close(sockfd);
+
+  struct stat st;
+  if (stat(path.c_str(), &st) == 0 && st.st_ino == inode) {
+    unlink(path.c_str());
+  }
+}
+
+void UpgradeSocket::serve() {
+  struct pollfd fds[2] = {{sockfd, POLLIN, 0}, {wakeup.raw(), POLLIN, 0}};
+
+  while (true) {
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      std::cerr << "ERROR: poll(): " << strerror(errno) << std::endl;
+      return;
+    }
+    if (fds[1].revents & POLLIN) {
+      return;
+    }
+
+    int client = accept4(sockfd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (client == -1) {
+      continue;
+    }
+    bool handed = hand_over(client);
+    close(client);
+    if (handed) {
+      drain();
+      return;
+    }
+    std::cerr << "WARNING: upgrade abandoned by the new server; "
+              << "carrying on" << std::endl;
+  }
+}
+
+/* sends the descriptors and waits for the new server to say it's accepting;
+ * false if it goes away first (or we're being destroyed) */
+bool UpgradeSocket::hand_over(int client) {
+  char head[sizeof(UPGRADE_MAGIC) - 1 + sizeof(uint32_t)];
+  uint32_t count = handoff.listeners.size();
+  memcpy(head, UPGRADE_MAGIC, sizeof(UPGRADE_MAGIC) - 1);
+  memcpy(head + sizeof(UPGRADE_MAGIC) - 1, &count, sizeof(count));
+
+  std::vector<int> fds{handoff.listeners};
+  fds.push_back(handoff.counter);
+  std::vector<char> control(CMSG_SPACE(fds.size() * sizeof(int)));
+
+  struct iovec iov = {head, sizeof(head)};
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.data();
+  msg.msg_controllen = control.size();
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(fds.size() * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), fds.data(), fds.size() * sizeof(int));
+
+  if (sendmsg(client, &msg, MSG_NOSIGNAL) != sizeof(head)) {
+    std::cerr << "ERROR: sendmsg(): " << strerror(errno) << std::endl;
+    return false;
+  }
+
+  struct pollfd pfds[2] = {{client, POLLIN, 0}, {wakeup.raw(), POLLIN, 0}};
+  while (poll(pfds, 2, -1) == -1) {
+    if (errno != EINTR) {
+      return false;
+    }
+  }
+  if (pfds[1].revents & POLLIN) {
+    return false;
+  }
+  char ack;
+  return recv(client, &ack, 1, 0) == 1;
+}
+
+Takeover::Takeover(const std::string& path) : sockfd(-1) {
+  struct sockaddr_un addr = unix_address(path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    throw std::runtime_error{"socket(): " + std::string{strerror(errno)}};
+  }
+  if (connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) ==
+      -1) {
+    int err = errno;
+    close(fd);
+    if (err == ENOENT || err == ECONNREFUSED) {
+      return;  // nobody to take over from: a fresh start
+    }
+    throw std::runtime_error{"connect(" + path + "): " +
+                             std::string{strerror(err)}};
+  }
+  sockfd = fd;
+
+  char head[sizeof(UPGRADE_MAGIC) - 1 + sizeof(uint32_t)];
+  char control[CMSG_SPACE((UPGRADE_MAX_LISTENERS + 1) * sizeof(int))];
+  struct iovec iov = {head, sizeof(head)};
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  ssize_t n;
+  do {
+    n = recvmsg(sockfd, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+  } while (n == -1 && errno == EINTR);
+  if (n == -1) {
+    throw std::runtime_error{"recvmsg(): " + std::string{strerror(errno)}};
+  }
+
+  std::vector<int> fds;
+  for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      const int* data = reinterpret_cast<const int*>(CMSG_DATA(cmsg));
+      fds.insert(fds.end(), data, data + count);
+    }
+  }
+
+  uint32_t count;
+  memcpy(&count, head + sizeof(UPGRADE_MAGIC) - 1, sizeof(count));
+  if (n != sizeof(head) ||
+      memcmp(head, UPGRADE_MAGIC, sizeof(UPGRADE_MAGIC) - 1) != 0 ||
+      (msg.msg_flags & MSG_CTRUNC) || count == 0 ||
+      fds.size() != count + 1) {
+    for (int fd : fds) {
+      close(fd);
+    }
+    throw std::runtime_error{"bad handoff from the server at " + path};
+  }
+  taken.listeners.assign(fds.begin(), fds.end() - 1);
+  taken.counter = fds.back();
+}
+
+Takeover::~Takeover() {
+  if (sockfd != -1) {
+    close(sockfd);
+  }
+}
+
+void Takeover::accepting() {
+  if (sockfd == -1) {
+    return;
+  }
+  char ack = 1;
+  if (send(sockfd, &ack, 1, MSG_NOSIGNAL) != 1) {
+    std::cerr << "ERROR: send(): " << strerror(errno) << std::endl;
+  }
+  close(sockfd);
+  sockfd = -1;
+}
@@ -0,0 +1,113 @@
+#ifndef UPGRADE_HPP
+#define UPGRADE_HPP
+
+#include "file.hpp"
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define UPGRADE_MAGIC "\x7f" "ACCIOUP"  // 8 bytes, first of the handoff
+#define UPGRADE_MAX_LISTENERS 64
+
+/* Hot upgrades: a new server started with the same -u path as a running one
+ * takes over its listening sockets instead of binding the port, and the old
+ * one stops accepting and lets the uploads it has in hand finish before it
+ * exits. The sockets never close, so clients never find the port shut; the
+ * ones that connect while neither server is accepting just wait in the
+ * listen backlog.
+ *
+ * The handoff goes over a Unix-domain socket at the -u path, as SCM_RIGHTS:
+ *
+ *   old -> new   UPGRADE_MAGIC, the number of listening sockets (4 bytes,
+ *                host order), and the sockets themselves followed by the
+ *                connection counter (see SharedCounter)
+ *   new -> old   one byte, once the new server is set up and about to
+ *                accept; only then does the old one start draining
+ *
+ * If the new server dies before it gets that far, the old one notices the
+ * connection close and carries on as if nothing had happened. */
+
+/* descriptors handed from one server to the next; whoever receives them
+ * owns them */
+struct Handoff {
+  Handoff() : counter(-1) {}
+
+  std::vector<int> listeners;  // one per shard; empty if nothing came
+  int counter;                 // a SharedCounter's memfd, or -1
+};
+
+/* The next connection id, kept in a memfd rather than in the server, so an
+ * upgrade can hand over the counter itself instead of a snapshot of it.
+ * Both servers draw ids from it for as long as they overlap, so an upload
+ * the old one accepts at the last moment can't get the same id (and so the
+ * same file) as one the new one accepts. */
+class SharedCounter {
+ public:
+  /* adopts a counter handed over by another server, or with fd -1 starts a
+   * new one at 1 */
+  explicit SharedCounter(int fd = -1);
+  SharedCounter(const SharedCounter&) = delete;
+  ~SharedCounter();
+
+  SharedCounter& operator=(const SharedCounter&) = delete;
+
+  int next() { return value->fetch_add(1); }
+  int fd() const { return memfd.raw(); }
+
+ private:
+  FileDescriptor memfd;
+  std::atomic<int>* value;  // mapped shared from memfd
+};
+
+/* The old server's end: listens at path, and when a new server connects,
+ * hands it the descriptors and, once it's accepting, calls drain. Serves a
+ * single successful handoff from a thread of its own, and removes the
+ * socket file when destroyed unless a newer server has bound its own. */
+class UpgradeSocket {
+ public:
+  UpgradeSocket(const std::string& path, const Handoff& handoff,
+                std::function<void()> drain);
+  UpgradeSocket(const UpgradeSocket&) = delete;
+  ~UpgradeSocket();
+
+  UpgradeSocket& operator=(const UpgradeSocket&) = delete;
+
+ private:
+  void serve();
+  bool hand_over(int client);
+
+  std::string path;
+  int sockfd;
+  ino_t inode;  // of the socket file we bound
+  Handoff handoff;
+  std::function<void()> drain;
+  FileDescriptor wakeup;  // eventfd, becomes readable on destruction
+  std::thread thread;
+};
+
+/* The new server's end: if a server is listening at path, takes over its
+ * descriptors; handoff() is left empty if there's nobody there. */
+class Takeover {
+ public:
+  explicit Takeover(const std::string& path);
+  Takeover(const Takeover&) = delete;
+  ~Takeover();
+
+  Takeover& operator=(const Takeover&) = delete;
+
+  const Handoff& handoff() const { return taken; }
+
+  /* tells the old server the new one is about to accept, so it can drain */
+  void accepting();
+
+ private:
+  int sockfd;  // -1 if there was nobody to take over from
+  Handoff taken;
+};
+
+#endif // UPGRADE_HPP
@@ -0,0 +1,314 @@
+#include "uring.hpp"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <vector>
+
+static int io_uring_setup(unsigned entries, struct io_uring_params* p) {
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                          unsigned flags) {
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                 nullptr, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, const void* arg,
+                             unsigned nr_args) {
+  return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+Ring::Ring(unsigned entries)
+    : sq_ring(MAP_FAILED), cq_ring(MAP_FAILED), sqes(nullptr),
+      sqe_tail(0) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER |
+            IORING_SETUP_DEFER_TASKRUN;
+  p.cq_entries = entries * 4;
+
+  ringfd = io_uring_setup(entries, &p);
+  if (ringfd == -1 && errno == EINVAL) {
+    /* pre-6.1 kernels don't know the task running flags */
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4;
+    ringfd = io_uring_setup(entries, &p);
+  }
+  if (ringfd == -1) {
+    /* ENOSYS on old kernels, EPERM when kernel.io_uring_disabled is set */
+    throw uring_unsupported{"io_uring_setup(): " +
+                            std::string{strerror(errno)}};
+  }
+  features = p.features;
+  if (!(features & IORING_FEAT_SINGLE_MMAP)) {
+    close(ringfd);
+    throw uring_unsupported{"kernel predates IORING_FEAT_SINGLE_MMAP"};
+  }
+
+  sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (cq_ring_len > sq_ring_len) {
+    sq_ring_len = cq_ring_len;
+  }
+  sq_ring = mmap(nullptr, sq_ring_len, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQ_RING);
+  if (sq_ring == MAP_FAILED) {
+    close(ringfd);
+    throw std::runtime_error{"mmap(SQ_RING): " + std::string{strerror(errno)}};
+  }
+  cq_ring = sq_ring;  // one mapping covers both rings
+
+  sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  void* s = mmap(nullptr, sqes_len, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQES);
+  if (s == MAP_FAILED) {
+    munmap(sq_ring, sq_ring_len);
+    close(ringfd);
+    throw std::runtime_error{"mmap(SQES): " + std::string{strerror(errno)}};
+  }
+  sqes = static_cast<struct io_uring_sqe*>(s);
+
+  char* sq = static_cast<char*>(sq_ring);
+  sq_head = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+  sq_tail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+  sq_mask = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+  sq_entries = p.sq_entries;
+  sqe_tail = *sq_tail;
+
+  /* SQEs are always used in order, so the indirection array is identity */
+  unsigned* array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+  for (unsigned i = 0; i < sq_entries; i++) {
+    array[i] = i;
+  }
+
+  char* cq = static_cast<char*>(cq_ring);
+  cq_head = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+  cq_tail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+  cq_mask = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+  cqes = reinterpret_cast<struct io_uring_cqe*>(cq + p.cq_off.cqes);
+}
+
+Ring::~Ring() {
+  munmap(sqes, sqes_len);
+  munmap(sq_ring, sq_ring_len);
+  close(ringfd);
+}
+
+struct io_uring_sqe* Ring::sqe() {
+  unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+  if (sqe_tail - head >= sq_entries) {
+    submit(0);
+    head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    if (sqe_tail - head >= sq_entries) {
+      throw std::runtime_error{"io_uring: submission queue overflow"};
+    }
+  }
+
+  struct io_uring_sqe* e = &sqes[sqe_tail & sq_mask];
+  memset(e, 0, sizeof(*e));
+  sqe_tail++;
+  return e;
+}
+
+void Ring::submit(unsigned wait_nr) {
+  __atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+
+  /* with DEFER_TASKRUN completions are only posted from inside enter, so
+   * always ask for them */
+  unsigned flags = IORING_ENTER_GETEVENTS;
+
+  while (true) {
+    unsigned to_submit = sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    if (io_uring_enter(ringfd, to_submit, wait_nr, flags) >= 0) {
+      return;
+    }
+
+    switch (errno) {
+      case EINTR:
+        continue;
+      case EAGAIN:
+      case EBUSY:
+        /* out of resources for new requests; reap some completions first */
+        return;
+      default:
+        throw std::runtime_error{"io_uring_enter(): " +
+                                 std::string{strerror(errno)}};
+    }
+  }
+}
+
+struct io_uring_cqe* Ring::peek() {
+  unsigned head = *cq_head;
+  if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+    return nullptr;
+  }
+  return &cqes[head & cq_mask];
+}
+
+void Ring::seen() {
+  __atomic_store_n(cq_head, *cq_head + 1, __ATOMIC_RELEASE);
+}
+
+void Ring::register_files(unsigned n) {
+  struct io_uring_rsrc_register reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.nr = n;
+  reg.flags = IORING_RSRC_REGISTER_SPARSE;
+
+  if (io_uring_register(ringfd, IORING_REGISTER_FILES2, &reg,
+                        sizeof(reg)) == -1) {
+    throw uring_unsupported{"IORING_REGISTER_FILES2: " +
+                            std::string{strerror(errno)}};
+  }
+}
+
+bool Ring::supports(unsigned opcode) {
+  size_t len = sizeof(struct io_uring_probe) +
+               256 * sizeof(struct io_uring_probe_op);
+  std::vector<char> buf(len, 0);
+  struct io_uring_probe* probe =
+      reinterpret_cast<struct io_uring_probe*>(buf.data());
+
+  if (io_uring_register(ringfd, IORING_REGISTER_PROBE, probe, 256) == -1) {
+    return false;
+  }
+  return opcode <= probe->last_op &&
+         (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED);
+}
+
+ProvidedBuffers::ProvidedBuffers(Ring& ring, unsigned count, unsigned size,
+                                 uint16_t group)
+    : ring(ring), count(count), bufsize(size), bgid(group), br(nullptr),
+      tail(0) {
+  void* b = mmap(nullptr, static_cast<size_t>(count) * size,
+                 PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (b == MAP_FAILED) {
+    throw std::runtime_error{"mmap(): " + std::string{strerror(errno)}};
+  }
+  base = static_cast<char*>(b);
+
+  try {
+    if (!register_ring()) {
+      provide_all();
+    }
+  } catch (std::runtime_error&) {
+    munmap(base, static_cast<size_t>(count) * size);
+    throw;
+  }
+}
+
+/* Registers a buffer ring for the group and fills it with every buffer;
+ * false if the kernel predates buffer rings (EINVAL). The ring goes in
+ * memory of its own, page aligned as the kernel wants it. */
+bool ProvidedBuffers::register_ring() {
+  size_t len = static_cast<size_t>(count) * sizeof(struct io_uring_buf);
+  void* r = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (r == MAP_FAILED) {
+    throw std::runtime_error{"mmap(): " + std::string{strerror(errno)}};
+  }
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = reinterpret_cast<uintptr_t>(r);
+  reg.ring_entries = count;
+  reg.bgid = bgid;
+  if (io_uring_register(ring.fd(), IORING_REGISTER_PBUF_RING, &reg, 1) ==
+      -1) {
+    int err = errno;
+    munmap(r, len);
+    if (err == EINVAL) {
+      return false;
+    }
+    throw uring_unsupported{"IORING_REGISTER_PBUF_RING: " +
+                            std::string{strerror(err)}};
+  }
+
+  br = static_cast<struct io_uring_buf_ring*>(r);
+  for (unsigned bid = 0; bid < count; bid++) {
+    give_back(bid);
+  }
+  return true;
+}
+
+/* hands the whole lot over at once with IORING_OP_PROVIDE_BUFFERS, and
+ * waits to hear that it worked since every recv depends on it */
+void ProvidedBuffers::provide_all() {
+  if (!ring.supports(IORING_OP_PROVIDE_BUFFERS)) {
+    throw uring_unsupported{"IORING_OP_PROVIDE_BUFFERS"};
+  }
+
+  struct io_uring_sqe* sqe = ring.sqe();
+  sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+  sqe->fd = count;
+  sqe->addr = reinterpret_cast<uintptr_t>(base);
+  sqe->len = bufsize;
+  sqe->off = 0;
+  sqe->buf_group = bgid;
+  sqe->user_data = 0;
+  ring.submit(1);
+
+  struct io_uring_cqe* cqe = ring.peek();
+  int res = cqe != nullptr ? cqe->res : -EAGAIN;
+  if (cqe != nullptr) {
+    ring.seen();
+  }
+  if (res < 0) {
+    throw uring_unsupported{"IORING_OP_PROVIDE_BUFFERS: " +
+                            std::string{strerror(-res)}};
+  }
+}
+
+ProvidedBuffers::~ProvidedBuffers() {
+  /* take back whatever the kernel still holds so no recv picks memory we
+   * are about to unmap */
+  if (br != nullptr) {
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.bgid = bgid;
+    io_uring_register(ring.fd(), IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    munmap(br, static_cast<size_t>(count) * sizeof(struct io_uring_buf));
+  } else {
+    struct io_uring_sqe* sqe = ring.sqe();
+    sqe->opcode = IORING_OP_REMOVE_BUFFERS;
+    sqe->fd = count;
+    sqe->buf_group = bgid;
+    sqe->user_data = 0;
+    try {
+      ring.submit(0);
+    } catch (std::runtime_error&) {
+    }
+  }
+
+  munmap(base, static_cast<size_t>(count) * bufsize);
+}
+
+void ProvidedBuffers::give_back(uint16_t bid) {
+  if (br != nullptr) {
+    /* the entry has to be filled in before the kernel can see the new tail,
+     * hence the release store */
+    struct io_uring_buf* buf = entry(tail & (count - 1));
+    buf->addr = reinterpret_cast<uintptr_t>(buffer(bid));
+    buf->len = bufsize;
+    buf->bid = bid;
+    tail++;
+    __atomic_store_n(&br->tail, tail, __ATOMIC_RELEASE);
+    return;
+  }
+
+  /* queued, not submitted: it goes in with the rest of the next batch */
+  struct io_uring_sqe* sqe = ring.sqe();
+  sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+  sqe->fd = 1;
+  sqe->addr = reinterpret_cast<uintptr_t>(buffer(bid));
+  sqe->len = bufsize;
+  sqe->off = bid;
+  sqe->buf_group = bgid;
+  sqe->user_data = 0;
+}
@@ -0,0 +1,115 @@
+#ifndef URING_HPP
+#define URING_HPP
+
+#include <linux/io_uring.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+#define URING_ENTRIES 1024  // submission queue; the completion queue is 4x
+
+/* the kernel can't do what we need; callers fall back to epoll */
+class uring_unsupported : public std::runtime_error {
+ public:
+  explicit uring_unsupported(const std::string& what)
+      : std::runtime_error{"io_uring unsupported: " + what} {}
+};
+
+/* A bare io_uring instance set up with the raw syscalls (we don't link
+ * liburing). Submission queue entries are handed out zeroed by sqe() and go
+ * to the kernel in batches on the next submit(); completions are consumed
+ * one at a time with peek() and seen(). */
+class Ring {
+ public:
+  explicit Ring(unsigned entries);
+  Ring(const Ring&) = delete;
+  ~Ring();
+
+  Ring& operator=(const Ring&) = delete;
+
+  int fd() const { return ringfd; }
+
+  /* a free SQE; submits what's queued if the submission queue is full */
+  struct io_uring_sqe* sqe();
+
+  /* submits everything queued and blocks until wait_nr completions are
+   * ready (wait_nr may be 0) */
+  void submit(unsigned wait_nr);
+
+  struct io_uring_cqe* peek();
+  void seen();
+
+  /* a table of n direct descriptors, all empty to begin with */
+  void register_files(unsigned n);
+  bool supports(unsigned opcode);
+
+ private:
+  int ringfd;
+  unsigned features;
+
+  void* sq_ring;
+  size_t sq_ring_len;
+  void* cq_ring;
+  size_t cq_ring_len;
+  struct io_uring_sqe* sqes;
+  size_t sqes_len;
+
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned sqe_tail;  // SQEs handed out, not yet published to the kernel
+
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe* cqes;
+};
+
+/* A group of provided buffers: the kernel picks one of them for each recv
+ * it completes and reports which one in the CQE, so idle connections don't
+ * tie any memory down. They're handed over in a buffer ring registered with
+ * the kernel (IORING_REGISTER_PBUF_RING), so handing one back is just an
+ * entry and a store to the ring's tail. Kernels before 5.19 don't have
+ * those and get IORING_OP_PROVIDE_BUFFERS instead, where handing a buffer
+ * back is itself an SQE. Those, like the ones issued on teardown, complete
+ * with user_data 0. */
+class ProvidedBuffers {
+ public:
+  /* count must be a power of two, as the buffer ring's size has to be */
+  ProvidedBuffers(Ring& ring, unsigned count, unsigned size, uint16_t group);
+  ProvidedBuffers(const ProvidedBuffers&) = delete;
+  ~ProvidedBuffers();
+
+  ProvidedBuffers& operator=(const ProvidedBuffers&) = delete;
+
+  uint16_t group() const { return bgid; }
+  unsigned size() const { return bufsize; }
+  char* buffer(uint16_t bid) { return base + static_cast<size_t>(bid) * bufsize; }
+
+  /* hands a buffer the kernel gave us back to it */
+  void give_back(uint16_t bid);
+
+ private:
+  bool register_ring();
+  void provide_all();
+
+  /* The ring's entries start at its base, its tail overlaid on the first
+   * one's reserved field. Not br->bufs: in C++ the kernel header's flexible
+   * array sits behind an empty struct, 8 bytes further in. */
+  struct io_uring_buf* entry(unsigned i) {
+    return reinterpret_cast<struct io_uring_buf*>(br) + i;
+  }
+
+  Ring& ring;
+  char* base;
+  unsigned count;
+  unsigned bufsize;
+  uint16_t bgid;
+  struct io_uring_buf_ring* br;  // null when provided by SQE instead
+  uint16_t tail;  // br's, as far as we've filled it in
+};
+
+#endif // URING_HPP
@@ -0,0 +1,112 @@
+#include "writer.hpp"
+#include "metrics.hpp"
+
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+WriteBehind::WriteBehind(FileDescriptor& file, bool direct)
+    : file(file), fill(0), offset(0), allocated(0), direct_io(false) {
+  if (direct) {
+    direct_io = file.set_direct(true);
+  }
+}
+
+WriteBehind::~WriteBehind() {
+  /* normally finish() or discard() has already run; this is for the event
+   * loop dropping its connections when the server stops */
+  try {
+    finish();
+  } catch (std::runtime_error& e) {
+    std::cerr << "ERROR: " << e.what() << std::endl;
+  }
+}
+
+void WriteBehind::write(const char* data, size_t len) {
+  while (len > 0) {
+    if (segments.empty() || fill == COALESCE_CHUNK) {
+      if (segments.size() == COALESCE_SEGMENTS) {
+        flush();
+      }
+      segments.push_back(write_buffers().borrow());
+      fill = 0;
+    }
+
+    size_t n = std::min(len, static_cast<size_t>(COALESCE_CHUNK) - fill);
+    memcpy(segments.back().data() + fill, data, n);
+    fill += n;
+    data += n;
+    len -= n;
+  }
+}
+
+void WriteBehind::spliced(size_t len) {
+  offset += len;
+  reserve(offset);
+}
+
+void WriteBehind::resync() {
+  flush();
+  offset = file.position();
+}
+
+/* writes out every buffered segment in one go and gives them back */
+void WriteBehind::flush() {
+  if (segments.empty()) {
+    return;
+  }
+
+  size_t len = (segments.size() - 1) * COALESCE_CHUNK + fill;
+  reserve(offset + len);
+
+  struct iovec iov[COALESCE_SEGMENTS];
+  for (size_t i = 0; i < segments.size(); i++) {
+    iov[i].iov_base = segments[i].data();
+    iov[i].iov_len = COALESCE_CHUNK;
+  }
+  iov[segments.size() - 1].iov_len = fill;
+
+  if (direct_io && fill % SLAB_ALIGN != 0) {
+    /* O_DIRECT only takes whole blocks; this is the tail of the upload */
+    file.set_direct(false);
+    direct_io = false;
+  }
+  Stopwatch timer;
+  file.pwritev_all(iov, segments.size(), offset);
+  thread_metrics().write_latency.record(timer.micros());
+
+  offset += len;
+  segments.clear();
+  fill = 0;
+}
+
+void WriteBehind::reserve(uint64_t end) {
+  if (end <= allocated) {
+    return;
+  }
+  uint64_t step = std::max<uint64_t>(PREALLOC_STEP, end - allocated);
+  file.preallocate(allocated, step);
+  allocated += step;
+}
+
+void WriteBehind::finish() {
+  flush();
+  if (allocated > offset) {
+    file.truncate(offset);  // hands back the blocks past the end
+    allocated = offset;
+  }
+}
+
+void WriteBehind::discard() {
+  segments.clear();
+  fill = 0;
+  offset = 0;
+  allocated = 0;
+  if (direct_io) {
+    file.set_direct(false);
+    direct_io = false;
+  }
+}
@@ -0,0 +1,65 @@
+#ifndef WRITER_HPP
+#define WRITER_HPP
+
+#include "file.hpp"
+#include "slab.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#define COALESCE_CHUNK 65536     // one pooled segment of write-behind data
+#define COALESCE_SEGMENTS 16     // segments gathered into one pwritev()
+#define PREALLOC_STEP (8 << 20)  // fallocate() this far ahead of the data
+
+/* The write-behind stage between a connection and its file.
+ *
+ * A client that trickles its upload in 2 KB segments used to cost a write()
+ * per segment and left the file in as many small pieces. Instead, received
+ * data is copied into pooled COALESCE_CHUNK segments and only goes to disk
+ * once COALESCE_SEGMENTS of them are full, as one pwritev() of aligned
+ * blocks. Segments are borrowed as data arrives, so a connection that has
+ * nothing buffered holds none. As the file grows its blocks are reserved
+ * PREALLOC_STEP at a time with fallocate(), and finish() trims whatever the
+ * upload didn't use.
+ *
+ * With direct set the full blocks bypass the page cache (O_DIRECT); the
+ * unaligned tail written by finish() goes through it as usual. Data that
+ * reaches the file by splice() never passes through here, but spliced()
+ * keeps the offset and the preallocation in step with it. */
+class WriteBehind {
+ public:
+  WriteBehind(FileDescriptor& file, bool direct);
+  WriteBehind(const WriteBehind&) = delete;
+  ~WriteBehind();
+
+  WriteBehind& operator=(const WriteBehind&) = delete;
+
+  void write(const char* data, size_t len);
+  void spliced(size_t len);
+
+  /* picks up the offset from the file after something else wrote to it */
+  void resync();
+
+  /* writes out everything buffered and gives back the unused preallocation */
+  void finish();
+
+  /* forgets everything buffered and turns O_DIRECT back off, so the file can
+   * be rewritten with plain writes */
+  void discard();
+
+  bool direct() const { return direct_io; }
+
+ private:
+  void flush();
+  void reserve(uint64_t end);
+
+  FileDescriptor& file;
+  std::vector<BufferPool::Buffer> segments;
+  size_t fill;         // bytes used in the last segment
+  uint64_t offset;     // where the first buffered byte goes in the file
+  uint64_t allocated;  // fallocate()d up to here
+  bool direct_io;
+};
+
+#endif // WRITER_HPP